@@ -6,8 +6,23 @@
 #include <algorithm>
 #include <sstream>
 #include <iomanip> 
+#include <fstream>
+#include <cstring>
+#include <unordered_map>
+#ifndef LABHELPER_NO_GL
 #include <GL/glew.h>
 #include <stb_image.h>
+#else
+///////////////////////////////////////////////////////////////////////////////
+// Without GL, labhelper.cpp (which holds the stb implementations) is not 
+// linked, so they go here instead. Textures and geometry then only live on 
+// the CPU. 
+///////////////////////////////////////////////////////////////////////////////
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+#endif
 
 namespace labhelper
 {
@@ -20,6 +35,7 @@ namespace labhelper
 			std::cout << "ERROR: loadModelFromOBJ(): Failed to load texture: " << filename << "\n";
 			exit(1);
 		}
+#ifndef LABHELPER_NO_GL
 		glGenTextures(1, &gl_id);
 		glBindTexture(GL_TEXTURE_2D, gl_id);
 		GLenum format, internal_format;
@@ -37,6 +53,7 @@ namespace labhelper
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
+#endif
 		return true; 
 	}
 
@@ -45,6 +62,7 @@ namespace labhelper
 	///////////////////////////////////////////////////////////////////////////
 	Model::~Model()
 	{
+#ifndef LABHELPER_NO_GL
 		for (auto & material : m_materials) {
 			if (material.m_color_texture.valid) glDeleteTextures(1, &material.m_color_texture.gl_id);
 			if (material.m_reflectivity_texture.valid) glDeleteTextures(1, &material.m_reflectivity_texture.gl_id);
@@ -56,6 +74,61 @@ namespace labhelper
 		glDeleteBuffers(1, &m_positions_bo);
 		glDeleteBuffers(1, &m_normals_bo);
 		glDeleteBuffers(1, &m_texture_coordinates_bo);
+#endif
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A vertex, as used when welding the vertex stream into indexed meshes
+	///////////////////////////////////////////////////////////////////////////
+	struct Vertex
+	{
+		glm::vec3 position;
+		glm::vec3 normal;
+		glm::vec2 texture_coordinate;
+		bool operator==(const Vertex & other) const
+		{
+			return position == other.position && normal == other.normal && 
+				texture_coordinate == other.texture_coordinate;
+		}
+	};
+
+	struct VertexHash
+	{
+		size_t operator()(const Vertex & v) const
+		{
+			// Adding 0 turns -0 into +0, so that equal vertices hash equally
+			float values[8] = { v.position.x + 0.0f, v.position.y + 0.0f, v.position.z + 0.0f,
+				v.normal.x + 0.0f, v.normal.y + 0.0f, v.normal.z + 0.0f,
+				v.texture_coordinate.x + 0.0f, v.texture_coordinate.y + 0.0f };
+			uint32_t bits[8];
+			memcpy(bits, values, sizeof(bits));
+			size_t hash = 2166136261u;
+			for (int i = 0; i < 8; i++) {
+				hash = (hash ^ bits[i]) * 16777619u;
+			}
+			return hash;
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Build the indexed version of a mesh from its part of the vertex stream
+	///////////////////////////////////////////////////////////////////////////
+	static void weldMesh(Model * model, Mesh & mesh)
+	{
+		mesh.m_start_indexed_vertex = uint32_t(model->m_indexed_positions.size());
+		std::unordered_map<Vertex, uint32_t, VertexHash> welded_vertices;
+		welded_vertices.reserve(mesh.m_number_of_vertices);
+		for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++) {
+			Vertex vertex = { model->m_positions[i], model->m_normals[i], model->m_texture_coordinates[i] };
+			auto inserted = welded_vertices.insert(std::make_pair(vertex, uint32_t(welded_vertices.size())));
+			if (inserted.second) {
+				model->m_indexed_positions.push_back(vertex.position);
+				model->m_indexed_normals.push_back(vertex.normal);
+				model->m_indexed_texture_coordinates.push_back(vertex.texture_coordinate);
+			}
+			model->m_indices.push_back(inserted.first->second);
+		}
+		mesh.m_number_of_indexed_vertices = uint32_t(welded_vertices.size());
 	}
 
 	Model * loadModelFromOBJ(std::string path)
@@ -263,6 +336,7 @@ namespace labhelper
 				// Finalize and push this mesh to the list
 				///////////////////////////////////////////////////////////////
 				mesh.m_number_of_vertices =	vertices_so_far - mesh.m_start_index;
+				weldMesh(model, mesh);
 				model->m_meshes.push_back(mesh);
 				finished_materials[current_material_index] = true; 
 			}
@@ -270,10 +344,12 @@ namespace labhelper
 				model->m_meshes.back().m_name = shape.name; 
 			}
 		}
+		model->m_indexed_positions.push_back(glm::vec3(0.0f));
 
 		///////////////////////////////////////////////////////////////////////
 		// Upload to GPU
 		///////////////////////////////////////////////////////////////////////
+#ifndef LABHELPER_NO_GL
 		glGenVertexArrays(1, &model->m_vaob);
 		glBindVertexArray(model->m_vaob);
 		glGenBuffers(1, &model->m_positions_bo);
@@ -294,6 +370,19 @@ namespace labhelper
 			&model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
 		glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
 		glEnableVertexAttribArray(2);
+#endif
+
+		///////////////////////////////////////////////////////////////////////
+		// The vertex stream was only needed to weld the meshes and upload 
+		// them to the GPU. On the CPU we keep just the indexed meshes. 
+		///////////////////////////////////////////////////////////////////////
+		std::vector<glm::vec3>().swap(model->m_positions);
+		std::vector<glm::vec3>().swap(model->m_normals);
+		std::vector<glm::vec2>().swap(model->m_texture_coordinates);
+		model->m_indices.shrink_to_fit();
+		model->m_indexed_positions.shrink_to_fit();
+		model->m_indexed_normals.shrink_to_fit();
+		model->m_indexed_texture_coordinates.shrink_to_fit();
 
 		std::cout << "done.\n";
 		return model; 
@@ -374,32 +463,37 @@ namespace labhelper
 			obj_file << "o " << mesh.m_name << "\n";
 			obj_file << "g " << mesh.m_name << "\n";
 			obj_file << "usemtl " << model->m_materials[mesh.m_material_idx].m_name << "\n";
-			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			// The welded vertices of the mesh, and the faces that index them
+			const uint32_t start = mesh.m_start_indexed_vertex;
+			const uint32_t end = start + mesh.m_number_of_indexed_vertices;
+			for (uint32_t i = start; i < end; i++)
 			{
-				obj_file << "v " << model->m_positions[i].x << " "
-					<< model->m_positions[i].y << " "
-					<< model->m_positions[i].z << "\n";
+				obj_file << "v " << model->m_indexed_positions[i].x << " "
+					<< model->m_indexed_positions[i].y << " "
+					<< model->m_indexed_positions[i].z << "\n";
 			}
-			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			for (uint32_t i = start; i < end; i++)
 			{
-				obj_file << "vn " << model->m_normals[i].x << " "
-					<< model->m_normals[i].y << " "
-					<< model->m_normals[i].z << "\n";
+				obj_file << "vn " << model->m_indexed_normals[i].x << " "
+					<< model->m_indexed_normals[i].y << " "
+					<< model->m_indexed_normals[i].z << "\n";
 			}
-			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			for (uint32_t i = start; i < end; i++)
 			{
-				obj_file << "vt " << model->m_texture_coordinates[i].x << " "
-					<< model->m_texture_coordinates[i].y << "\n";
+				obj_file << "vt " << model->m_indexed_texture_coordinates[i].x << " "
+					<< model->m_indexed_texture_coordinates[i].y << "\n";
 			}
 			int number_of_faces = mesh.m_number_of_vertices / 3; 
 			for (int i = 0; i < number_of_faces; i++)
 			{
-				obj_file << "f " 
-					<< vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-					<< vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-					<< vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-				vertex_counter += 3; 
+				obj_file << "f";
+				for (int j = 0; j < 3; j++) {
+					int v = vertex_counter + int(model->m_indices[mesh.m_start_index + i * 3 + j]);
+					obj_file << " " << v << "/" << v << "/" << v;
+				}
+				obj_file << "\n";
 			}
+			vertex_counter += mesh.m_number_of_indexed_vertices;
 		}
 	}
 
@@ -410,6 +504,7 @@ namespace labhelper
 		if(model != nullptr) delete model; 
 	}
 
+#ifndef LABHELPER_NO_GL
 	///////////////////////////////////////////////////////////////////////
 	// Loop through all Meshes in the Model and render them
 	///////////////////////////////////////////////////////////////////////
@@ -455,4 +550,5 @@ namespace labhelper
 			glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
 		}
 	}
+#endif
 }
@@ -46,6 +46,9 @@ namespace labhelper
 		// Where this Mesh's vertices start
 		uint32_t m_start_index; 
 		uint32_t m_number_of_vertices;
+		// Where this Mesh's welded vertices start (see Model::m_indices)
+		uint32_t m_start_indexed_vertex;
+		uint32_t m_number_of_indexed_vertices;
 	};
 
 	class Model
@@ -60,10 +63,23 @@ namespace labhelper
 		std::vector<Material> m_materials; 
 		// A model will contain one or more "Meshes"
 		std::vector<Mesh> m_meshes; 
-		// Buffers on CPU
+		// Buffers on CPU, one vertex per triangle corner. Only used while 
+		// loading (to weld the meshes and upload them to the GPU), and empty 
+		// after loadModelFromOBJ() returns. 
 		std::vector<glm::vec3> m_positions;
 		std::vector<glm::vec3> m_normals;
 		std::vector<glm::vec2> m_texture_coordinates; 
+		// The same meshes as an indexed triangle list, where vertices with 
+		// the same position, normal and texture coordinate are only stored 
+		// once (used for raytracing and saving). Index i belongs to vertex 
+		// i of the stream above, and indexes the mesh's own range of welded
+		// vertices starting at m_start_indexed_vertex. m_indexed_positions 
+		// has one extra (unused) element at the end, so that the last 
+		// position can be read with a 16 byte load. 
+		std::vector<uint32_t> m_indices;
+		std::vector<glm::vec3> m_indexed_positions;
+		std::vector<glm::vec3> m_indexed_normals;
+		std::vector<glm::vec2> m_indexed_texture_coordinates;
 		// Buffers on GPU
 		uint32_t m_positions_bo;
 		uint32_t m_normals_bo;
@@ -1,21 +1,293 @@
 #include "HDRImage.h"
+#include "sampling.h"
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <sys/stat.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HDR_USE_SSE
+#endif
 
-using namespace std; 
-using namespace glm; 
+using namespace std;
+using namespace glm;
+using pathtracer::buildAliasTable;
+using pathtracer::sampleAliasTable;
+
+#define HDR_PI 3.14159265359f
+
+// The largest octahedral map made from an image (and accepted from a cache)
+static const int max_octahedral_size = 16384;
+
+///////////////////////////////////////////////////////////////////////////
+// Bilinear lookup in a latitude-longitude float image (u = phi / 2pi,
+// v = theta / pi), only used when converting it to an octahedral map
+///////////////////////////////////////////////////////////////////////////
+static vec3 sampleLatLong(const float * data, int width, int height, const vec3 & d)
+{
+	const float theta = acos(std::max(-1.0f, std::min(1.0f, d.y)));
+	float phi = atan2(d.z, d.x);
+	if (phi < 0.0f) phi = phi + 2.0f * HDR_PI;
+	const float x = phi / (2.0f * HDR_PI) * float(width) - 0.5f;
+	const float y = theta / HDR_PI * float(height) - 0.5f;
+	const float fx = floor(x), fy = floor(y);
+	const float tx = x - fx, ty = y - fy;
+	const int x0 = ((int(fx) % width) + width) % width, x1 = (x0 + 1) % width;
+	const int y0 = std::max(0, int(fy)), y1 = std::min(int(fy) + 1, height - 1);
+	auto texel = [&](int x, int y) {
+		const float * c = &data[(size_t(y) * width + x) * 3];
+		return vec3(c[0], c[1], c[2]);
+	};
+	return mix(mix(texel(x0, y0), texel(x1, y0), tx), mix(texel(x0, y1), texel(x1, y1), tx), ty);
+}
 
 void HDRImage::load(const string & filename) {
+	if (loadCache(filename)) {
+		buildDistribution();
+		return;
+	}
 	stbi_set_flip_vertically_on_load(false);
-	data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
+	float * data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
 	stbi_set_flip_vertically_on_load(true);
 	if (data == NULL) {
 		std::cout << "Failed to load image: " << filename << ".\n";
 		exit(1);
 	}
+	///////////////////////////////////////////////////////////////////////
+	// Convert to an octahedral map with about the same resolution at the
+	// horizon (a power of two, so that every mip level is an octahedral
+	// map too), averaging 2x2 samples per texel
+	///////////////////////////////////////////////////////////////////////
+	size = 16;
+	while (size * 3 < width * 2 && size < max_octahedral_size) size *= 2;
+	vector<float> octahedral(size_t(size) * size * 3);
+#pragma omp parallel for
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			vec3 color(0.0f);
+			for (int s = 0; s < 4; s++) {
+				vec2 uv = vec2(float(x) + 0.25f + 0.5f * float(s & 1), float(y) + 0.25f + 0.5f * float(s >> 1)) / float(size);
+				color += 0.25f * sampleLatLong(data, width, height, octahedralToDirection(uv));
+			}
+			memcpy(&octahedral[(size_t(y) * size + x) * 3], &color.x, sizeof(vec3));
+		}
+	}
+	stbi_image_free(data);
+	mipmap.build(octahedral.data(), size, size, MipMap::WRAP_OCTAHEDRAL, MipMap::WRAP_OCTAHEDRAL);
+	buildDistribution();
+	saveCache(filename);
 };
 
-vec3 HDRImage::sample(float u, float v) {
-	int x = int(u * width) % width;
-	int y = int(v * height) % height;
-	return vec3(data[(y * width + x) * 3 + 0], data[(y * width + x) * 3 + 1], data[(y * width + x) * 3 + 2]);
-}
\ No newline at end of file
+///////////////////////////////////////////////////////////////////////////
+// The octahedral mapping. Directions are projected onto the octahedron
+// |x| + |y| + |z| = 1, whose upper half is seen from above and whose lower
+// half is folded out over the corners of the square.
+///////////////////////////////////////////////////////////////////////////
+static inline float signNotZero(float v)
+{
+	return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+vec2 HDRImage::directionToOctahedral(const vec3 & d)
+{
+	const float inv_l1 = 1.0f / (abs(d.x) + abs(d.y) + abs(d.z));
+	vec2 p = vec2(d.x, d.z) * inv_l1;
+	if (d.y < 0.0f) p = vec2((1.0f - abs(p.y)) * signNotZero(p.x), (1.0f - abs(p.x)) * signNotZero(p.y));
+	return p * 0.5f + 0.5f;
+}
+
+vec3 HDRImage::octahedralToDirection(const vec2 & uv)
+{
+	const vec2 f = uv * 2.0f - 1.0f;
+	vec3 p = vec3(f.x, 1.0f - abs(f.x) - abs(f.y), f.y);
+	const float t = std::max(-p.y, 0.0f);
+	p.x += p.x >= 0.0f ? -t : t;
+	p.z += p.z >= 0.0f ? -t : t;
+	return normalize(p);
+}
+
+float HDRImage::octahedralSolidAngle(const vec3 & d)
+{
+	// A point on the octahedron at distance r covers a solid angle of
+	// dA / r^3, and dA = 4 du dv. For a unit direction r = 1 / |d|_1.
+	const float l1 = abs(d.x) + abs(d.y) + abs(d.z);
+	return 4.0f * l1 * l1 * l1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Lookups
+///////////////////////////////////////////////////////////////////////////
+vec3 HDRImage::sample(const vec3 & direction, float lod) const {
+	const vec2 uv = directionToOctahedral(direction);
+	return mipmap.trilinear(uv.x, uv.y, lod);
+}
+
+void HDRImage::sample(int count, const float * x, const float * y, const float * z, const float * lod,
+	vec3 * result) const
+{
+	int i = 0;
+#ifdef HDR_USE_SSE
+	const __m128 sign_mask = _mm_set1_ps(-0.0f), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+	for (; i + 4 <= count; i += 4) {
+		const __m128 dx = _mm_loadu_ps(x + i), dy = _mm_loadu_ps(y + i), dz = _mm_loadu_ps(z + i);
+		const __m128 l1 = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_mask, dx), _mm_andnot_ps(sign_mask, dy)),
+			_mm_andnot_ps(sign_mask, dz));
+		const __m128 inv_l1 = _mm_div_ps(one, l1);
+		__m128 px = _mm_mul_ps(dx, inv_l1), pz = _mm_mul_ps(dz, inv_l1);
+		// Fold out the lower hemisphere
+		const __m128 sign_x = _mm_or_ps(_mm_and_ps(px, sign_mask), one);
+		const __m128 sign_z = _mm_or_ps(_mm_and_ps(pz, sign_mask), one);
+		const __m128 folded_x = _mm_mul_ps(_mm_sub_ps(one, _mm_andnot_ps(sign_mask, pz)), sign_x);
+		const __m128 folded_z = _mm_mul_ps(_mm_sub_ps(one, _mm_andnot_ps(sign_mask, px)), sign_z);
+		const __m128 lower = _mm_cmplt_ps(dy, _mm_setzero_ps());
+		px = _mm_or_ps(_mm_and_ps(lower, folded_x), _mm_andnot_ps(lower, px));
+		pz = _mm_or_ps(_mm_and_ps(lower, folded_z), _mm_andnot_ps(lower, pz));
+		alignas(16) float u[4], v[4];
+		_mm_store_ps(u, _mm_add_ps(_mm_mul_ps(px, half), half));
+		_mm_store_ps(v, _mm_add_ps(_mm_mul_ps(pz, half), half));
+		for (int k = 0; k < 4; k++) {
+			result[i + k] = mipmap.trilinear(u[k], v[k], lod != nullptr ? lod[i + k] : 0.0f);
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		result[i] = sample(vec3(x[i], y[i], z[i]), lod != nullptr ? lod[i] : 0.0f);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build the distribution used by sampleDirection() and pdf() from the full
+// resolution octahedral map. The rows are independent, so their tables are
+// built in parallel.
+///////////////////////////////////////////////////////////////////////////
+void HDRImage::buildDistribution()
+{
+	texel_tables.resize(size_t(size) * size_t(size));
+	row_table.resize(size);
+	vector<float> row_weights(size);
+#pragma omp parallel
+	{
+		vector<float> weights(size);
+#pragma omp for schedule(dynamic, 16)
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				const vec3 c = mipmap.texel(0, x, y);
+				const vec3 d = octahedralToDirection((vec2(x, y) + 0.5f) / float(size));
+				weights[x] = (0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b) * octahedralSolidAngle(d);
+			}
+			row_weights[y] = buildAliasTable(weights.data(), size, &texel_tables[size_t(y) * size]);
+		}
+	}
+	buildAliasTable(row_weights.data(), size, row_table.data());
+}
+
+vec3 HDRImage::sampleDirection(float u1, float u2, float & pdf) const
+{
+	// Pick a texel, and a point in it with what is left of u1 and u2
+	uint32_t y = sampleAliasTable(row_table.data(), size, u1);
+	uint32_t x = sampleAliasTable(&texel_tables[size_t(y) * size], size, u2);
+	const vec3 direction = octahedralToDirection(vec2(float(x) + u2, float(y) + u1) / float(size));
+	// The pdf over the map is constant within the texel
+	const float pdf_uv = row_table[y].pdf * texel_tables[size_t(y) * size + x].pdf * float(size) * float(size);
+	pdf = pdf_uv / octahedralSolidAngle(direction);
+	return direction;
+}
+
+float HDRImage::pdf(const vec3 & direction) const
+{
+	const vec2 uv = directionToOctahedral(direction);
+	const uint32_t x = std::min(uint32_t(uv.x * float(size)), uint32_t(size - 1));
+	const uint32_t y = std::min(uint32_t(uv.y * float(size)), uint32_t(size - 1));
+	const float pdf_uv = row_table[y].pdf * texel_tables[size_t(y) * size + x].pdf * float(size) * float(size);
+	return pdf_uv / octahedralSolidAngle(direction);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The cache holds the packed texels of all mip levels of the octahedral
+// map. It is only used if the image has the same size and modification
+// time as when the cache was written. It is written to a temporary file 
+// that is then renamed, so that processes loading the same map at once 
+// (like the workers of a distributed render) never read half a cache. 
+///////////////////////////////////////////////////////////////////////////
+struct OctahedralCacheHeader
+{
+	char magic[8];
+	int64_t source_size;
+	int64_t source_time;
+	int32_t width, height, size;
+};
+
+static const char octahedral_cache_magic[8] = { 'O', 'C', 'T', 'E', 'N', 'V', '0', '1' };
+
+static bool sourceStats(const string & filename, int64_t & source_size, int64_t & source_time)
+{
+	struct stat status;
+	if (stat(filename.c_str(), &status) != 0) return false;
+	source_size = int64_t(status.st_size);
+	source_time = int64_t(status.st_mtime);
+	return true;
+}
+
+bool HDRImage::loadCache(const string & filename)
+{
+	OctahedralCacheHeader header;
+	int64_t source_size, source_time;
+	if (!sourceStats(filename, source_size, source_time)) return false;
+	ifstream file(filename + ".oct", ios::binary);
+	if (!file.is_open()) return false;
+	if (!file.read((char *)&header, sizeof(header))) return false;
+	if (memcmp(header.magic, octahedral_cache_magic, sizeof(header.magic)) != 0 ||
+		header.source_size != source_size || header.source_time != source_time) {
+		return false;
+	}
+	// A power of two that we could have made, before allocating for it
+	if (header.size <= 0 || header.size > max_octahedral_size || (header.size & (header.size - 1)) != 0) {
+		return false;
+	}
+	width = header.width;
+	height = header.height;
+	components = 3;
+	size = header.size;
+	mipmap.allocate(size, size, MipMap::WRAP_OCTAHEDRAL, MipMap::WRAP_OCTAHEDRAL);
+	for (auto & level : mipmap.levels) {
+		if (!file.read((char *)level.texels.data(), level.texels.size() * sizeof(uint32_t))) return false;
+	}
+	return true;
+}
+
+void HDRImage::saveCache(const string & filename) const
+{
+	OctahedralCacheHeader header;
+	memcpy(header.magic, octahedral_cache_magic, sizeof(header.magic));
+	if (!sourceStats(filename, header.source_size, header.source_time)) return;
+	header.width = width;
+	header.height = height;
+	header.size = size;
+	const string cache_filename = filename + ".oct";
+	const string temporary_filename = cache_filename + ".tmp";
+	{
+		ofstream file(temporary_filename, ios::binary);
+		if (file.is_open()) {
+			file.write((const char *)&header, sizeof(header));
+			for (auto & level : mipmap.levels) {
+				file.write((const char *)level.texels.data(), level.texels.size() * sizeof(uint32_t));
+			}
+		}
+		if (!file.good()) {
+			std::cout << "Could not write environment map cache " << cache_filename << ".\n";
+			file.close();
+			remove(temporary_filename.c_str());
+			return;
+		}
+	}
+#ifdef _WIN32
+	// Windows does not rename onto an existing file
+	remove(cache_filename.c_str());
+#endif
+	if (rename(temporary_filename.c_str(), cache_filename.c_str()) != 0) {
+		std::cout << "Could not write environment map cache " << cache_filename << ".\n";
+		remove(temporary_filename.c_str());
+	}
+}
@@ -1,16 +1,67 @@
 #pragma once
 #include <stb_image.h>
 #include <string>
+#include <vector>
 #include <glm/glm.hpp>
+#include "mipmap.h"
+#include "sampling.h"
 
 ///////////////////////////////////////////////////////////////////////////
-// Simple helper class for loading HDR images with STB image
+// Simple helper class for loading HDR images with STB image. The image is
+// expected to be a latitude-longitude environment map, and is converted
+// to an octahedral map (see directionToOctahedral()) when loaded, so that
+// lookups by direction need no trigonometry. The converted map is cached
+// next to the image (as <filename>.oct), so that the next load is fast.
 ///////////////////////////////////////////////////////////////////////////
 struct HDRImage {
-	int width, height, components;
-	float * data = nullptr;
+	int width, height, components;	// Of the loaded latitude-longitude image
+	int size;						// The octahedral map has size x size texels
+	MipMap mipmap;					// The octahedral map
 	HDRImage() {};
-	~HDRImage() { if (data != nullptr) stbi_image_free(data); };
 	void load(const std::string & filename);
-	glm::vec3 sample(float u, float v);
-};
\ No newline at end of file
+
+	///////////////////////////////////////////////////////////////////////
+	// Filtered lookup in a direction. lod 0 is a bilinear lookup in the
+	// full resolution map, larger lods blur over 2^lod texels (trilinear).
+	// The batch version looks up count directions given as arrays of x, y
+	// and z (and lod, or nullptr for 0), mapping four at a time to the map
+	// with SIMD instructions.
+	///////////////////////////////////////////////////////////////////////
+	glm::vec3 sample(const glm::vec3 & direction, float lod = 0.0f) const;
+	void sample(int count, const float * x, const float * y, const float * z, const float * lod,
+		glm::vec3 * result) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// Map a direction to [0,1]^2 on the octahedral map and back. The upper
+	// hemisphere (y > 0) covers the diamond in the middle of the map and
+	// the lower hemisphere is folded out over the corners.
+	///////////////////////////////////////////////////////////////////////
+	static glm::vec2 directionToOctahedral(const glm::vec3 & direction);
+	static glm::vec3 octahedralToDirection(const glm::vec2 & uv);
+	// The solid angle per unit area of the map around a direction
+	static float octahedralSolidAngle(const glm::vec3 & direction);
+
+	///////////////////////////////////////////////////////////////////////
+	// Importance sampling of directions. Directions are picked in
+	// proportion to luminance times solid angle, i.e., to the power
+	// arriving from each texel of the octahedral map. sampleDirection()
+	// maps two uniform numbers to a direction and returns its pdf (per
+	// solid angle), pdf() returns the pdf of a given direction.
+	///////////////////////////////////////////////////////////////////////
+	glm::vec3 sampleDirection(float u1, float u2, float & pdf) const;
+	float pdf(const glm::vec3 & direction) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// Alias tables (see sampling.h): one over the rows (marginal) and one
+	// per row (conditional)
+	///////////////////////////////////////////////////////////////////////
+	std::vector<pathtracer::AliasEntry> row_table;		// size entries
+	std::vector<pathtracer::AliasEntry> texel_tables;	// size entries per row
+	void buildDistribution();
+
+	///////////////////////////////////////////////////////////////////////
+	// The on-disk cache of the octahedral map
+	///////////////////////////////////////////////////////////////////////
+	bool loadCache(const std::string & filename);
+	void saveCache(const std::string & filename) const;
+};
@@ -3,9 +3,14 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "scheduler.h"
+#include "wavefront.h"
+#include "lights.h"
 
 using namespace std; 
 using namespace glm; 
@@ -21,76 +26,669 @@ namespace pathtracer
 	PointLight point_light; 
 
 	///////////////////////////////////////////////////////////////////////////
-	// Restart rendering of image
+	// The screen tiles that the rendered image is split into, and the tile
+	// size and resolution they were built for. 
 	///////////////////////////////////////////////////////////////////////////
+	vector<Tile> tiles;
+	int tiles_width = 0, tiles_height = 0, tiles_size = 0;
+	// The last pass in which each tile was finished, and the number of the
+	// current pass, so that finished tiles can be reported while the others
+	// are still being traced
+	unique_ptr<atomic<uint32_t>[]> tile_finished_pass;
+	uint32_t pass_number = 0;
+	// The camera of the last pass, which the image's samples were taken with
+	Camera traced_camera;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Restart rendering of image. Other threads may call restart(), 
+	// cancelPass() and cancelPasses() while a pass is running, so they only
+	// set atomics that the pass looks at. A restart also counts as a cancel,
+	// and is counted first, so a pass never sees a restart without a cancel.
+	///////////////////////////////////////////////////////////////////////////
+	atomic<uint32_t> restart_count(0);
+	atomic<uint32_t> cancel_count(0);
+	uint32_t pass_restart_count = 0;		// restart_count when the pass started
+	uint32_t pass_cancel_count = 0;			// cancel_count when the pass started
+	atomic<bool> passes_cancelled(false);
+
 	void restart()
 	{
-		// No need to clear image, 
-		rendered_image.number_of_samples = 0; 
+		// No need to clear image, the per-pixel sample counts are reset 
+		// when the next pass starts. 
+		restart_count++;
+		cancel_count++;
+	}
+
+	void cancelPass()
+	{
+		cancel_count++;
+	}
+
+	void cancelPasses()
+	{
+		passes_cancelled = true;
+	}
+
+	void resumePasses()
+	{
+		passes_cancelled = false;
+	}
+
+	bool passCancelled()
+	{
+		return passes_cancelled.load(memory_order_relaxed) ||
+			cancel_count.load(memory_order_relaxed) != pass_cancel_count;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// On window resize, window size is passed in, actual size of pathtraced
 	// image may be smaller (if we're subsampling for speed)
 	///////////////////////////////////////////////////////////////////////////
+	int window_width = 0, window_height = 0;
+
 	void resize(int w, int h)
 	{
-		rendered_image.width = w / settings.subsampling; 
-		rendered_image.height = h / settings.subsampling; 
-		rendered_image.data.resize(rendered_image.width * rendered_image.height);
-		restart(); 
+		window_width = w;
+		window_height = h;
+		// With a frame time budget the subsampling is picked by the render 
+		// thread, so keep the one it has picked
+		int subsampling = settings.subsampling;
+		if (settings.frame_time_budget > 0.0f && rendered_image.subsampling > 0) subsampling = rendered_image.subsampling;
+		rendered_image.subsampling = 0;
+		setSubsampling(subsampling);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The luminance of a linear RGB color
+	///////////////////////////////////////////////////////////////////////////
+	static float luminance(const vec3 & c)
+	{
+		return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Resample the image to a new subsampling. The colors are always carried
+	// over (nearest neighbor), so that there is something to show until the
+	// new pixels have samples, but the samples only when they can be kept. 
+	///////////////////////////////////////////////////////////////////////////
+	void setSubsampling(int subsampling)
+	{
+		subsampling = std::max(1, subsampling);
+		const int old_subsampling = rendered_image.subsampling;
+		if (subsampling == old_subsampling) return;
+		const int old_width = rendered_image.width, old_height = rendered_image.height;
+		const bool finer = old_subsampling > subsampling && old_subsampling % subsampling == 0;
+		const bool coarser = old_subsampling > 0 && subsampling > old_subsampling && subsampling % old_subsampling == 0;
+		const bool keep_samples = (finer || coarser) && rendered_image.number_of_samples > 0;
+		vector<vec3> old_data;
+		vector<int> old_sample_count;
+		vector<float> old_variance_m2;
+		swap(old_data, rendered_image.data);
+		swap(old_sample_count, rendered_image.sample_count);
+		swap(old_variance_m2, rendered_image.variance_m2);
+
+		rendered_image.subsampling = subsampling;
+		rendered_image.width = window_width / subsampling; 
+		rendered_image.height = window_height / subsampling; 
+		const int width = rendered_image.width, height = rendered_image.height;
+		rendered_image.data.assign(width * height, vec3(0.0f));
+		rendered_image.sample_count.assign(width * height, 0);
+		rendered_image.variance_m2.assign(width * height, 0.0f);
+		rendered_image.pass_samples.assign(width * height, 0);
+		vector<float> old_depth;
+		vector<vec3> old_normal, old_albedo;
+		swap(old_depth, rendered_image.depth);
+		swap(old_normal, rendered_image.normal);
+		swap(old_albedo, rendered_image.albedo);
+		rendered_image.depth.assign(width * height, FLT_MAX);
+		rendered_image.normal.assign(width * height, vec3(0.0f));
+		rendered_image.albedo.assign(width * height, vec3(1.0f));
+		if (old_data.size() == 0 || old_subsampling == 0) {
+			restart();
+			return;
+		}
+		// Each new pixel covers factor x factor old pixels, whose samples are
+		// merged into it (as in mergeCheckpoint()). Its first hit is the one
+		// of the old pixel that its camera ray goes through, the corner one. 
+		if (coarser && keep_samples) {
+			const int factor = subsampling / old_subsampling;
+#pragma omp parallel for
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					const int i = y * width + x;
+					const int corner = std::min(y * factor, old_height - 1) * old_width + std::min(x * factor, old_width - 1);
+					rendered_image.data[i] = old_data[corner];
+					rendered_image.depth[i] = old_depth[corner];
+					rendered_image.normal[i] = old_normal[corner];
+					rendered_image.albedo[i] = old_albedo[corner];
+					int n = 0;
+					vec3 mean = vec3(0.0f);
+					float m2 = 0.0f;
+					for (int old_y = y * factor; old_y < std::min((y + 1) * factor, old_height); old_y++) {
+						for (int old_x = x * factor; old_x < std::min((x + 1) * factor, old_width); old_x++) {
+							const int old_i = old_y * old_width + old_x;
+							const int old_n = old_sample_count[old_i];
+							if (old_n == 0) continue;
+							const float delta = luminance(old_data[old_i]) - luminance(mean);
+							const float total = float(n + old_n);
+							m2 += old_variance_m2[old_i] + delta * delta * float(n) * float(old_n) / total;
+							mean += (old_data[old_i] - mean) * float(old_n) / total;
+							n += old_n;
+						}
+					}
+					if (n == 0) continue;
+					rendered_image.data[i] = mean;
+					rendered_image.sample_count[i] = n;
+					rendered_image.variance_m2[i] = m2;
+				}
+			}
+			return;
+		}
+		// Each old pixel's samples are shared (rounding up) between the new
+		// pixels it covers, so that the old mean fades out as new samples 
+		// come in, at the rate it would have had at this resolution
+		const int factor = old_subsampling / std::max(1, subsampling);
+		const int new_pixels_per_old = factor * factor;
+#pragma omp parallel for
+		for (int y = 0; y < height; y++) {
+			const int old_y = std::min((y * subsampling) / old_subsampling, old_height - 1);
+			for (int x = 0; x < width; x++) {
+				const int old_x = std::min((x * subsampling) / old_subsampling, old_width - 1);
+				const int i = y * width + x, old_i = old_y * old_width + old_x;
+				rendered_image.data[i] = old_data[old_i];
+				rendered_image.depth[i] = old_depth[old_i];
+				rendered_image.normal[i] = old_normal[old_i];
+				rendered_image.albedo[i] = old_albedo[old_i];
+				if (keep_samples && old_sample_count[old_i] > 0) {
+					const int n = (old_sample_count[old_i] + new_pixels_per_old - 1) / new_pixels_per_old;
+					rendered_image.sample_count[i] = n;
+					rendered_image.variance_m2[i] = old_variance_m2[old_i] * float(n) / float(old_sample_count[old_i]);
+				}
+			}
+		}
+		if (!keep_samples) restart();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Take over the samples of another image. A pending restart (e.g. from
+	// the resize that set the size) is done now, so that it does not throw
+	// them away, and the camera is taken as the one they were traced with.
+	///////////////////////////////////////////////////////////////////////////
+	bool resumeImage(Image & image, vec3 camera_pos, vec3 camera_dir, vec3 camera_up)
+	{
+		if (image.width != rendered_image.width || image.height != rendered_image.height) return false;
+		pass_restart_count = restart_count;
+		swap(rendered_image.data, image.data);
+		swap(rendered_image.sample_count, image.sample_count);
+		swap(rendered_image.variance_m2, image.variance_m2);
+		swap(rendered_image.depth, image.depth);
+		swap(rendered_image.normal, image.normal);
+		swap(rendered_image.albedo, image.albedo);
+		rendered_image.number_of_samples = image.number_of_samples;
+		rendered_image.converged_pixels = image.converged_pixels;
+		traced_camera = createCamera(camera_pos, camera_dir, camera_up);
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pick the mip level of the environment map where a texel around wi 
+	// covers about solid_angle
+	///////////////////////////////////////////////////////////////////////////
+	float environmentLod(const vec3 & wi, float solid_angle)
+	{
+		if (solid_angle <= 0.0f) return 0.0f;
+		const float texel_solid_angle = HDRImage::octahedralSolidAngle(wi) /
+			(float(environment.map.size) * float(environment.map.size));
+		return 0.5f * log2(solid_angle / texel_solid_angle);
 	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Return the radiance from a certain direction wi from the environment
 	// map. 
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Lenvironment(const vec3 & wi) {
-		const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
-		float phi = atan(wi.z, wi.x);
-		if (phi < 0.0f) phi = phi + 2.0f * M_PI;
-		vec2 lookup = vec2(phi / (2.0 * M_PI), theta / M_PI);
-		return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
+	vec3 Lenvironment(const vec3 & wi, float solid_angle) {
+		return environment.multiplier * environment.map.sample(wi, environmentLod(wi, solid_angle));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Importance sample the environment map
+	///////////////////////////////////////////////////////////////////////////
+	vec3 sampleEnvironment(vec3 & wi, float & pdf)
+	{
+		vec2 u = getSampler().get2D();
+		wi = environment.map.sampleDirection(u.x, u.y, pdf);
+		return pdf > 0.0f ? Lenvironment(wi) : vec3(0.0f);
+	}
+
+	float environmentPdf(const vec3 & wi)
+	{
+		return environment.map.pdf(wi);
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// The samples taken in a tile by traceTile() and traceTilePackets(). The
+	// brdfs of the light samples are evaluated together (with 
+	// settings.batched_shading), the shadow rays of all samples are traced 
+	// together when the tile is done, and then the samples are accumulated 
+	// to the image. 
+	///////////////////////////////////////////////////////////////////////////
+	struct TileSamples
+	{
+		vector<int> x, y;		// Pixel of each sample
+		vector<vec3> radiance;
+		DirectLightBatch direct_light;	// Light samples waiting for their brdfs
+		ShadowQueue shadows;
+		void clear()
+		{
+			x.clear();
+			y.clear();
+			radiance.clear();
+			direct_light.clear();
+			shadows.clear();
+		}
+	};
+
 	///////////////////////////////////////////////////////////////////////////
 	// Calculate the radiance going from one point (r.hitPosition()) in one 
-	// direction (-r.d), through path tracing.  
+	// direction (-r.d), through path tracing, depth first. Each hit is 
+	// shaded as in the wavefront integrator (see shadeHit()), so every 
+	// trace mode computes the same image. Light that reaches a hit through
+	// a shadow ray is not returned, the shadow ray is queued with the 
+	// radiance it carries to the sample's slot. 
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Li(Ray & primary_ray) {
+	vec3 Li(Ray & primary_ray, TileSamples & samples, int slot, uint32_t sample_index) {
 		vec3 L = vec3(0.0f);
-		vec3 path_throughput = vec3(1.0);
+		PathState path;
+		path.slot = slot;
+		path.throughput = vec3(1.0f);
+		path.brdf_pdf = 0.0f;
 		Ray current_ray = primary_ray;
-
-		///////////////////////////////////////////////////////////////////
-		// Get the intersection information from the ray
-		///////////////////////////////////////////////////////////////////
-		Intersection hit = getIntersection(current_ray);
-		///////////////////////////////////////////////////////////////////
-		// Create a Material tree for evaluating brdfs and calculating
-		// sample directions. 
-		///////////////////////////////////////////////////////////////////
-
-		Diffuse diffuse(hit.material->m_color);
-		BRDF & mat = diffuse;
-		///////////////////////////////////////////////////////////////////
-		// Calculate Direct Illumination from light.
-		///////////////////////////////////////////////////////////////////
-		{
-			const float distance_to_light = length(point_light.position - hit.position);
-			const float falloff_factor = 1.0f / (distance_to_light*distance_to_light);
-			vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-			vec3 wi = normalize(point_light.position - hit.position);
-			L = mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+		for (int bounce = 0; ; bounce++) {
+			if (bounce > 0) startPixelSample(samples.x[slot], samples.y[slot], sample_index, bounce * dimensions_per_bounce);
+			const Intersection hit = getIntersection(current_ray);
+			Ray next_ray;
+			if (!shadeHit(hit, current_ray, bounce < settings.max_bounces, path, L, next_ray, samples.direct_light,
+				samples.shadows)) {
+				break;
+			}
+			current_ray = next_ray;
+			if (!intersect(current_ray)) {
+				float solid_angle;
+				const float weight = environmentWeight(path, current_ray.d, sample_index, solid_angle);
+				L += weight * path.throughput * Lenvironment(current_ray.d, solid_angle);
+				break;
+			}
 		}
 		// Return the final outgoing radiance for the primary ray
 		return L;
 	}
 
+	static void finishTile(TileSamples & samples)
+	{
+		samples.direct_light.resolve(samples.shadows);
+		samples.shadows.trace(samples.radiance);
+		for (size_t slot = 0; slot < samples.radiance.size(); slot++) {
+			accumulate(samples.x[slot], samples.y[slot], samples.radiance[slot]);
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel and accumulate the result in an image
+	// Evaluate the radiance along a primary ray that has been intersected 
+	// with the scene, as sample s of pixel (x, y) in this pass
+	///////////////////////////////////////////////////////////////////////////
+	void shadePixel(int x, int y, int s, Ray & primaryRay, TileSamples & samples)
+	{
+		const int slot = int(samples.radiance.size());
+		samples.x.push_back(x);
+		samples.y.push_back(y);
+		const uint32_t sample_index = uint32_t(rendered_image.sample_count[y * rendered_image.width + x] + s);
+		startPixelSample(x, y, sample_index);
+		vec3 color;
+		if (s == 0) {
+			if (primaryRay.geomID != RTC_INVALID_GEOMETRY_ID) {
+				const Intersection hit = getIntersection(primaryRay);
+				recordPrimaryHit(x, y, primaryRay.tfar, hit.shading_normal, hit.material->m_color);
+			}
+			else {
+				recordPrimaryHit(x, y, FLT_MAX, vec3(0.0f), vec3(1.0f));
+			}
+		}
+		if (primaryRay.geomID != RTC_INVALID_GEOMETRY_ID) {
+			// If it hit something, evaluate the radiance from that point
+			color = Li(primaryRay, samples, slot, sample_index);
+		}
+		else {
+			// Otherwise evaluate environment
+			color = Lenvironment(primaryRay.d);
+		}
+		samples.radiance.push_back(color);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add a new sample to the running average of pixel (x, y)
 	///////////////////////////////////////////////////////////////////////////
-	void tracePaths(vec3 camera_pos, vec3 camera_dir, vec3 camera_up)
+	void accumulate(int x, int y, const vec3 & color)
+	{
+		const int i = y * rendered_image.width + x;
+		const float n = float(++rendered_image.sample_count[i]);
+		const float old_mean = luminance(rendered_image.data[i]);
+		rendered_image.data[i] += (color - rendered_image.data[i]) / n;
+		const float new_mean = luminance(rendered_image.data[i]);
+		rendered_image.variance_m2[i] += (luminance(color) - old_mean) * (luminance(color) - new_mean);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The hit of a camera ray is the same for every sample of a pixel (the 
+	// rays go through the pixel corner), so a reprojected pixel is checked
+	// against the first one traced. 
+	///////////////////////////////////////////////////////////////////////////
+	const float reprojection_depth_tolerance = 0.05f;	// Relative to the depth
+	const float reprojection_normal_tolerance = 0.9f;	// Cosine of the angle
+
+	void recordPrimaryHit(int x, int y, float depth, const vec3 & normal, const vec3 & albedo)
+	{
+		const int i = y * rendered_image.width + x;
+		if (rendered_image.sample_count[i] > 0) {
+			const float old_depth = rendered_image.depth[i];
+			const bool hit = depth != FLT_MAX, old_hit = old_depth != FLT_MAX;
+			if (hit != old_hit || (hit && (abs(depth - old_depth) > reprojection_depth_tolerance * depth ||
+				dot(normal, rendered_image.normal[i]) < reprojection_normal_tolerance))) {
+				rendered_image.sample_count[i] = 0;
+				rendered_image.variance_m2[i] = 0.0f;
+			}
+		}
+		rendered_image.depth[i] = depth;
+		rendered_image.normal[i] = normal;
+		rendered_image.albedo[i] = albedo;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Move the samples of the image from one view to another. Each pixel's
+	// camera ray hit (or, if it missed, its direction) is projected into 
+	// the new view and its samples go to the pixel it lands in, the nearest
+	// one winning where several land in the same pixel. Each move keeps 
+	// only reprojection_history of the samples, so that the view dependent
+	// parts of the image (and the pixels that could not be checked) do not
+	// lag behind forever. Pixels that nothing lands in (disocclusions) get 
+	// no samples; they keep their old color until they are traced, just to 
+	// have something to show. 
+	///////////////////////////////////////////////////////////////////////////
+	const float reprojection_history = 0.9f;
+
+	static void reproject(const Camera & from, const Camera & to)
+	{
+		const int width = rendered_image.width, height = rendered_image.height;
+		const int number_of_pixels = width * height;
+		// A point is d = a X + b Y + c lower_right_corner from the new camera,
+		// which puts it at pixel (a / c, b / c) times the resolution
+		const mat3 to_screen = inverse(mat3(to.X, to.Y, to.lower_right_corner));
+		vector<int> target(number_of_pixels, -1);
+		vector<float> target_depth(number_of_pixels, FLT_MAX);
+#pragma omp parallel for
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				const int i = y * width + x;
+				if (rendered_image.sample_count[i] == 0) continue;
+				const float depth = rendered_image.depth[i];
+				vec3 d = from.direction(x, y);
+				if (depth != FLT_MAX) d = from.position + depth * d - to.position;
+				const vec3 screen = to_screen * d;
+				if (screen.z <= 0.0f) continue;
+				const int tx = int(floor(float(width) * screen.x / screen.z + 0.5f));
+				const int ty = int(floor(float(height) * screen.y / screen.z + 0.5f));
+				if (tx < 0 || tx >= width || ty < 0 || ty >= height) continue;
+				target[i] = ty * width + tx;
+				target_depth[i] = depth != FLT_MAX ? length(d) : FLT_MAX;
+			}
+		}
+		// Resolve which pixel lands in each new pixel
+		vector<int> source(number_of_pixels, -1);
+		for (int i = 0; i < number_of_pixels; i++) {
+			const int t = target[i];
+			if (t >= 0 && (source[t] < 0 || target_depth[i] < target_depth[source[t]])) source[t] = i;
+		}
+		vector<vec3> data(rendered_image.data);
+		vector<int> sample_count(number_of_pixels, 0);
+		vector<float> variance_m2(number_of_pixels, 0.0f);
+		vector<float> depth(number_of_pixels, FLT_MAX);
+		vector<vec3> normal(number_of_pixels, vec3(0.0f));
+		vector<vec3> albedo(number_of_pixels, vec3(1.0f));
+#pragma omp parallel for
+		for (int i = 0; i < number_of_pixels; i++) {
+			const int j = source[i];
+			if (j < 0) continue;
+			const int n = rendered_image.sample_count[j];
+			const int kept = std::max(1, int(float(n) * reprojection_history));
+			data[i] = rendered_image.data[j];
+			sample_count[i] = kept;
+			variance_m2[i] = rendered_image.variance_m2[j] * float(kept) / float(n);
+			depth[i] = target_depth[j];
+			normal[i] = rendered_image.normal[j];
+			albedo[i] = rendered_image.albedo[j];
+		}
+		swap(rendered_image.data, data);
+		swap(rendered_image.sample_count, sample_count);
+		swap(rendered_image.variance_m2, variance_m2);
+		swap(rendered_image.depth, depth);
+		swap(rendered_image.normal, normal);
+		swap(rendered_image.albedo, albedo);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The standard error of a pixel's mean, relative to its luminance. 
+	///////////////////////////////////////////////////////////////////////////
+	float relativeError(int i)
+	{
+		const int n = rendered_image.sample_count[i];
+		if (n < 2) return FLT_MAX;
+		const float variance_of_mean = rendered_image.variance_m2[i] / (float(n) * float(n - 1));
+		return sqrt(variance_of_mean) / std::max(luminance(rendered_image.data[i]), 0.01f);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Decide how many samples each pixel gets in this pass. A pixel that has
+	// reached max_paths_per_pixel or settings.target_error gets none. In 
+	// adaptive mode, a budget of one sample per pixel in the image is then 
+	// split over the remaining pixels in proportion to their relative error.
+	// Returns false when every pixel is done. 
+	///////////////////////////////////////////////////////////////////////////
+	const int adaptive_warmup_samples = 4;
+	const int max_samples_per_pass = 64;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Interleaved refinement. In the first 16 passes after a restart, pass k
+	// only traces the pixels whose entry in a 4x4 Bayer matrix is k, so the
+	// first pass costs a 16th of a full one and the pixels it covers are
+	// spread evenly over the image. The matrix is laid out so that every 
+	// pass lands as far as possible from the pixels traced before it. 
+	///////////////////////////////////////////////////////////////////////////
+	const int interleaved_passes = 16;
+	const uint8_t bayer_matrix[4][4] = {
+		{  0,  8,  2, 10 },
+		{ 12,  4, 14,  6 },
+		{  3, 11,  1,  9 },
+		{ 15,  7, 13,  5 }
+	};
+
+	static bool interleaving()
+	{
+		return settings.interleaved && rendered_image.number_of_samples < interleaved_passes;
+	}
+
+	bool planPass()
+	{
+		const int number_of_pixels = rendered_image.width * rendered_image.height;
+		const bool warming_up = rendered_image.number_of_samples < adaptive_warmup_samples + 
+			(settings.interleaved ? interleaved_passes : 0);
+		int converged = 0, remaining = 0;
+		double total_error = 0.0;
+#pragma omp parallel for reduction(+:converged, remaining, total_error)
+		for (int i = 0; i < number_of_pixels; i++) {
+			const int n = rendered_image.sample_count[i];
+			const float error = relativeError(i);
+			bool done = (settings.max_paths_per_pixel != 0 && n >= settings.max_paths_per_pixel);
+			if (settings.target_error > 0.0f && n >= adaptive_warmup_samples && error < settings.target_error) {
+				done = true;
+				converged++;
+			}
+			rendered_image.pass_samples[i] = done ? 0 : 1;
+			if (!done && interleaving()) {
+				const int x = i % rendered_image.width, y = i / rendered_image.width;
+				if (bayer_matrix[y % 4][x % 4] != rendered_image.number_of_samples) rendered_image.pass_samples[i] = 0;
+			}
+			if (!done) {
+				remaining++;
+				total_error += std::min(error, 1e3f);
+			}
+		}
+		rendered_image.converged_pixels = converged;
+		if (remaining == 0) return false;
+		if (!settings.adaptive_sampling || warming_up || total_error <= 0.0) return true;
+
+		const double samples_per_error = double(number_of_pixels) / total_error;
+		const uint32_t pass = uint32_t(rendered_image.number_of_samples);
+#pragma omp parallel for
+		for (int i = 0; i < number_of_pixels; i++) {
+			if (rendered_image.pass_samples[i] == 0) continue;
+			// Round the pixel's share of the budget up or down at random, so
+			// that the expected total matches the budget
+			uint32_t h = (uint32_t(i) * 0x9E3779B1u) ^ (pass * 0x85EBCA77u);
+			h ^= h >> 15; h *= 0x2C1B3C6Du; h ^= h >> 12;
+			const float jitter = float(h >> 8) * 5.9604645e-8f;
+			double share = samples_per_error * std::min(relativeError(i), 1e3f);
+			int samples = int(share + jitter);
+			if (settings.max_paths_per_pixel != 0) {
+				samples = std::min(samples, settings.max_paths_per_pixel - rendered_image.sample_count[i]);
+			}
+			rendered_image.pass_samples[i] = uint16_t(std::max(0, std::min(samples, max_samples_per_pass)));
+		}
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// While interleaving, give the pixels of a tile that have no samples yet
+	// the color (and first hit, for the denoiser) of the nearest pixel in 
+	// the tile that has, so that every pass shows a whole image. The first
+	// sample a pixel gets replaces them (the mean of one sample is that 
+	// sample), so this costs nothing later. The first pass traces the 
+	// corner of every 4x4 cell of the Bayer matrix, and while interleaving
+	// the tiles are a multiple of 4 in size (see tileSize()), so each cell 
+	// lies in one tile and looking 3 pixels away is enough. 
+	///////////////////////////////////////////////////////////////////////////
+	static vector<ivec2> neighborOffsets()
+	{
+		vector<ivec2> offsets;
+		for (int dy = -3; dy <= 3; dy++) {
+			for (int dx = -3; dx <= 3; dx++) {
+				if (dx != 0 || dy != 0) offsets.push_back(ivec2(dx, dy));
+			}
+		}
+		stable_sort(offsets.begin(), offsets.end(), [](const ivec2 & a, const ivec2 & b) {
+			return a.x * a.x + a.y * a.y < b.x * b.x + b.y * b.y;
+		});
+		return offsets;
+	}
+
+	static void fillUntracedPixels(const Tile & tile)
+	{
+		// Nearest first
+		static const vector<ivec2> offsets = neighborOffsets();
+		const int width = rendered_image.width;
+		for (int y = tile.y0; y < tile.y1; y++) {
+			for (int x = tile.x0; x < tile.x1; x++) {
+				if (rendered_image.sample_count[y * width + x] > 0) continue;
+				for (const ivec2 & offset : offsets) {
+					const int nx = x + offset.x, ny = y + offset.y;
+					if (nx < tile.x0 || nx >= tile.x1 || ny < tile.y0 || ny >= tile.y1) continue;
+					const int i = y * width + x, j = ny * width + nx;
+					if (rendered_image.sample_count[j] > 0) {
+						rendered_image.data[i] = rendered_image.data[j];
+						rendered_image.depth[i] = rendered_image.depth[j];
+						rendered_image.normal[i] = rendered_image.normal[j];
+						rendered_image.albedo[i] = rendered_image.albedo[j];
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The tile size to split the image with: settings.tile_size, rounded up
+	// to a multiple of the Bayer matrix with interleaved refinement
+	///////////////////////////////////////////////////////////////////////////
+	static int tileSize()
+	{
+		const int tile_size = std::max(1, settings.tile_size);
+		return settings.interleaved ? (tile_size + 3) / 4 * 4 : tile_size;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace the primary rays of a tile one at a time
+	///////////////////////////////////////////////////////////////////////////
+	void traceTile(const Tile & tile, const Camera & camera)
+	{
+		static thread_local TileSamples samples;
+		samples.clear();
+		for (int y = tile.y0; y < tile.y1; y++) {
+			if (passCancelled()) return;
+			for (int x = tile.x0; x < tile.x1; x++) {
+				const int pixel_samples = rendered_image.pass_samples[y * rendered_image.width + x];
+				for (int s = 0; s < pixel_samples; s++) {
+					Ray primaryRay(camera.position, camera.direction(x, y));
+					intersect(primaryRay);
+					shadePixel(x, y, s, primaryRay, samples);
+				}
+			}
+		}
+		finishTile(samples);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace the primary rays of a tile as packets of N rays, each covering a
+	// small block of pixels (2x2 for N = 4, 4x2 for N = 8, 4x4 for N = 16), 
+	// so that the rays in a packet travel through the same part of the BVH. 
+	///////////////////////////////////////////////////////////////////////////
+	template<int N>
+	void traceTilePackets(const Tile & tile, const Camera & camera)
+	{
+		const int block_width = (N == 4) ? 2 : 4;
+		const int block_height = N / block_width;
+		static thread_local TileSamples samples;
+		samples.clear();
+		for (int by = tile.y0; by < tile.y1; by += block_height) {
+			if (passCancelled()) return;
+			for (int bx = tile.x0; bx < tile.x1; bx += block_width) {
+				// Pixels that get several samples this pass are traced in 
+				// several packets, pixels that get none are masked out
+				for (int s = 0; ; s++) {
+					RayPacket<N> packet;
+					RTCORE_ALIGN(64) int valid[N];
+					bool any_valid = false;
+					for (int i = 0; i < N; i++) {
+						int x = bx + i % block_width, y = by + i / block_width;
+						valid[i] = (x < tile.x1 && y < tile.y1 &&
+							s < rendered_image.pass_samples[y * rendered_image.width + x]) ? -1 : 0;
+						if (valid[i]) packet.setRay(i, Ray(camera.position, camera.direction(x, y)));
+						any_valid = any_valid || valid[i];
+					}
+					if (!any_valid) break;
+					intersect(valid, packet);
+					for (int i = 0; i < N; i++) {
+						if (!valid[i]) continue;
+						Ray primaryRay = packet.getRay(i);
+						shadePixel(bx + i % block_width, by + i / block_width, s, primaryRay, samples);
+					}
+				}
+			}
+		}
+		finishTile(samples);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set up the virtual screen for a camera
+	///////////////////////////////////////////////////////////////////////////
+	Camera createCamera(vec3 camera_pos, vec3 camera_dir, vec3 camera_up)
 	{
 		// Calculate where to shoot rays from the camera
 		vec3 camera_right = normalize(cross(camera_dir, camera_up));
@@ -103,40 +701,95 @@ namespace pathtracer
 		glm::vec3 A = camera_dir * cos(camera_fov / 2.0f * (M_PI / 180.0f));
 		glm::vec3 B = camera_up * sin(camera_fov / 2.0f * (M_PI / 180.0f));
 		glm::vec3 C = camera_right * sin(camera_fov / 2.0f * (M_PI / 180.0f)) * camera_aspectRatio;
-		glm::vec3 lower_right_corner = A - C - B;
-		glm::vec3 X = 2.0f * ((A - B) - lower_right_corner);
-		glm::vec3 Y = 2.0f * ((A - C) - lower_right_corner);
-		// Stop here if we have as many samples as we want
-		if ((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel) &&
-			(settings.max_paths_per_pixel != 0)) return;
-		// Trace one path per pixel (the omp parallel stuf magically distributes the 
-		// pathtracing on all cores of your CPU).
-#pragma omp parallel for
-		for (int y = 0; y < rendered_image.height; y++) {
-			for (int x = 0; x < rendered_image.width; x++) {
-				vec3 color;
-				Ray primaryRay;
-				primaryRay.o = camera_pos;
-				// Create a ray that starts in the camera position and points toward
-				// the current pixel on a virtual screen. 
-				vec2 screenCoord = vec2(float(x) / float(rendered_image.width), float(y) / float(rendered_image.height));
-				primaryRay.d = normalize(lower_right_corner + screenCoord.x * X + screenCoord.y * Y);
-				// Intersect ray with scene
-				if (intersect(primaryRay)) {
-					// If it hit something, evaluate the radiance from that point
-					color = Li(primaryRay);
-				}
-				else {
-					// Otherwise evaluate environment
-					color = Lenvironment(primaryRay.d);
-				}
-				// Accumulate the obtained radiance to the pixels color
-				float n = float(rendered_image.number_of_samples);
-				rendered_image.data[y * rendered_image.width + x] =
-					rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f)) +
-					(1.0f / (n + 1.0f)) * color;
+		Camera camera;
+		camera.position = camera_pos;
+		camera.lower_right_corner = A - C - B;
+		camera.X = 2.0f * ((A - B) - camera.lower_right_corner);
+		camera.Y = 2.0f * ((A - C) - camera.lower_right_corner);
+		return camera;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Report the tiles that have been finished in this pass and not yet 
+	// reported
+	///////////////////////////////////////////////////////////////////////////
+	static void reportFinishedTiles(vector<bool> & reported, const ProgressCallback & progress)
+	{
+		vector<Tile> finished_tiles;
+		for (size_t i = 0; i < tiles.size(); i++) {
+			if (!reported[i] && tile_finished_pass[i].load(memory_order_acquire) == pass_number) {
+				reported[i] = true;
+				finished_tiles.push_back(tiles[i]);
 			}
 		}
+		if (!finished_tiles.empty()) progress(finished_tiles);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace one path per pixel and accumulate the result in an image
+	///////////////////////////////////////////////////////////////////////////
+	bool tracePaths(vec3 camera_pos, vec3 camera_dir, vec3 camera_up, const ProgressCallback & progress)
+	{
+		waitForBVH();
+		Camera camera = createCamera(camera_pos, camera_dir, camera_up);
+		if (passes_cancelled) return false;
+		// A restart resets the per-pixel sample counts
+		pass_cancel_count = cancel_count;
+		const uint32_t restarts = restart_count;
+		if (restarts != pass_restart_count) {
+			pass_restart_count = restarts;
+			rendered_image.number_of_samples = 0;
+		}
+		if (rendered_image.number_of_samples == 0) {
+			std::fill(rendered_image.sample_count.begin(), rendered_image.sample_count.end(), 0);
+			std::fill(rendered_image.variance_m2.begin(), rendered_image.variance_m2.end(), 0.0f);
+		}
+		// Otherwise, if the camera has moved, carry the samples over to the
+		// new view
+		else if (settings.reprojection && !(camera == traced_camera)) {
+			reproject(traced_camera, camera);
+		}
+		traced_camera = camera;
+		// Stop here if every pixel has as many samples as we want, or has 
+		// converged to the target error
+		if (!planPass()) return false;
+		updateLights();
+		// Split the image into tiles if the resolution or tile size changed
+		const int tile_size = tileSize();
+		if (tiles_width != rendered_image.width || tiles_height != rendered_image.height || tiles_size != tile_size) {
+			buildTiles(rendered_image.width, rendered_image.height, tile_size, tiles);
+			tiles_width = rendered_image.width;
+			tiles_height = rendered_image.height;
+			tiles_size = tile_size;
+			tile_finished_pass.reset(new atomic<uint32_t>[tiles.size()]);
+			for (size_t i = 0; i < tiles.size(); i++) tile_finished_pass[i] = 0;
+		}
+		pass_number++;
+		// Trace the paths of this pass. The tiles are distributed on all cores of 
+		// your CPU, and cores that run out of tiles steal from the others. 
+		// The first thread also reports finished tiles now and then. 
+		const int packet_width = packetWidth();
+		const bool interleave = interleaving();
+		vector<bool> reported(tiles.size(), false);
+		auto last_report = chrono::steady_clock::now();
+		forEachTile(tiles, [&](const Tile & tile) {
+			if (passCancelled()) return;
+			if (settings.trace_mode == TRACE_WAVEFRONT) traceTileWavefront(tile, camera);
+			else if (settings.trace_mode != TRACE_PACKETS) traceTile(tile, camera);
+			else if (packet_width == 16) traceTilePackets<16>(tile, camera);
+			else if (packet_width == 8) traceTilePackets<8>(tile, camera);
+			else traceTilePackets<4>(tile, camera);
+			if (interleave && !passCancelled()) fillUntracedPixels(tile);
+			if (!passCancelled()) tile_finished_pass[&tile - tiles.data()].store(pass_number, memory_order_release);
+			if (progress && omp_get_thread_num() == 0 &&
+				chrono::duration<float>(chrono::steady_clock::now() - last_report).count() >= progress_interval) {
+				reportFinishedTiles(reported, progress);
+				last_report = chrono::steady_clock::now();
+			}
+		});
+		if (progress) reportFinishedTiles(reported, progress);
+		if (passCancelled()) return false;
 		rendered_image.number_of_samples += 1;
+		return true;
 	}
 };
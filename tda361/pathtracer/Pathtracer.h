@@ -3,7 +3,9 @@
 #include <vector>
 #include <Model.h>
 #include <omp.h>
+#include <functional>
 #include "HDRImage.h"
+#include "scheduler.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -11,6 +13,16 @@
 #define M_PI 3.14159265359f
 #define EPSILON 0.0001f
 
+///////////////////////////////////////////////////////////////////////////////
+// Ask the compiler to vectorize a loop (MSVC only has OpenMP 2.0, and
+// vectorizes what it can by itself)
+///////////////////////////////////////////////////////////////////////////////
+#if defined(_MSC_VER)
+#define PATHTRACER_SIMD
+#else
+#define PATHTRACER_SIMD _Pragma("omp simd")
+#endif
+
 using namespace glm; 
 
 namespace pathtracer
@@ -18,10 +30,28 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////////
 	// Path Tracer settings
 	///////////////////////////////////////////////////////////////////////////////
+	// The trace modes compute the same image, they only trace the rays in
+	// different orders
+	enum TraceMode {
+		TRACE_SINGLE_RAYS = 0,	// One rtcIntersect call per ray, paths traced depth first
+		TRACE_PACKETS = 1,		// Primary rays traced as coherent 2x2/4x2/4x4 packets
+		TRACE_WAVEFRONT = 2		// All paths of a tile traced breadth first, one bounce at a time
+	};
 	extern struct Settings {
 		int subsampling;
 		int max_bounces;
 		int max_paths_per_pixel;
+		int tile_size;			// Rounded up to a multiple of 4 with interleaved refinement
+		int trace_mode;
+		int sampler;
+		bool adaptive_sampling;	// Spend each pass's samples where the error is highest
+		float target_error;		// Relative error at which a pixel is done (0 = never)
+		bool batched_shading;	// Evaluate brdfs in batches sorted by material (see shading.h)
+		float frame_time_budget;// Seconds per pass while the camera moves, picks the subsampling (0 = off)
+		bool interleaved;		// Reach one sample per pixel over 16 passes, in Bayer order
+		bool reprojection;		// Keep the samples when the camera moves, reprojected to the new view
+		bool denoise;			// Filter the image before it is shown (see denoiser.h)
+		uint32_t seed;			// Picks the random numbers; images with different seeds can be merged
 	} settings; 
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -37,7 +67,24 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	extern struct Image {
 		int width, height, number_of_samples = 0; 
+		int subsampling = 0;	// The window is this many times larger in each direction
 		std::vector<glm::vec3> data;
+		// Number of samples accumulated in each pixel, and the running sum of
+		// squared differences from the mean of the pixels' luminance 
+		// (Welford's algorithm), from which we get the variance. 
+		std::vector<int> sample_count;
+		std::vector<float> variance_m2;
+		// How many samples each pixel gets in the current pass
+		std::vector<uint16_t> pass_samples;
+		// Number of pixels that have reached settings.target_error
+		int converged_pixels = 0;
+		// What the camera ray of each pixel hit: the distance to the hit 
+		// (FLT_MAX if it missed), the shading normal and the albedo (the 
+		// material's color) there. Reprojection checks the pixels against 
+		// the depth and normal, and the denoiser stops at edges in all three.
+		std::vector<float> depth;
+		std::vector<glm::vec3> normal;
+		std::vector<glm::vec3> albedo;
 		float * getPtr() { return &data[0].x; }
 	} rendered_image;
 
@@ -51,10 +98,82 @@ namespace pathtracer
 	} point_light;
 
 	///////////////////////////////////////////////////////////////////////////
-	// Restart rendering of image
+	// The virtual screen that primary rays are shot through
+	///////////////////////////////////////////////////////////////////////////
+	struct Camera
+	{
+		vec3 position, lower_right_corner, X, Y;
+		// The direction from the camera position toward pixel (x, y) on the 
+		// virtual screen. 
+		vec3 direction(int x, int y) const
+		{
+			vec2 screenCoord = vec2(float(x) / float(rendered_image.width), float(y) / float(rendered_image.height));
+			return normalize(lower_right_corner + screenCoord.x * X + screenCoord.y * Y);
+		}
+		bool operator==(const Camera & c) const
+		{
+			return position == c.position && lower_right_corner == c.lower_right_corner && X == c.X && Y == c.Y;
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set up the virtual screen for a camera at camera_pos, looking in 
+	// camera_dir, for the current resolution of the rendered image
+	///////////////////////////////////////////////////////////////////////////
+	Camera createCamera(vec3 camera_pos, vec3 camera_dir, vec3 camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Return the radiance from a certain direction wi from the environment
+	// map. If solid_angle is given, the map is filtered over roughly that
+	// solid angle around wi (the footprint of the ray). 
+	///////////////////////////////////////////////////////////////////////////
+	vec3 Lenvironment(const vec3 & wi, float solid_angle = 0.0f);
+	// The mip level of the environment map filtered over solid_angle
+	float environmentLod(const vec3 & wi, float solid_angle);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pick a direction wi toward the environment, in proportion to the 
+	// power arriving from it. Returns the radiance from wi and sets pdf to
+	// the probability density (per solid angle) of picking it. 
+	// environmentPdf() is the pdf for any given direction. 
+	///////////////////////////////////////////////////////////////////////////
+	vec3 sampleEnvironment(vec3 & wi, float & pdf);
+	float environmentPdf(const vec3 & wi);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add a new sample to the running average of pixel (x, y)
+	///////////////////////////////////////////////////////////////////////////
+	void accumulate(int x, int y, const vec3 & color);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Record what a camera ray of pixel (x, y) hit, before its sample is 
+	// accumulated. If the pixel's samples were reprojected from another 
+	// surface (the depth or the normal differ), they are dropped. 
+	///////////////////////////////////////////////////////////////////////////
+	void recordPrimaryHit(int x, int y, float depth, const vec3 & normal, const vec3 & albedo);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Restart rendering of image. May be called from another thread while 
+	// tracePaths() is running: the pass in flight is then cancelled, and the
+	// image is reset when the next pass starts. 
 	///////////////////////////////////////////////////////////////////////////
 	void restart();
 
+	///////////////////////////////////////////////////////////////////////////
+	// Cancel the pass in flight, from any thread, without restarting. 
+	///////////////////////////////////////////////////////////////////////////
+	void cancelPass();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Cancel the pass in flight (from any thread) and every pass started 
+	// until resumePasses() is called. The tiles of a cancelled pass stop at 
+	// their next row of pixels and drop their samples. passCancelled() is 
+	// what the tile loops check. 
+	///////////////////////////////////////////////////////////////////////////
+	void cancelPasses();
+	void resumePasses();
+	bool passCancelled();
+
 	///////////////////////////////////////////////////////////////////////////
 	// On window resize, window size is passed in, actual size of pathtraced
 	// image may be smaller (if we're subsampling for speed)
@@ -62,8 +181,37 @@ namespace pathtracer
 	void resize(int w, int h);
 
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
+	// Change the subsampling of the image (not settings.subsampling) for the
+	// window size last passed to resize(). If every new pixel lies within 
+	// one old pixel (the subsampling is divided by a whole number) and the 
+	// old image has samples, they are kept: each new pixel starts out with
+	// the mean of its old pixel and its share of the old pixel's samples.
+	// The same goes the other way (the subsampling is multiplied by a whole
+	// number): each new pixel gets the samples of the old ones it covers. 
+	// Otherwise rendering restarts. 
+	///////////////////////////////////////////////////////////////////////////
+	void setSubsampling(int subsampling);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Go on rendering from the samples in image (as read from a checkpoint,
+	// see checkpoint.h), taken with the camera given at the current size of
+	// rendered_image, instead of from the samples rendered_image has. The 
+	// buffers of image are swapped into rendered_image. Returns false (and
+	// changes nothing) if image has another size. Must not be called while
+	// tracePaths() runs. 
+	///////////////////////////////////////////////////////////////////////////
+	bool resumeImage(Image & image, vec3 camera_pos, vec3 camera_dir, vec3 camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace one path per pixel. Returns false if no pass was traced, because
+	// every pixel is done or the pass was cancelled. If progress is given, 
+	// it is called on one of the rendering threads every progress_interval
+	// seconds while the pass runs, and once at the end, with the tiles 
+	// finished since the last call. Their pixels in rendered_image are not
+	// written again during the pass. 
 	///////////////////////////////////////////////////////////////////////////
-	void tracePaths(vec3 camera_pos, vec3 camera_dir, vec3 camera_up);
+	typedef std::function<void(const std::vector<Tile> & finished_tiles)> ProgressCallback;
+	const float progress_interval = 1.0f / 60.0f;
+	bool tracePaths(vec3 camera_pos, vec3 camera_dir, vec3 camera_up, const ProgressCallback & progress = nullptr);
 };
 
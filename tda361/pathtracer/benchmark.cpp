@@ -0,0 +1,885 @@
+#include <chrono>
+#include <cfloat>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <random>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "material.h"
+#include "shading.h"
+#include "mipmap.h"
+#include "sampling.h"
+#include "scheduler.h"
+#include "imageio.h"
+#include "lights.h"
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Render a fixed set of scenes from fixed cameras and measure how fast the
+// pathtracer is: BVH build time, primary and secondary rays per second, the
+// cost of turning a hit into an Intersection, samples per second and the
+// error against a reference image after fixed amounts of render time.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// The benchmark scenes
+///////////////////////////////////////////////////////////////////////////////
+struct BenchmarkScene
+{
+	string name;
+	vector<pair<string, mat4>> models;
+	vec3 camera_position, camera_target;
+	vec3 light_position;
+	float light_intensity;
+	vector<pathtracer::PointLight> point_lights;	// Besides the main light
+	float environment_multiplier = 1.0f;
+};
+
+vector<BenchmarkScene> benchmarkScenes()
+{
+	vector<BenchmarkScene> scenes(5);
+	scenes[0].name = "cornell";
+	scenes[0].models.push_back(make_pair(string("../scenes/cornell.obj"), mat4(1.0f)));
+	scenes[0].camera_position = vec3(0.0f, 0.0f, 3.5f);
+	scenes[0].camera_target = vec3(0.0f, 0.0f, 0.0f);
+	scenes[0].light_position = vec3(0.0f, 0.8f, 0.0f);
+	scenes[0].light_intensity = 3.0f;
+
+	scenes[1].name = "ship";
+	scenes[1].models.push_back(make_pair(string("../scenes/NewShip.obj"), translate(vec3(0.0f, 10.0f, 0.0f))));
+	scenes[1].models.push_back(make_pair(string("../scenes/landingpad2.obj"), mat4(1.0f)));
+	scenes[1].camera_position = vec3(-30.0f, 10.0f, 30.0f);
+	scenes[1].camera_target = vec3(0.0f, 10.0f, 0.0f);
+	scenes[1].light_position = vec3(10.0f, 40.0f, 10.0f);
+	scenes[1].light_intensity = 2500.0f;
+
+	scenes[2].name = "city";
+	scenes[2].models.push_back(make_pair(string("../scenes/city.obj"), mat4(1.0f)));
+	scenes[2].camera_position = vec3(-70.0f, 45.0f, 70.0f);
+	scenes[2].camera_target = vec3(0.0f, 10.0f, 0.0f);
+	scenes[2].light_position = vec3(20.0f, 100.0f, 20.0f);
+	scenes[2].light_intensity = 15000.0f;
+
+	scenes[3].name = "island";
+	scenes[3].models.push_back(make_pair(string("../scenes/island.obj"), mat4(1.0f)));
+	scenes[3].camera_position = vec3(-100.0f, 40.0f, 100.0f);
+	scenes[3].camera_target = vec3(0.0f, 0.0f, 0.0f);
+	scenes[3].light_position = vec3(0.0f, 80.0f, 0.0f);
+	scenes[3].light_intensity = 15000.0f;
+
+	// The city at night, lit by a grid of 256 street lights
+	scenes[4] = scenes[2];
+	scenes[4].name = "city-lights";
+	scenes[4].light_intensity = 0.0f;
+	scenes[4].environment_multiplier = 0.02f;
+	for (int z = 0; z < 16; z++) {
+		for (int x = 0; x < 16; x++) {
+			pathtracer::PointLight light;
+			light.position = vec3(-48.0f + 6.4f * float(x), 6.0f, -48.0f + 6.4f * float(z));
+			light.color = ((x + z) % 3 == 0) ? vec3(1.0f, 0.6f, 0.3f) : vec3(1.0f, 0.9f, 0.8f);
+			light.intensity_multiplier = 40.0f;
+			scenes[4].point_lights.push_back(light);
+		}
+	}
+	return scenes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A combination of settings to benchmark, and what we measured for it
+///////////////////////////////////////////////////////////////////////////////
+struct Configuration
+{
+	int trace_mode;
+	int sampler;
+	int tile_size;
+};
+
+struct Result
+{
+	string scene;
+	Configuration configuration;
+	int triangles = 0;
+	double bytes_per_triangle = 0.0;		// Geometry and shading attributes, not the BVH
+	double unindexed_bytes_per_triangle = 0.0;
+	double load_time = 0.0;					// Seconds to load the models and add them to embree
+	double build_time = 0.0;				// Seconds to build the BVH
+	double embree_megabytes = 0.0;			// Held by embree after the build (mostly the BVH)
+	double primary_rays_per_second = 0.0;
+	double secondary_rays_per_second = 0.0;
+	double hit_lookup_ns = 0.0;				// Nanoseconds per getIntersection()
+	double map_hit_lookup_ns = 0.0;			// The same through std::maps (see MapHitLookup)
+	double samples_per_second = 0.0;
+	vector<double> samples_per_pixel;		// At each time budget
+	vector<double> rmse;					// At each time budget, < 0 without a reference
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Command line options
+///////////////////////////////////////////////////////////////////////////////
+struct Options
+{
+	vector<string> scenes;
+	vector<Configuration> configurations;
+	vector<double> budgets = { 1.0, 2.0, 4.0, 8.0 };
+	string environment_map = "../scenes/envmaps/001.hdr";
+	string reference_directory = "../scenes/references";
+	bool make_references = false;
+	bool check_shading = false;
+	bool check_rgb9e5 = false;
+	int reference_samples = 4096;
+	int width = 640, height = 360;
+	int max_bounces = 8;
+	double measure_time = 0.5;
+	string json_file, csv_file;
+};
+
+const char * trace_mode_names[] = { "single", "packets", "wavefront" };
+const char * sampler_names[] = { "independent", "halton", "sobol", "owen" };
+const char * bvh_quality_names[] = { "fast", "balanced", "high" };
+
+///////////////////////////////////////////////////////////////////////////////
+// The reference images are rendered with this trace mode. Every trace mode
+// computes the same image, so the error of any configuration is its error
+// in converging to it. The image does depend on the number of bounces, so
+// there is a reference for each number of bounces. 
+///////////////////////////////////////////////////////////////////////////////
+const pathtracer::TraceMode reference_trace_mode = pathtracer::TRACE_WAVEFRONT;
+
+void printUsage()
+{
+	cout << "Usage: pathtracer-benchmark [options]\n"
+		"  --scenes <a,b,...>            Scenes to run (default: all of cornell, ship, city, island,\n"
+		"                                city-lights)\n"
+		"  --trace-modes <a,b,...>       single, packets and/or wavefront (default: packets)\n"
+		"  --samplers <a,b,...>          independent, halton, sobol and/or owen (default: owen)\n"
+		"  --tile-sizes <a,b,...>        Tile sizes for the scheduler (default: 16)\n"
+		"  --budgets <a,b,...>           Render times in seconds to measure the error at (default: 1,2,4,8)\n"
+		"  --size <width> <height>       Resolution (default: 640 360)\n"
+		"  --max-bounces <n>             Maximum path length (default: 8)\n"
+		"  --env <file.hdr>              Environment map\n"
+		"  --compact                     Use embree's compact BVH (less memory, slower)\n"
+		"  --bvh-quality <quality>       fast, balanced or high (default: balanced)\n"
+		"  --references <directory>      Where the reference images are (default: ../scenes/references)\n"
+		"  --make-references             Render the reference images (for --max-bounces) instead of\n"
+		"                                benchmarking\n"
+		"  --reference-spp <n>           Samples per pixel of the reference images (default: 4096)\n"
+		"  --json <file>                 Write the results as JSON\n"
+		"  --csv <file>                  Write the results as CSV\n"
+		"  --check-shading               Check the material kernels against MaterialTree instead of\n"
+		"                                benchmarking\n"
+		"  --check-rgb9e5                Check the RGB9E5 round trip instead of benchmarking\n"
+		"Every combination of trace mode, sampler and tile size is benchmarked on every scene.\n";
+}
+
+vector<string> splitList(const string & list)
+{
+	vector<string> items;
+	stringstream ss(list);
+	string item;
+	while (getline(ss, item, ',')) {
+		if (!item.empty()) items.push_back(item);
+	}
+	return items;
+}
+
+int findName(const char * const * names, int number_of_names, const string & name, const char * what)
+{
+	for (int i = 0; i < number_of_names; i++) {
+		if (name == names[i]) return i;
+	}
+	cout << "Unknown " << what << ": " << name << ".\n";
+	exit(1);
+}
+
+Options parseCommandLine(int argc, char *argv[])
+{
+	Options options;
+	vector<int> trace_modes = { pathtracer::TRACE_PACKETS };
+	vector<int> samplers = { pathtracer::SAMPLER_OWEN_SOBOL };
+	vector<int> tile_sizes = { 16 };
+	int i = 1;
+	auto next = [&]() -> const char * {
+		if (i >= argc) {
+			cout << "Missing argument for " << argv[i - 1] << ".\n";
+			printUsage();
+			exit(1);
+		}
+		return argv[i++];
+	};
+
+	while (i < argc) {
+		string option = next();
+		if (option == "--scenes") options.scenes = splitList(next());
+		else if (option == "--trace-modes") {
+			trace_modes.clear();
+			for (auto & name : splitList(next())) trace_modes.push_back(findName(trace_mode_names, 3, name, "trace mode"));
+		}
+		else if (option == "--samplers") {
+			samplers.clear();
+			for (auto & name : splitList(next())) samplers.push_back(findName(sampler_names, 4, name, "sampler"));
+		}
+		else if (option == "--tile-sizes") {
+			tile_sizes.clear();
+			for (auto & size : splitList(next())) tile_sizes.push_back(std::max(1, atoi(size.c_str())));
+		}
+		else if (option == "--budgets") {
+			options.budgets.clear();
+			for (auto & budget : splitList(next())) options.budgets.push_back(atof(budget.c_str()));
+			sort(options.budgets.begin(), options.budgets.end());
+		}
+		else if (option == "--size") { options.width = atoi(next()); options.height = atoi(next()); }
+		else if (option == "--max-bounces") options.max_bounces = atoi(next());
+		else if (option == "--env") options.environment_map = next();
+		else if (option == "--compact") pathtracer::compact_scenes = true;
+		else if (option == "--bvh-quality") {
+			pathtracer::bvh_quality = pathtracer::BVHQuality(findName(bvh_quality_names, 3, next(), "BVH quality"));
+		}
+		else if (option == "--references") options.reference_directory = next();
+		else if (option == "--make-references") options.make_references = true;
+		else if (option == "--reference-spp") options.reference_samples = atoi(next());
+		else if (option == "--json") options.json_file = next();
+		else if (option == "--csv") options.csv_file = next();
+		else if (option == "--check-shading") options.check_shading = true;
+		else if (option == "--check-rgb9e5") options.check_rgb9e5 = true;
+		else if (option == "--help" || option == "-h") { printUsage(); exit(0); }
+		else {
+			cout << "Unknown option: " << option << ".\n";
+			printUsage();
+			exit(1);
+		}
+	}
+	if (options.budgets.empty()) {
+		cout << "At least one time budget is needed.\n";
+		exit(1);
+	}
+	for (int trace_mode : trace_modes) {
+		for (int sampler : samplers) {
+			for (int tile_size : tile_sizes) {
+				options.configurations.push_back({ trace_mode, sampler, tile_size });
+			}
+		}
+	}
+	return options;
+}
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trace the camera rays of a tile, the same way tracePaths() does in each
+// trace mode, but without shading. The hits are stored per pixel.
+///////////////////////////////////////////////////////////////////////////////
+void tracePrimaryTile(const pathtracer::Tile & tile, const pathtracer::Camera & camera, vector<pathtracer::Ray> & hits)
+{
+	const int width = pathtracer::rendered_image.width;
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++) {
+			pathtracer::Ray ray(camera.position, camera.direction(x, y));
+			pathtracer::intersect(ray);
+			hits[y * width + x] = ray;
+		}
+	}
+}
+
+template<int N>
+void tracePrimaryTilePackets(const pathtracer::Tile & tile, const pathtracer::Camera & camera, vector<pathtracer::Ray> & hits)
+{
+	const int width = pathtracer::rendered_image.width;
+	const int block_width = (N == 4) ? 2 : 4;
+	const int block_height = N / block_width;
+	for (int by = tile.y0; by < tile.y1; by += block_height) {
+		for (int bx = tile.x0; bx < tile.x1; bx += block_width) {
+			pathtracer::RayPacket<N> packet;
+			RTCORE_ALIGN(64) int valid[N];
+			for (int i = 0; i < N; i++) {
+				int x = bx + i % block_width, y = by + i / block_width;
+				valid[i] = (x < tile.x1 && y < tile.y1) ? -1 : 0;
+				if (valid[i]) packet.setRay(i, pathtracer::Ray(camera.position, camera.direction(x, y)));
+			}
+			pathtracer::intersect(valid, packet);
+			for (int i = 0; i < N; i++) {
+				if (valid[i]) hits[(by + i / block_width) * width + bx + i % block_width] = packet.getRay(i);
+			}
+		}
+	}
+}
+
+void tracePrimaryTileStream(const pathtracer::Tile & tile, const pathtracer::Camera & camera, vector<pathtracer::Ray> & hits)
+{
+	static thread_local pathtracer::RayQueue queue;
+	const int width = pathtracer::rendered_image.width;
+	queue.clear();
+	queue.reserve(size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++) {
+			queue.push(pathtracer::Ray(camera.position, camera.direction(x, y)));
+		}
+	}
+	pathtracer::intersect(queue, true);
+	size_t i = 0;
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++) {
+			hits[y * width + x] = queue.getRay(i++);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trace a list of (incoherent) rays in the given trace mode
+///////////////////////////////////////////////////////////////////////////////
+template<int N>
+void traceRayListPackets(vector<pathtracer::Ray> & rays)
+{
+	const int number_of_packets = int((rays.size() + N - 1) / N);
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int p = 0; p < number_of_packets; p++) {
+		pathtracer::RayPacket<N> packet;
+		RTCORE_ALIGN(64) int valid[N];
+		for (int i = 0; i < N; i++) {
+			size_t r = size_t(p) * N + i;
+			valid[i] = r < rays.size() ? -1 : 0;
+			if (valid[i]) packet.setRay(i, rays[r]);
+		}
+		pathtracer::intersect(valid, packet);
+		for (int i = 0; i < N; i++) {
+			if (valid[i]) rays[size_t(p) * N + i] = packet.getRay(i);
+		}
+	}
+}
+
+void traceRayList(vector<pathtracer::Ray> & rays, int trace_mode)
+{
+	if (trace_mode == pathtracer::TRACE_SINGLE_RAYS) {
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int i = 0; i < int(rays.size()); i++) {
+			pathtracer::intersect(rays[i]);
+		}
+	}
+	else if (trace_mode == pathtracer::TRACE_PACKETS) {
+		if (pathtracer::packetWidth() == 16) traceRayListPackets<16>(rays);
+		else if (pathtracer::packetWidth() == 8) traceRayListPackets<8>(rays);
+		else traceRayListPackets<4>(rays);
+	}
+	else {
+		const int chunk_size = 4096;
+		const int number_of_chunks = int((rays.size() + chunk_size - 1) / chunk_size);
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int c = 0; c < number_of_chunks; c++) {
+			static thread_local pathtracer::RayQueue queue;
+			const size_t begin = size_t(c) * chunk_size;
+			const size_t end = std::min(rays.size(), begin + chunk_size);
+			queue.clear();
+			for (size_t i = begin; i < end; i++) queue.push(rays[i]);
+			pathtracer::intersect(queue, false);
+			for (size_t i = begin; i < end; i++) rays[i] = queue.getRay(i - begin);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The hit lookup as it was before the flat hit-attribute tables of 
+// getIntersection(): the model and mesh of a hit are found through 
+// std::maps keyed by its IDs. Kept to measure what the tables save, so it
+// computes the same Intersection. 
+///////////////////////////////////////////////////////////////////////////////
+struct MapHitLookup
+{
+	map<uint64_t, const labhelper::Model *> models;
+	map<uint64_t, const labhelper::Mesh *> meshes;
+	map<uint32_t, mat3> normal_matrices;
+
+	static uint64_t key(uint32_t inst_ID, uint32_t geom_ID) { return (uint64_t(inst_ID) << 32) | geom_ID; }
+	void clear() { models.clear(); meshes.clear(); normal_matrices.clear(); }
+	// The geometries of a model get their geomIDs in the order of its meshes
+	void add(uint32_t inst_ID, const labhelper::Model * model, const mat4 & model_matrix)
+	{
+		for (uint32_t geom_ID = 0; geom_ID < uint32_t(model->m_meshes.size()); geom_ID++) {
+			models[key(inst_ID, geom_ID)] = model;
+			meshes[key(inst_ID, geom_ID)] = &model->m_meshes[geom_ID];
+		}
+		normal_matrices[inst_ID] = inverse(transpose(mat3(model_matrix)));
+	}
+	pathtracer::Intersection lookup(const pathtracer::Ray & r) const
+	{
+		const labhelper::Model * model = models.find(key(r.instID, r.geomID))->second;
+		const labhelper::Mesh * mesh = meshes.find(key(r.instID, r.geomID))->second;
+		const mat3 & normal_matrix = normal_matrices.find(r.instID)->second;
+		const uint32_t * v = &model->m_indices[mesh->m_start_index + 3 * r.primID];
+		const vec3 * normals = &model->m_indexed_normals[mesh->m_start_indexed_vertex];
+		const vec2 * texture_coordinates = &model->m_indexed_texture_coordinates[mesh->m_start_indexed_vertex];
+		pathtracer::Intersection i;
+		i.material = &model->m_materials[mesh->m_material_idx];
+		i.shading = nullptr;
+		float w = 1.0f - (r.u + r.v);
+		i.shading_normal = normalize(normal_matrix * (w * normals[v[0]] + r.u * normals[v[1]] + r.v * normals[v[2]]));
+		i.texture_coordinate = w * texture_coordinates[v[0]] + r.u * texture_coordinates[v[1]] + 
+			r.v * texture_coordinates[v[2]];
+		i.geometry_normal = -normalize(normal_matrix * r.n);
+		i.position = r.o + r.tfar * r.d;
+		i.wo = normalize(-r.d);
+		return i;
+	}
+};
+MapHitLookup map_hit_lookup;
+
+///////////////////////////////////////////////////////////////////////////////
+// Measure primary and secondary ray throughput and the cost of a hit lookup.
+// Each measurement is repeated until it has run for at least measure_time.
+///////////////////////////////////////////////////////////////////////////////
+void measureRays(const pathtracer::Camera & camera, const Configuration & configuration, double measure_time, Result & result)
+{
+	const int width = pathtracer::rendered_image.width, height = pathtracer::rendered_image.height;
+	vector<pathtracer::Tile> tiles;
+	pathtracer::buildTiles(width, height, configuration.tile_size, tiles);
+	vector<pathtracer::Ray> hits(width * height);
+
+	// Primary rays
+	const int packet_width = pathtracer::packetWidth();
+	double rays = 0.0, elapsed = 0.0;
+	auto start = chrono::steady_clock::now();
+	do {
+		pathtracer::forEachTile(tiles, [&](const pathtracer::Tile & tile) {
+			if (configuration.trace_mode == pathtracer::TRACE_WAVEFRONT) tracePrimaryTileStream(tile, camera, hits);
+			else if (configuration.trace_mode != pathtracer::TRACE_PACKETS) tracePrimaryTile(tile, camera, hits);
+			else if (packet_width == 16) tracePrimaryTilePackets<16>(tile, camera, hits);
+			else if (packet_width == 8) tracePrimaryTilePackets<8>(tile, camera, hits);
+			else tracePrimaryTilePackets<4>(tile, camera, hits);
+		});
+		rays += double(width * height);
+		elapsed = secondsSince(start);
+	} while (elapsed < measure_time);
+	result.primary_rays_per_second = rays / elapsed;
+
+	// Secondary rays, leaving each primary hit in a cosine weighted random
+	// direction
+	vector<int> hit_pixels;
+	for (int i = 0; i < width * height; i++) {
+		if (hits[i].geomID != RTC_INVALID_GEOMETRY_ID) hit_pixels.push_back(i);
+	}
+	vector<pathtracer::Ray> secondary(hit_pixels.size());
+#pragma omp parallel for
+	for (int i = 0; i < int(hit_pixels.size()); i++) {
+		const int pixel = hit_pixels[i];
+		pathtracer::Intersection hit = pathtracer::getIntersection(hits[pixel]);
+		pathtracer::startPixelSample(pixel % width, pixel / width, 0);
+		pathtracer::Diffuse diffuse(vec3(1.0f));
+		vec3 wi;
+		float pdf;
+		diffuse.sample_wi(wi, hit.wo, hit.shading_normal, pdf);
+		const float side = dot(wi, hit.geometry_normal) > 0.0f ? EPSILON : -EPSILON;
+		secondary[i] = pathtracer::Ray(hit.position + side * hit.geometry_normal, wi);
+	}
+	if (!secondary.empty()) {
+		vector<pathtracer::Ray> rays_to_trace;
+		rays = 0.0;
+		elapsed = 0.0;
+		do {
+			// Only the tracing is timed, not resetting the rays
+			rays_to_trace = secondary;
+			start = chrono::steady_clock::now();
+			traceRayList(rays_to_trace, configuration.trace_mode);
+			elapsed += secondsSince(start);
+			rays += double(rays_to_trace.size());
+		} while (elapsed < measure_time);
+		result.secondary_rays_per_second = rays / elapsed;
+	}
+
+	// Hit lookup, on one thread
+	if (!hit_pixels.empty()) {
+		vec3 checksum(0.0f);
+		double lookups = 0.0;
+		start = chrono::steady_clock::now();
+		do {
+			for (int pixel : hit_pixels) {
+				pathtracer::Intersection hit = pathtracer::getIntersection(hits[pixel]);
+				checksum += hit.shading_normal;
+			}
+			lookups += double(hit_pixels.size());
+			elapsed = secondsSince(start);
+		} while (elapsed < measure_time);
+		result.hit_lookup_ns = elapsed * 1e9 / lookups;
+
+		lookups = 0.0;
+		start = chrono::steady_clock::now();
+		do {
+			for (int pixel : hit_pixels) {
+				pathtracer::Intersection hit = map_hit_lookup.lookup(hits[pixel]);
+				checksum += hit.shading_normal;
+			}
+			lookups += double(hit_pixels.size());
+			elapsed = secondsSince(start);
+		} while (elapsed < measure_time);
+		result.map_hit_lookup_ns = elapsed * 1e9 / lookups;
+		if (checksum.x == 12345.0f) cout << " ";	// Keep the loops from being optimized away
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Root mean square error of the rendered image against a reference
+///////////////////////////////////////////////////////////////////////////////
+double rmse(const pathtracer::Image & image, const pathtracer::Image & reference)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < image.data.size(); i++) {
+		vec3 d = image.data[i] - reference.data[i];
+		sum += double(dot(d, d));
+	}
+	return sqrt(sum / (3.0 * double(image.data.size())));
+}
+
+double meanSamplesPerPixel()
+{
+	double samples = 0.0;
+	for (int n : pathtracer::rendered_image.sample_count) samples += double(n);
+	return samples / double(pathtracer::rendered_image.sample_count.size());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Render progressively and record samples per pixel and error each time a
+// time budget has been used up. Only the time spent in tracePaths() counts.
+///////////////////////////////////////////////////////////////////////////////
+void measureConvergence(const BenchmarkScene & scene, const vector<double> & budgets,
+	const pathtracer::Image * reference, Result & result)
+{
+	vec3 camera_direction = normalize(scene.camera_target - scene.camera_position);
+	pathtracer::restart();
+	double render_time = 0.0;
+	size_t budget = 0;
+	while (budget < budgets.size()) {
+		auto start = chrono::steady_clock::now();
+		const bool finished = !pathtracer::tracePaths(scene.camera_position, camera_direction, vec3(0.0f, 1.0f, 0.0f));
+		render_time += secondsSince(start);
+		while (budget < budgets.size() && (render_time >= budgets[budget] || finished)) {
+			result.samples_per_pixel.push_back(meanSamplesPerPixel());
+			result.rmse.push_back(reference ? rmse(pathtracer::rendered_image, *reference) : -1.0);
+			budget++;
+		}
+	}
+	result.samples_per_second = meanSamplesPerPixel() * double(pathtracer::rendered_image.sample_count.size()) / render_time;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Write the results
+///////////////////////////////////////////////////////////////////////////////
+void printResult(const Result & r, const vector<double> & budgets)
+{
+	cout << fixed << setprecision(3)
+		<< r.scene << " [" << trace_mode_names[r.configuration.trace_mode] << ", "
+		<< sampler_names[r.configuration.sampler] << ", tile " << r.configuration.tile_size << "]\n"
+		<< "  triangles:           " << r.triangles << "\n"
+		<< "  geometry:            " << r.bytes_per_triangle << " bytes/triangle ("
+		<< r.unindexed_bytes_per_triangle << " unindexed)\n"
+		<< "  load:                " << r.load_time << " s\n"
+		<< "  BVH build:           " << r.build_time << " s (" << bvh_quality_names[pathtracer::bvh_quality] << ")\n"
+		<< "  embree memory:       " << r.embree_megabytes << " MB\n"
+		<< "  primary rays:        " << r.primary_rays_per_second * 1e-6 << " Mrays/s\n"
+		<< "  secondary rays:      " << r.secondary_rays_per_second * 1e-6 << " Mrays/s\n"
+		<< "  hit lookup:          " << r.hit_lookup_ns << " ns (" << r.map_hit_lookup_ns << " ns through std::map)\n"
+		<< "  samples:             " << r.samples_per_second * 1e-6 << " Msamples/s\n";
+	for (size_t i = 0; i < budgets.size(); i++) {
+		cout << "  after " << setw(7) << budgets[i] << " s:     " << r.samples_per_pixel[i] << " spp";
+		if (r.rmse[i] >= 0.0) cout << ", RMSE " << setprecision(6) << r.rmse[i] << setprecision(3);
+		cout << "\n";
+	}
+	cout.unsetf(ios::floatfield);
+}
+
+void writeJSON(const string & filename, const vector<Result> & results, const Options & options)
+{
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "Failed to write " << filename << ".\n";
+		return;
+	}
+	file << setprecision(9);
+	file << "{\n  \"width\": " << options.width << ",\n  \"height\": " << options.height
+		<< ",\n  \"max_bounces\": " << options.max_bounces << ",\n  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result & r = results[i];
+		file << "    {\n"
+			<< "      \"scene\": \"" << r.scene << "\",\n"
+			<< "      \"trace_mode\": \"" << trace_mode_names[r.configuration.trace_mode] << "\",\n"
+			<< "      \"sampler\": \"" << sampler_names[r.configuration.sampler] << "\",\n"
+			<< "      \"tile_size\": " << r.configuration.tile_size << ",\n"
+			<< "      \"triangles\": " << r.triangles << ",\n"
+			<< "      \"bytes_per_triangle\": " << r.bytes_per_triangle << ",\n"
+			<< "      \"unindexed_bytes_per_triangle\": " << r.unindexed_bytes_per_triangle << ",\n"
+			<< "      \"load_seconds\": " << r.load_time << ",\n"
+			<< "      \"bvh_build_seconds\": " << r.build_time << ",\n"
+			<< "      \"bvh_quality\": \"" << bvh_quality_names[pathtracer::bvh_quality] << "\",\n"
+			<< "      \"embree_megabytes\": " << r.embree_megabytes << ",\n"
+			<< "      \"primary_rays_per_second\": " << r.primary_rays_per_second << ",\n"
+			<< "      \"secondary_rays_per_second\": " << r.secondary_rays_per_second << ",\n"
+			<< "      \"hit_lookup_ns\": " << r.hit_lookup_ns << ",\n"
+			<< "      \"map_hit_lookup_ns\": " << r.map_hit_lookup_ns << ",\n"
+			<< "      \"samples_per_second\": " << r.samples_per_second << ",\n"
+			<< "      \"budgets\": [";
+		for (size_t b = 0; b < options.budgets.size(); b++) {
+			file << (b ? ", " : "") << "{ \"seconds\": " << options.budgets[b]
+				<< ", \"samples_per_pixel\": " << r.samples_per_pixel[b] << ", \"rmse\": ";
+			if (r.rmse[b] >= 0.0) file << r.rmse[b];
+			else file << "null";
+			file << " }";
+		}
+		file << "]\n    }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	file << "  ]\n}\n";
+	cout << "Wrote " << filename << ".\n";
+}
+
+void writeCSV(const string & filename, const vector<Result> & results, const Options & options)
+{
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "Failed to write " << filename << ".\n";
+		return;
+	}
+	file << setprecision(9);
+	file << "scene,trace_mode,sampler,tile_size,width,height,triangles,bytes_per_triangle,"
+		"unindexed_bytes_per_triangle,load_seconds,bvh_build_seconds,bvh_quality,embree_megabytes,"
+		"primary_rays_per_second,secondary_rays_per_second,hit_lookup_ns,map_hit_lookup_ns,samples_per_second";
+	for (double budget : options.budgets) file << ",spp_at_" << budget << "s,rmse_at_" << budget << "s";
+	file << "\n";
+	for (const Result & r : results) {
+		file << r.scene << "," << trace_mode_names[r.configuration.trace_mode] << ","
+			<< sampler_names[r.configuration.sampler] << "," << r.configuration.tile_size << ","
+			<< options.width << "," << options.height << "," << r.triangles << ","
+			<< r.bytes_per_triangle << "," << r.unindexed_bytes_per_triangle << ","
+			<< r.load_time << "," << r.build_time << "," << bvh_quality_names[pathtracer::bvh_quality] << ","
+			<< r.embree_megabytes << "," << r.primary_rays_per_second << ","
+			<< r.secondary_rays_per_second << "," << r.hit_lookup_ns << "," << r.map_hit_lookup_ns << ","
+			<< r.samples_per_second;
+		for (size_t b = 0; b < options.budgets.size(); b++) {
+			file << "," << r.samples_per_pixel[b] << ",";
+			if (r.rmse[b] >= 0.0) file << r.rmse[b];
+		}
+		file << "\n";
+	}
+	cout << "Wrote " << filename << ".\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks of the building blocks of the renderer, run instead of the 
+// benchmark. Each one prints the largest error it finds and returns false
+// if that is above its tolerance. 
+///////////////////////////////////////////////////////////////////////////////
+
+// The material kernels of shading.h against the MaterialTree they stand in
+// for: the brdf and pdf of 100k random pairs of directions, over materials
+// with and without each of the layers. 
+bool checkShading()
+{
+	const float tolerance = 1e-6f;
+	const int number_of_entries = 100000;
+	mt19937 rng(3);
+	uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	auto randomDirection = [&]() {
+		return normalize(vec3(uniform(rng), uniform(rng), uniform(rng)) * 2.0f - 1.0f);
+	};
+
+	vector<labhelper::Material> materials(7);
+	for (auto & m : materials) {
+		m.m_color = vec3(uniform(rng), uniform(rng), uniform(rng));
+		m.m_reflectivity = uniform(rng);
+		m.m_metalness = uniform(rng) < 0.3f ? 0.0f : uniform(rng);
+		m.m_fresnel = uniform(rng);
+		m.m_shininess = 200.0f * uniform(rng);
+	}
+	// Only the diffuse base, only metal and only the dielectric layer
+	materials[0].m_reflectivity = 0.0f;
+	materials[5].m_reflectivity = 1.0f;
+	materials[5].m_metalness = 1.0f;
+	materials[6].m_reflectivity = 1.0f;
+	materials[6].m_metalness = 0.0f;
+	vector<pathtracer::ShadingMaterial> shading_materials;
+	for (auto & m : materials) shading_materials.push_back(pathtracer::makeShadingMaterial(m));
+
+	pathtracer::ShadingBatch batch;
+	vector<vec3> reference_f(number_of_entries);
+	vector<float> reference_pdf(number_of_entries);
+	for (int i = 0; i < number_of_entries; i++) {
+		const int k = int(rng() % materials.size());
+		const vec3 n = randomDirection(), wo = randomDirection();
+		vec3 wi = randomDirection();
+		// Every other wi near the mirror direction, where the microfacet 
+		// layers peak
+		if (i % 2 == 1) wi = normalize(reflect(-wo, normalize(n + 0.1f * wi)));
+		pathtracer::MaterialTree tree(materials[k]);
+		reference_f[i] = tree.brdf().f(wi, wo, n);
+		reference_pdf[i] = tree.brdf().pdf(wi, wo, n);
+		batch.push(&shading_materials[k], wi, wo, n);
+	}
+	batch.evaluate();
+
+	// Relative errors, but not below 1e-3 where the brdf or pdf is about 0
+	float f_error = 0.0f, pdf_error = 0.0f;
+	for (int i = 0; i < number_of_entries; i++) {
+		const float f = length(batch.f(i) - reference_f[i]) / std::max(1e-3f, length(reference_f[i]));
+		const float pdf = abs(batch.pdf(i) - reference_pdf[i]) / std::max(1e-3f, reference_pdf[i]);
+		// A NaN on either side counts as a failure
+		f_error = f == f ? std::max(f_error, f) : FLT_MAX;
+		pdf_error = pdf == pdf ? std::max(pdf_error, pdf) : FLT_MAX;
+	}
+	cout << "Shading kernels against MaterialTree, " << number_of_entries << " entries: largest relative error "
+		<< f_error << " in f, " << pdf_error << " in pdf (tolerance " << tolerance << ").\n";
+	return f_error <= tolerance && pdf_error <= tolerance;
+}
+
+// The RGB9E5 texels of the environment map mip pyramid: the error of a round
+// trip is at most half a step of the 9 bit mantissa of the largest 
+// component, which is 2^-9 of that component. 
+bool checkRGB9E5()
+{
+	const float tolerance = 1.0f / 512.0f;
+	const int number_of_colors = 1000000;
+	mt19937 rng(3);
+	uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	float error = 0.0f;
+	for (int i = 0; i < number_of_colors; i++) {
+		// Largest component from 2^-10 to 2^15, in a random channel
+		const float largest = exp2(25.0f * uniform(rng) - 10.0f);
+		vec3 color = largest * vec3(uniform(rng), uniform(rng), uniform(rng));
+		color[rng() % 3] = largest;
+		const vec3 d = abs(unpackRGB9E5(packRGB9E5(color)) - color) / largest;
+		error = std::max(error, std::max(d.x, std::max(d.y, d.z)));
+	}
+	cout << "RGB9E5 round trip, " << number_of_colors << " colors: largest error " << error
+		<< " of the largest component (tolerance " << tolerance << ").\n";
+	return error <= tolerance;
+}
+
+int main(int argc, char *argv[])
+{
+	Options options = parseCommandLine(argc, argv);
+	if (options.check_shading || options.check_rgb9e5) {
+		bool passed = true;
+		if (options.check_shading) passed = checkShading() && passed;
+		if (options.check_rgb9e5) passed = checkRGB9E5() && passed;
+		return passed ? 0 : 1;
+	}
+	vector<BenchmarkScene> scenes = benchmarkScenes();
+	if (!options.scenes.empty()) {
+		vector<BenchmarkScene> selected;
+		for (auto & name : options.scenes) {
+			auto scene = find_if(scenes.begin(), scenes.end(), [&](const BenchmarkScene & s) { return s.name == name; });
+			if (scene == scenes.end()) {
+				cout << "Unknown scene: " << name << ".\n";
+				exit(1);
+			}
+			selected.push_back(*scene);
+		}
+		scenes = selected;
+	}
+
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = options.max_bounces;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.adaptive_sampling = false;
+	pathtracer::settings.target_error = 0.0f;
+	pathtracer::settings.batched_shading = true;
+	pathtracer::point_light.color = vec3(1.0f);
+	pathtracer::environment.map.load(options.environment_map);
+	pathtracer::environment.multiplier = 1.0f;
+	pathtracer::resize(options.width, options.height);
+
+	vector<Result> results;
+	for (auto & scene : scenes) {
+		///////////////////////////////////////////////////////////////////////
+		// Load and build the scene
+		///////////////////////////////////////////////////////////////////////
+		Result scene_result;
+		scene_result.scene = scene.name;
+		auto start = chrono::steady_clock::now();
+		vector<labhelper::Model *> models;
+		for (auto & m : scene.models) {
+			models.push_back(labhelper::loadModelFromOBJ(m.first));
+			map_hit_lookup.add(pathtracer::addModel(models.back(), m.second), models.back(), m.second);
+			for (auto & mesh : models.back()->m_meshes) scene_result.triangles += mesh.m_number_of_vertices / 3;
+		}
+		scene_result.load_time = secondsSince(start);
+		start = chrono::steady_clock::now();
+		pathtracer::buildBVH();
+		scene_result.build_time = secondsSince(start);
+		scene_result.embree_megabytes = double(pathtracer::build_stats.embree_bytes) / (1024.0 * 1024.0);
+		const double unique_triangles = double(std::max<size_t>(1, pathtracer::geometry_stats.triangles));
+		scene_result.bytes_per_triangle = double(pathtracer::geometry_stats.bytes) / unique_triangles;
+		scene_result.unindexed_bytes_per_triangle = double(pathtracer::geometry_stats.unindexed_bytes) / unique_triangles;
+		pathtracer::point_light.position = scene.light_position;
+		pathtracer::point_light.intensity_multiplier = scene.light_intensity;
+		pathtracer::point_lights = scene.point_lights;
+		pathtracer::environment.multiplier = scene.environment_multiplier;
+		vec3 camera_direction = normalize(scene.camera_target - scene.camera_position);
+		pathtracer::Camera camera = pathtracer::createCamera(scene.camera_position, camera_direction, vec3(0.0f, 1.0f, 0.0f));
+		const string reference_file = options.reference_directory + "/" + scene.name + "-" + 
+			to_string(options.max_bounces) + "-bounces.pfm";
+
+		if (options.make_references) {
+			///////////////////////////////////////////////////////////////////
+			// Render the reference image
+			///////////////////////////////////////////////////////////////////
+			pathtracer::settings.trace_mode = reference_trace_mode;
+			pathtracer::settings.sampler = pathtracer::SAMPLER_OWEN_SOBOL;
+			pathtracer::settings.tile_size = 16;
+			pathtracer::settings.max_paths_per_pixel = options.reference_samples;
+			pathtracer::restart();
+			cout << "Rendering reference for " << scene.name << " (" << trace_mode_names[reference_trace_mode] << ", " 
+				<< options.max_bounces << " bounces)..." << flush;
+			for (;;) {
+				if (!pathtracer::tracePaths(scene.camera_position, camera_direction, vec3(0.0f, 1.0f, 0.0f))) break;
+			}
+			pathtracer::settings.max_paths_per_pixel = 0;
+			if (pathtracer::writePFM(reference_file, pathtracer::rendered_image)) cout << "wrote " << reference_file << ".\n";
+			else cout << "failed to write " << reference_file << ".\n";
+		}
+		else {
+			///////////////////////////////////////////////////////////////////
+			// Benchmark every configuration
+			///////////////////////////////////////////////////////////////////
+			pathtracer::Image reference;
+			bool has_reference = pathtracer::readPFM(reference_file, reference);
+			if (has_reference && (reference.width != options.width || reference.height != options.height)) {
+				cout << "Reference " << reference_file << " is " << reference.width << "x" << reference.height
+					<< ", not " << options.width << "x" << options.height << ". Skipping RMSE.\n";
+				has_reference = false;
+			}
+			else if (!has_reference) {
+				cout << "No reference image " << reference_file << " (see --make-references). Skipping RMSE.\n";
+			}
+			for (auto & configuration : options.configurations) {
+				Result result = scene_result;
+				result.configuration = configuration;
+				pathtracer::settings.trace_mode = configuration.trace_mode;
+				pathtracer::settings.sampler = configuration.sampler;
+				pathtracer::settings.tile_size = configuration.tile_size;
+				measureRays(camera, configuration, options.measure_time, result);
+				measureConvergence(scene, options.budgets, has_reference ? &reference : nullptr, result);
+				printResult(result, options.budgets);
+				results.push_back(result);
+			}
+		}
+
+		pathtracer::clearScene();
+		map_hit_lookup.clear();
+		for (auto model : models) {
+			labhelper::freeModel(model);
+		}
+	}
+
+	if (!options.json_file.empty()) writeJSON(options.json_file, results, options);
+	if (!options.csv_file.empty()) writeCSV(options.csv_file, results, options);
+	return 0;
+}
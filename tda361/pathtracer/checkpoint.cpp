@@ -0,0 +1,358 @@
+#include "checkpoint.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "embree.h"
+#include "lights.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Hash eight bytes at a time, and the bytes that are left one by one
+	///////////////////////////////////////////////////////////////////////////
+	uint64_t hashBytes(uint64_t hash, const void * data, size_t size)
+	{
+		const uint64_t prime = 1099511628211ull;
+		const uint8_t * bytes = (const uint8_t *)data;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			uint64_t word;
+			memcpy(&word, bytes + i, sizeof(word));
+			hash = (hash ^ word) * prime;
+			hash ^= hash >> 29;
+		}
+		for (; i < size; i++) hash = (hash ^ bytes[i]) * prime;
+		return hash;
+	}
+
+	uint64_t hashLargeBytes(uint64_t hash, const void * data, size_t size)
+	{
+		const size_t block_size = size_t(1) << 20;
+		const int number_of_blocks = int((size + block_size - 1) / block_size);
+		const uint8_t * bytes = (const uint8_t *)data;
+		vector<uint64_t> block_hashes(number_of_blocks);
+#pragma omp parallel for
+		for (int i = 0; i < number_of_blocks; i++) {
+			const size_t begin = size_t(i) * block_size;
+			block_hashes[i] = hashBytes(hash_seed, bytes + begin, std::min(block_size, size - begin));
+		}
+		hash = hashValue(hash, size);
+		return hashBytes(hash, block_hashes.data(), block_hashes.size() * sizeof(uint64_t));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hash what the image depends on. The environment map is hashed by its
+	// smaller mip levels, which are cheap to hash and differ between maps.
+	///////////////////////////////////////////////////////////////////////////
+	const int environment_hash_size = 64;
+
+	uint64_t checkpointHash(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up)
+	{
+		uint64_t hash = hashScene(hash_seed);
+		hash = hashValue(hash, point_light.intensity_multiplier);
+		hash = hashValue(hash, point_light.color);
+		hash = hashValue(hash, point_light.position);
+		for (const PointLight & light : point_lights) {
+			hash = hashValue(hash, light.intensity_multiplier);
+			hash = hashValue(hash, light.color);
+			hash = hashValue(hash, light.position);
+		}
+		hash = hashValue(hash, environment.multiplier);
+		hash = hashValue(hash, environment.map.size);
+		for (const MipMap::Level & level : environment.map.mipmap.levels) {
+			if (level.width > environment_hash_size || level.height > environment_hash_size) continue;
+			hash = hashBytes(hash, level.texels.data(), level.texels.size() * sizeof(uint32_t));
+		}
+		hash = hashValue(hash, settings.max_bounces);
+		hash = hashValue(hash, settings.trace_mode);
+		hash = hashValue(hash, settings.sampler);
+		hash = hashValue(hash, settings.adaptive_sampling);
+		hash = hashValue(hash, settings.batched_shading);
+		hash = hashValue(hash, settings.interleaved);
+		hash = hashValue(hash, rendered_image.width);
+		hash = hashValue(hash, rendered_image.height);
+		hash = hashValue(hash, camera_pos);
+		hash = hashValue(hash, camera_dir);
+		hash = hashValue(hash, camera_up);
+		return hash;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Copy the image to a checkpoint and back
+	///////////////////////////////////////////////////////////////////////////
+	void makeCheckpoint(Checkpoint & checkpoint, const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up)
+	{
+		checkpoint.hash = checkpointHash(camera_pos, camera_dir, camera_up);
+		checkpoint.seed = settings.seed;
+		checkpoint.camera_position = camera_pos;
+		checkpoint.camera_direction = camera_dir;
+		checkpoint.camera_up = camera_up;
+		Image & image = checkpoint.image;
+		image.width = rendered_image.width;
+		image.height = rendered_image.height;
+		image.subsampling = rendered_image.subsampling;
+		image.number_of_samples = rendered_image.number_of_samples;
+		image.converged_pixels = rendered_image.converged_pixels;
+		image.data = rendered_image.data;
+		image.sample_count = rendered_image.sample_count;
+		image.variance_m2 = rendered_image.variance_m2;
+		image.depth = rendered_image.depth;
+		image.normal = rendered_image.normal;
+		image.albedo = rendered_image.albedo;
+	}
+
+	bool resumeCheckpoint(Checkpoint & checkpoint, const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up)
+	{
+		if (checkpoint.seed != settings.seed) return false;
+		if (checkpoint.hash != checkpointHash(camera_pos, camera_dir, camera_up)) return false;
+		return resumeImage(checkpoint.image, camera_pos, camera_dir, camera_up);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The file: a header, and then the buffers one after the other, as raw
+	// little endian values
+	///////////////////////////////////////////////////////////////////////////
+	const char checkpoint_magic[4] = { 'P', 'T', 'C', 'K' };
+	const uint32_t checkpoint_version = 1;
+
+	struct CheckpointHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t hash;
+		uint32_t seed;
+		int32_t width, height, subsampling;
+		int32_t number_of_samples, converged_pixels;
+		float camera[9];		// Position, direction and up
+	};
+
+	template<typename T>
+	static void writeBuffer(ostream & stream, const vector<T> & buffer)
+	{
+		stream.write((const char *)buffer.data(), buffer.size() * sizeof(T));
+	}
+
+	template<typename T>
+	static void readBuffer(istream & stream, vector<T> & buffer, size_t size)
+	{
+		buffer.resize(size);
+		stream.read((char *)buffer.data(), size * sizeof(T));
+	}
+
+	bool writeCheckpoint(ostream & stream, const Checkpoint & checkpoint)
+	{
+		const Image & image = checkpoint.image;
+		CheckpointHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+		header.version = checkpoint_version;
+		header.hash = checkpoint.hash;
+		header.seed = checkpoint.seed;
+		header.width = image.width;
+		header.height = image.height;
+		header.subsampling = image.subsampling;
+		header.number_of_samples = image.number_of_samples;
+		header.converged_pixels = image.converged_pixels;
+		memcpy(&header.camera[0], &checkpoint.camera_position.x, sizeof(vec3));
+		memcpy(&header.camera[3], &checkpoint.camera_direction.x, sizeof(vec3));
+		memcpy(&header.camera[6], &checkpoint.camera_up.x, sizeof(vec3));
+		stream.write((const char *)&header, sizeof(header));
+		writeBuffer(stream, image.data);
+		writeBuffer(stream, image.sample_count);
+		writeBuffer(stream, image.variance_m2);
+		writeBuffer(stream, image.depth);
+		writeBuffer(stream, image.normal);
+		writeBuffer(stream, image.albedo);
+		return stream.good();
+	}
+
+	uint64_t checkpointSize(int width, int height)
+	{
+		const uint64_t pixel_size = sizeof(vec3) + sizeof(int) + sizeof(float) + sizeof(float) + 2 * sizeof(vec3);
+		return sizeof(CheckpointHeader) + uint64_t(width) * uint64_t(height) * pixel_size;
+	}
+
+	bool readCheckpoint(istream & stream, const string & name, Checkpoint & checkpoint, int width, int height)
+	{
+		CheckpointHeader header;
+		stream.read((char *)&header, sizeof(header));
+		if (!stream.good() || memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 ||
+			header.version != checkpoint_version || header.width <= 0 || header.height <= 0) {
+			cout << "Not a checkpoint: " << name << "\n";
+			return false;
+		}
+		if ((width > 0 && header.width != width) || (height > 0 && header.height != height)) {
+			cout << "Checkpoint of another image size: " << name << "\n";
+			return false;
+		}
+		checkpoint.hash = header.hash;
+		checkpoint.seed = header.seed;
+		memcpy(&checkpoint.camera_position.x, &header.camera[0], sizeof(vec3));
+		memcpy(&checkpoint.camera_direction.x, &header.camera[3], sizeof(vec3));
+		memcpy(&checkpoint.camera_up.x, &header.camera[6], sizeof(vec3));
+		Image & image = checkpoint.image;
+		image.width = header.width;
+		image.height = header.height;
+		image.subsampling = header.subsampling;
+		image.number_of_samples = header.number_of_samples;
+		image.converged_pixels = header.converged_pixels;
+		const size_t number_of_pixels = size_t(header.width) * size_t(header.height);
+		readBuffer(stream, image.data, number_of_pixels);
+		readBuffer(stream, image.sample_count, number_of_pixels);
+		readBuffer(stream, image.variance_m2, number_of_pixels);
+		readBuffer(stream, image.depth, number_of_pixels);
+		readBuffer(stream, image.normal, number_of_pixels);
+		readBuffer(stream, image.albedo, number_of_pixels);
+		if (!stream.good()) {
+			cout << "Truncated checkpoint: " << name << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	bool writeCheckpoint(const string & filename, const Checkpoint & checkpoint)
+	{
+		const string temporary_filename = filename + ".tmp";
+		{
+			ofstream file(temporary_filename, ios::binary);
+			if (!file.is_open() || !writeCheckpoint(file, checkpoint)) return false;
+		}
+#ifdef _WIN32
+		// Windows does not rename onto an existing file
+		remove(filename.c_str());
+#endif
+		return rename(temporary_filename.c_str(), filename.c_str()) == 0;
+	}
+
+	bool readCheckpoint(const string & filename, Checkpoint & checkpoint)
+	{
+		ifstream file(filename, ios::binary);
+		if (!file.is_open()) return false;
+		return readCheckpoint(file, filename, checkpoint);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Merge pixel by pixel: the means weighted by the sample counts, and
+	// the sums of squared differences combined as in Chan et al.'s parallel
+	// variance algorithm
+	///////////////////////////////////////////////////////////////////////////
+	static float luminance(const vec3 & c)
+	{
+		return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	bool mergeCheckpoint(Checkpoint & checkpoint, const Checkpoint & other)
+	{
+		Image & image = checkpoint.image;
+		const Image & other_image = other.image;
+		if (checkpoint.hash != other.hash || image.width != other_image.width || image.height != other_image.height) {
+			cout << "Checkpoints of different scenes, cameras or settings can not be merged.\n";
+			return false;
+		}
+		if (checkpoint.seed == other.seed) {
+			cout << "Checkpoints with the same seed have the same samples, and can not be merged.\n";
+			return false;
+		}
+		const int number_of_pixels = image.width * image.height;
+#pragma omp parallel for
+		for (int i = 0; i < number_of_pixels; i++) {
+			const int other_n = other_image.sample_count[i];
+			if (other_n == 0) continue;
+			const int n = image.sample_count[i];
+			if (n == 0) {
+				image.data[i] = other_image.data[i];
+				image.depth[i] = other_image.depth[i];
+				image.normal[i] = other_image.normal[i];
+				image.albedo[i] = other_image.albedo[i];
+			}
+			else {
+				const float total = float(n + other_n);
+				const float delta = luminance(other_image.data[i]) - luminance(image.data[i]);
+				image.data[i] = (float(n) * image.data[i] + float(other_n) * other_image.data[i]) / total;
+				image.variance_m2[i] += delta * delta * float(n) * float(other_n) / total;
+			}
+			image.variance_m2[i] += other_image.variance_m2[i];
+			image.sample_count[i] = n + other_n;
+		}
+		image.number_of_samples += other_image.number_of_samples;
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The checkpoint writer. The checkpoint being written and the one
+	// handed over next are separate, so that the writer only holds the
+	// mutex to swap them.
+	///////////////////////////////////////////////////////////////////////////
+	thread writer_thread;
+	mutex writer_mutex;
+	condition_variable writer_condition;
+	bool writer_running = false;
+	string writer_filename;
+	float writer_interval = 0.0f;
+	Checkpoint next_checkpoint;
+	bool next_checkpoint_ready = false;		// Handed over and not yet taken by the writer
+	chrono::steady_clock::time_point last_checkpoint;
+
+	static void writeCheckpoints()
+	{
+		Checkpoint checkpoint;
+		unique_lock<mutex> lock(writer_mutex);
+		for (;;) {
+			writer_condition.wait(lock, [] { return next_checkpoint_ready || !writer_running; });
+			if (!next_checkpoint_ready) return;
+			swap(checkpoint, next_checkpoint);
+			next_checkpoint_ready = false;
+			writer_condition.notify_all();
+			const string filename = writer_filename;
+			lock.unlock();
+			if (!writeCheckpoint(filename, checkpoint)) cout << "Failed to write checkpoint " << filename << ".\n";
+			lock.lock();
+		}
+	}
+
+	void startCheckpointWriter(const string & filename, float interval)
+	{
+		lock_guard<mutex> lock(writer_mutex);
+		if (writer_running) return;
+		writer_running = true;
+		writer_filename = filename;
+		writer_interval = interval;
+		last_checkpoint = chrono::steady_clock::now();
+		writer_thread = thread(writeCheckpoints);
+	}
+
+	void stopCheckpointWriter()
+	{
+		{
+			lock_guard<mutex> lock(writer_mutex);
+			if (!writer_running) return;
+			writer_running = false;
+			writer_condition.notify_all();
+		}
+		writer_thread.join();
+	}
+
+	bool offerCheckpoint(const vec3 & camera_pos, const vec3 & camera_dir, const vec3 & camera_up, bool force)
+	{
+		unique_lock<mutex> lock(writer_mutex);
+		if (!writer_running) return false;
+		const auto now = chrono::steady_clock::now();
+		if (!force && (next_checkpoint_ready || chrono::duration<float>(now - last_checkpoint).count() < writer_interval)) {
+			return false;
+		}
+		writer_condition.wait(lock, [] { return !next_checkpoint_ready; });
+		makeCheckpoint(next_checkpoint, camera_pos, camera_dir, camera_up);
+		next_checkpoint_ready = true;
+		last_checkpoint = now;
+		writer_condition.notify_all();
+		return true;
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// 64 bit FNV-1a style hashing of raw bytes, eight at a time. Start from
+	// hash_seed and pass the result on to hash more.
+	///////////////////////////////////////////////////////////////////////////
+	const uint64_t hash_seed = 14695981039346656037ull;
+	uint64_t hashBytes(uint64_t hash, const void * data, size_t size);
+	template<typename T>
+	uint64_t hashValue(uint64_t hash, const T & value) { return hashBytes(hash, &value, sizeof(T)); }
+	// The same for large arrays, hashed in blocks on all cores (which gives
+	// another hash than hashBytes() of the same bytes)
+	uint64_t hashLargeBytes(uint64_t hash, const void * data, size_t size);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The accumulated samples of an image, as stored on disk: the buffers
+	// of rendered_image (not the ones that only last for a pass), the seed
+	// its samples were taken with, the camera, and a hash of everything the
+	// image depends on.
+	///////////////////////////////////////////////////////////////////////////
+	struct Checkpoint
+	{
+		uint64_t hash = 0;
+		uint32_t seed = 0;
+		glm::vec3 camera_position, camera_direction, camera_up;
+		Image image;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hash the scene (geometry, materials, lights and environment), the
+	// settings that change what is sampled (not the seed, and not the ones
+	// that only decide when to stop, max_paths_per_pixel and target_error,
+	// so a render can be resumed or merged with a larger budget or a 
+	// tighter target) and the camera at the current size of rendered_image.
+	///////////////////////////////////////////////////////////////////////////
+	uint64_t checkpointHash(const glm::vec3 & camera_pos, const glm::vec3 & camera_dir, const glm::vec3 & camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Copy rendered_image into a checkpoint, and go on rendering from one.
+	// resumeCheckpoint() only resumes if the hash matches the current scene
+	// and settings and the camera given (and the seed matches 
+	// settings.seed), and returns whether it did. It takes the checkpoint's
+	// buffers, and must not be called while tracePaths() runs.
+	///////////////////////////////////////////////////////////////////////////
+	void makeCheckpoint(Checkpoint & checkpoint, const glm::vec3 & camera_pos, const glm::vec3 & camera_dir,
+		const glm::vec3 & camera_up);
+	bool resumeCheckpoint(Checkpoint & checkpoint, const glm::vec3 & camera_pos, const glm::vec3 & camera_dir,
+		const glm::vec3 & camera_up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Read and write a checkpoint file. The file is written next to its
+	// final name and then renamed, so that a crash while writing never
+	// leaves a broken checkpoint behind. Return false on failure. The 
+	// stream versions read and write the same bytes anywhere else (name is
+	// what the messages call the stream). Given a width and height, the 
+	// stream version refuses (before allocating anything) a checkpoint of 
+	// any other size. checkpointSize() is the number of bytes of a 
+	// checkpoint of an image of that size. 
+	///////////////////////////////////////////////////////////////////////////
+	bool writeCheckpoint(const std::string & filename, const Checkpoint & checkpoint);
+	bool readCheckpoint(const std::string & filename, Checkpoint & checkpoint);
+	bool writeCheckpoint(std::ostream & stream, const Checkpoint & checkpoint);
+	bool readCheckpoint(std::istream & stream, const std::string & name, Checkpoint & checkpoint, int width = 0,
+		int height = 0);
+	uint64_t checkpointSize(int width, int height);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add the samples of another checkpoint of the same view (the same
+	// hash) to a checkpoint, pixel by pixel, as if they had been taken in
+	// one render. The two must have different seeds, otherwise their
+	// samples are the same ones. Returns false (with a message) if they can
+	// not be merged.
+	///////////////////////////////////////////////////////////////////////////
+	bool mergeCheckpoint(Checkpoint & checkpoint, const Checkpoint & other);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write checkpoints on a thread of their own. The thread that traces
+	// calls offerCheckpoint() between passes, which copies rendered_image
+	// (the only part that waits for it) if interval seconds have passed
+	// since the last checkpoint and the last one has been written. With
+	// force, it waits for the last one instead and always copies.
+	// stopCheckpointWriter() waits until the checkpoint handed over last
+	// has been written.
+	///////////////////////////////////////////////////////////////////////////
+	void startCheckpointWriter(const std::string & filename, float interval);
+	void stopCheckpointWriter();
+	bool offerCheckpoint(const glm::vec3 & camera_pos, const glm::vec3 & camera_dir, const glm::vec3 & camera_up,
+		bool force = false);
+}
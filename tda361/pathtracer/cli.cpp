@@ -0,0 +1,410 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "sampling.h"
+#include "imageio.h"
+#include "lights.h"
+#include "denoiser.h"
+#include "checkpoint.h"
+#include "distributed.h"
+
+using namespace glm;
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+// Render a scene with the pathtracer without opening a window, and write the
+// result to disk.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Command line options
+///////////////////////////////////////////////////////////////////////////////
+struct Options
+{
+	vector<pair<string, mat4>> models;
+	string environment_map = "../scenes/envmaps/001.hdr";
+	float environment_multiplier = 1.0f;
+	vec3 camera_position = vec3(-30.0f, 10.0f, 30.0f);
+	vec3 camera_target = vec3(0.0f, 10.0f, 0.0f);
+	vec3 camera_up = vec3(0.0f, 1.0f, 0.0f);
+	vec3 light_position = vec3(10.0f, 40.0f, 10.0f);
+	float light_intensity = 2500.0f;
+	int width = 1280, height = 720;
+	int samples_per_pixel = 0;
+	float time_budget = 0.0f;
+	float exposure = 1.0f;
+	float gamma = 1.0f;
+	vector<string> outputs;
+	bool seed_given = false;
+	string checkpoint;
+	float checkpoint_interval = 60.0f;
+	vector<string> merges;
+	int coordinator_port = 0;		// Hand out jobs to workers instead of rendering
+	string worker_host;				// Render jobs for a coordinator instead of the image
+	int worker_port = 0;
+	int job_passes = 4;
+};
+
+void printUsage()
+{
+	cout << "Usage: pathtracer-cli [options]\n"
+		"  --model <file.obj>            Add a model to the scene (repeatable)\n"
+		"  --translate <x> <y> <z>       Translate the last added model\n"
+		"  --env <file.hdr>              Environment map\n"
+		"  --env-multiplier <f>          Environment map multiplier\n"
+		"  --camera-pos <x> <y> <z>      Camera position\n"
+		"  --camera-target <x> <y> <z>   Point the camera looks at\n"
+		"  --camera-up <x> <y> <z>       Camera up vector\n"
+		"  --light-pos <x> <y> <z>       Point light position\n"
+		"  --light-intensity <f>         Point light intensity multiplier\n"
+		"  --point-light <x> <y> <z> <r> <g> <b>\n"
+		"                                Add another point light with intensity rgb (repeatable)\n"
+		"  --size <width> <height>       Resolution of the rendered image\n"
+		"  --spp <n>                     Samples per pixel\n"
+		"  --time <seconds>              Stop after this much render time\n"
+		"  --max-bounces <n>             Maximum path length\n"
+		"  --tile-size <n>               Size of the screen tiles\n"
+		"  --compact                     Use embree's compact BVH (less memory, slower)\n"
+		"  --bvh-quality <quality>       fast, balanced or high: BVH build time against trace\n"
+		"                                speed (default balanced)\n"
+		"  --trace-mode <mode>           single, packets or wavefront\n"
+		"  --sampler <sampler>           independent, halton, sobol or owen\n"
+		"  --adaptive                    Use adaptive sampling\n"
+		"  --interleaved                 Take the first sample of each pixel over 16 passes\n"
+		"  --denoise                     Denoise the image before writing it\n"
+		"  --target-error <f>            Stop pixels at this relative error\n"
+		"  --reference-shading           Evaluate materials one hit at a time (virtual BRDFs)\n"
+		"  --exposure <f>                Exposure for tonemapped (.png) output\n"
+		"  --gamma <f>                   Gamma for tonemapped (.png) output\n"
+		"  --output <file>               Write .hdr, .pfm or .png (repeatable)\n"
+		"  --seed <n>                    Seed of the random numbers (renders with different\n"
+		"                                seeds can be merged)\n"
+		"  --checkpoint <file>           Resume from this checkpoint if it is of the same scene,\n"
+		"                                camera and settings, and write it while rendering\n"
+		"  --checkpoint-interval <s>     Seconds between checkpoints (default 60)\n"
+		"  --merge <file>                Instead of rendering, merge checkpoints (repeatable) and\n"
+		"                                write the result (and --checkpoint, if given)\n"
+		"  --coordinator <port>          Instead of rendering, hand out jobs to workers that\n"
+		"                                connect on this port, and write what they render\n"
+		"                                (and --checkpoint, if given)\n"
+		"  --worker <host>:<port>        Render jobs for a coordinator, which must be given the\n"
+		"                                same scene, camera, size and settings\n"
+		"  --job-passes <n>              Passes in each job of a coordinator (default 4)\n"
+		"  --threads <n>                 Render (and build BVHs) with n threads instead of one\n"
+		"                                per core, e.g. to share a machine between workers\n"
+		"If neither --spp nor --time is given, 64 samples per pixel are taken.\n";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parse the command line into options and pathtracer settings
+///////////////////////////////////////////////////////////////////////////////
+Options parseCommandLine(int argc, char *argv[])
+{
+	Options options;
+	int i = 1;
+	auto next = [&]() -> const char * {
+		if (i >= argc) {
+			cout << "Missing argument for " << argv[i - 1] << ".\n";
+			printUsage();
+			exit(1);
+		}
+		return argv[i++];
+	};
+	auto nextFloat = [&]() { return float(atof(next())); };
+	auto nextInt = [&]() { return atoi(next()); };
+	auto nextVec3 = [&]() { float x = nextFloat(); float y = nextFloat(); return vec3(x, y, nextFloat()); };
+
+	while (i < argc) {
+		string option = next();
+		if (option == "--model") options.models.push_back(make_pair(string(next()), mat4(1.0f)));
+		else if (option == "--translate") {
+			if (options.models.empty()) { cout << "--translate must follow --model.\n"; exit(1); }
+			options.models.back().second = translate(nextVec3());
+		}
+		else if (option == "--env") options.environment_map = next();
+		else if (option == "--env-multiplier") options.environment_multiplier = nextFloat();
+		else if (option == "--camera-pos") options.camera_position = nextVec3();
+		else if (option == "--camera-target") options.camera_target = nextVec3();
+		else if (option == "--camera-up") options.camera_up = nextVec3();
+		else if (option == "--light-pos") options.light_position = nextVec3();
+		else if (option == "--light-intensity") options.light_intensity = nextFloat();
+		else if (option == "--point-light") {
+			pathtracer::PointLight light;
+			light.position = nextVec3();
+			light.color = nextVec3();
+			light.intensity_multiplier = 1.0f;
+			pathtracer::point_lights.push_back(light);
+		}
+		else if (option == "--size") { options.width = nextInt(); options.height = nextInt(); }
+		else if (option == "--spp") options.samples_per_pixel = nextInt();
+		else if (option == "--time") options.time_budget = nextFloat();
+		else if (option == "--max-bounces") pathtracer::settings.max_bounces = nextInt();
+		else if (option == "--tile-size") pathtracer::settings.tile_size = nextInt();
+		else if (option == "--trace-mode") {
+			string mode = next();
+			if (mode == "single") pathtracer::settings.trace_mode = pathtracer::TRACE_SINGLE_RAYS;
+			else if (mode == "packets") pathtracer::settings.trace_mode = pathtracer::TRACE_PACKETS;
+			else if (mode == "wavefront") pathtracer::settings.trace_mode = pathtracer::TRACE_WAVEFRONT;
+			else { cout << "Unknown trace mode: " << mode << ".\n"; exit(1); }
+		}
+		else if (option == "--sampler") {
+			string sampler = next();
+			if (sampler == "independent") pathtracer::settings.sampler = pathtracer::SAMPLER_INDEPENDENT;
+			else if (sampler == "halton") pathtracer::settings.sampler = pathtracer::SAMPLER_HALTON;
+			else if (sampler == "sobol") pathtracer::settings.sampler = pathtracer::SAMPLER_SOBOL;
+			else if (sampler == "owen") pathtracer::settings.sampler = pathtracer::SAMPLER_OWEN_SOBOL;
+			else { cout << "Unknown sampler: " << sampler << ".\n"; exit(1); }
+		}
+		else if (option == "--compact") pathtracer::compact_scenes = true;
+		else if (option == "--bvh-quality") {
+			string quality = next();
+			if (quality == "fast") pathtracer::bvh_quality = pathtracer::BVH_FAST;
+			else if (quality == "balanced") pathtracer::bvh_quality = pathtracer::BVH_BALANCED;
+			else if (quality == "high") pathtracer::bvh_quality = pathtracer::BVH_HIGH_QUALITY;
+			else { cout << "Unknown BVH quality: " << quality << ".\n"; exit(1); }
+		}
+		else if (option == "--adaptive") pathtracer::settings.adaptive_sampling = true;
+		else if (option == "--interleaved") pathtracer::settings.interleaved = true;
+		else if (option == "--denoise") pathtracer::settings.denoise = true;
+		else if (option == "--target-error") pathtracer::settings.target_error = nextFloat();
+		else if (option == "--reference-shading") pathtracer::settings.batched_shading = false;
+		else if (option == "--exposure") options.exposure = nextFloat();
+		else if (option == "--gamma") options.gamma = nextFloat();
+		else if (option == "--output") options.outputs.push_back(next());
+		else if (option == "--seed") { pathtracer::settings.seed = uint32_t(nextInt()); options.seed_given = true; }
+		else if (option == "--checkpoint") options.checkpoint = next();
+		else if (option == "--checkpoint-interval") options.checkpoint_interval = nextFloat();
+		else if (option == "--merge") options.merges.push_back(next());
+		else if (option == "--coordinator") options.coordinator_port = nextInt();
+		else if (option == "--worker") {
+			string address = next();
+			const size_t colon = address.rfind(':');
+			if (colon == string::npos) { cout << "--worker needs <host>:<port>.\n"; exit(1); }
+			options.worker_host = address.substr(0, colon);
+			options.worker_port = atoi(address.c_str() + colon + 1);
+		}
+		else if (option == "--job-passes") options.job_passes = std::max(1, nextInt());
+		else if (option == "--threads") {
+			const int threads = std::max(1, nextInt());
+			omp_set_num_threads(threads);
+			pathtracer::embree_threads = threads;
+		}
+		else if (option == "--help" || option == "-h") { printUsage(); exit(0); }
+		else {
+			cout << "Unknown option: " << option << ".\n";
+			printUsage();
+			exit(1);
+		}
+	}
+
+	if (options.models.empty()) {
+		options.models.push_back(make_pair(string("../scenes/NewShip.obj"), translate(vec3(0.0f, 10.0f, 0.0f))));
+		options.models.push_back(make_pair(string("../scenes/landingpad2.obj"), mat4(1.0f)));
+	}
+	if (options.outputs.empty()) {
+		options.outputs.push_back("render.hdr");
+		options.outputs.push_back("render.png");
+	}
+	if (options.samples_per_pixel == 0 && options.time_budget <= 0.0f) {
+		options.samples_per_pixel = 64;
+	}
+	return options;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Denoise an image if asked to, and write it to the output files. Returns
+// the exit code. 
+///////////////////////////////////////////////////////////////////////////////
+int writeOutputs(const Options & options, pathtracer::Image & image)
+{
+	if (pathtracer::settings.denoise) {
+		auto denoise_start = chrono::steady_clock::now();
+		vector<vec3> denoised;
+		pathtracer::denoise(image, denoised);
+		swap(image.data, denoised);
+		cout << "Denoised in " << chrono::duration<float>(chrono::steady_clock::now() - denoise_start).count() << " s.\n";
+	}
+	int result = 0;
+	for (auto & output : options.outputs) {
+		if (pathtracer::writeImage(output, image, options.exposure, options.gamma)) {
+			cout << "Wrote " << output << ".\n";
+		}
+		else {
+			cout << "Failed to write " << output << ".\n";
+			result = 1;
+		}
+	}
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Merge checkpoints of the same view, rendered with different seeds, into
+// one image
+///////////////////////////////////////////////////////////////////////////////
+int mergeCheckpoints(const Options & options)
+{
+	pathtracer::Checkpoint merged, checkpoint;
+	for (size_t i = 0; i < options.merges.size(); i++) {
+		if (!pathtracer::readCheckpoint(options.merges[i], i == 0 ? merged : checkpoint)) {
+			cout << "Failed to read " << options.merges[i] << ".\n";
+			return 1;
+		}
+		if (i > 0 && !pathtracer::mergeCheckpoint(merged, checkpoint)) return 1;
+	}
+	cout << "Merged " << options.merges.size() << " checkpoints, " << merged.image.number_of_samples << " passes.\n";
+	if (!options.checkpoint.empty()) {
+		if (!pathtracer::writeCheckpoint(options.checkpoint, merged)) {
+			cout << "Failed to write " << options.checkpoint << ".\n";
+			return 1;
+		}
+		cout << "Wrote " << options.checkpoint << ".\n";
+	}
+	return writeOutputs(options, merged.image);
+}
+
+int main(int argc, char *argv[])
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Default path-tracer settings (same as the interactive pathtracer),
+	// overridden by the command line
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::settings.max_bounces = 8;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.tile_size = 16;
+	pathtracer::settings.trace_mode = pathtracer::TRACE_PACKETS;
+	pathtracer::settings.sampler = pathtracer::SAMPLER_OWEN_SOBOL;
+	pathtracer::settings.adaptive_sampling = false;
+	pathtracer::settings.target_error = 0.0f;
+	pathtracer::settings.batched_shading = true;
+	Options options = parseCommandLine(argc, argv);
+	pathtracer::settings.max_paths_per_pixel = options.samples_per_pixel;
+	if (!options.merges.empty()) return mergeCheckpoints(options);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set up light and environment
+	///////////////////////////////////////////////////////////////////////////
+	pathtracer::point_light.intensity_multiplier = options.light_intensity;
+	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
+	pathtracer::point_light.position = options.light_position;
+	pathtracer::environment.map.load(options.environment_map);
+	pathtracer::environment.multiplier = options.environment_multiplier;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Load .obj models and add them to the pathtracer scene
+	///////////////////////////////////////////////////////////////////////////
+	vector<pair<labhelper::Model *, mat4>> models;
+	auto load_start = chrono::steady_clock::now();
+	for (auto & m : options.models) {
+		models.push_back(make_pair(labhelper::loadModelFromOBJ(m.first), m.second));
+	}
+	cout << "Loaded " << models.size() << " models in " 
+		<< chrono::duration<float>(chrono::steady_clock::now() - load_start).count() << " s.\n";
+	for (auto m : models) {
+		pathtracer::addModel(m.first, m.second);
+	}
+	// The coordinator only needs the scene to check that the workers have 
+	// the same one
+	if (options.coordinator_port == 0) pathtracer::buildBVH();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render until we have the requested number of samples, every pixel has
+	// converged or the time budget is spent
+	///////////////////////////////////////////////////////////////////////////
+	vec3 camera_direction = normalize(options.camera_target - options.camera_position);
+	vec3 camera_right = normalize(cross(camera_direction, options.camera_up));
+	vec3 camera_up = normalize(cross(camera_right, camera_direction));
+	pathtracer::resize(options.width, options.height);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render with other processes instead (see distributed.h)
+	///////////////////////////////////////////////////////////////////////////
+	if (!options.worker_host.empty()) {
+		// The coordinator decides how many passes there are
+		pathtracer::settings.max_paths_per_pixel = 0;
+		const bool rendered = pathtracer::renderForCoordinator(options.worker_host, options.worker_port,
+			options.camera_position, camera_direction, camera_up);
+		for (auto & m : models) {
+			labhelper::freeModel(m.first);
+		}
+		return rendered ? 0 : 1;
+	}
+	if (options.coordinator_port != 0) {
+		pathtracer::DistributedRender render;
+		render.total_passes = options.samples_per_pixel;
+		render.passes_per_job = options.job_passes;
+		render.time_budget = options.time_budget;
+		pathtracer::Checkpoint checkpoint;
+		const uint64_t hash = pathtracer::checkpointHash(options.camera_position, camera_direction, camera_up);
+		int result = 1;
+		if (pathtracer::coordinateRender(options.coordinator_port, render, hash, checkpoint)) {
+			result = 0;
+			if (!options.checkpoint.empty()) {
+				if (pathtracer::writeCheckpoint(options.checkpoint, checkpoint)) {
+					cout << "Wrote " << options.checkpoint << ".\n";
+				}
+				else {
+					cout << "Failed to write " << options.checkpoint << ".\n";
+					result = 1;
+				}
+			}
+			result |= writeOutputs(options, checkpoint.image);
+		}
+		for (auto & m : models) {
+			labhelper::freeModel(m.first);
+		}
+		return result;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Go on from the checkpoint if it is of this render. Unless a seed was
+	// given, the checkpoint's seed is the one to go on with. 
+	///////////////////////////////////////////////////////////////////////////
+	if (!options.checkpoint.empty()) {
+		pathtracer::Checkpoint checkpoint;
+		if (pathtracer::readCheckpoint(options.checkpoint, checkpoint)) {
+			if (!options.seed_given) pathtracer::settings.seed = checkpoint.seed;
+			if (pathtracer::resumeCheckpoint(checkpoint, options.camera_position, camera_direction, camera_up)) {
+				cout << "Resumed from " << options.checkpoint << " at " << pathtracer::rendered_image.number_of_samples
+					<< " passes.\n";
+			}
+			else {
+				cout << options.checkpoint << " is of another scene, camera, seed or settings, starting over.\n";
+			}
+		}
+		pathtracer::startCheckpointWriter(options.checkpoint, options.checkpoint_interval);
+	}
+
+	auto start_time = chrono::steady_clock::now();
+	float elapsed = 0.0f;
+	for (;;) {
+		if (!pathtracer::tracePaths(options.camera_position, camera_direction, camera_up)) break;
+		pathtracer::offerCheckpoint(options.camera_position, camera_direction, camera_up);
+		elapsed = chrono::duration<float>(chrono::steady_clock::now() - start_time).count();
+		cout << "\rPass " << pathtracer::rendered_image.number_of_samples << ", " << elapsed << " s" << flush;
+		if (options.time_budget > 0.0f && elapsed >= options.time_budget) break;
+	}
+	cout << "\nRendered " << pathtracer::rendered_image.number_of_samples << " passes in " << elapsed << " s.\n";
+	pathtracer::offerCheckpoint(options.camera_position, camera_direction, camera_up, true);
+	pathtracer::stopCheckpointWriter();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Write the result
+	///////////////////////////////////////////////////////////////////////////
+	int result = writeOutputs(options, pathtracer::rendered_image);
+
+	for (auto & m : models) {
+		labhelper::freeModel(m.first);
+	}
+	return result;
+}
@@ -0,0 +1,258 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// How hard the edges stop the filter
+	///////////////////////////////////////////////////////////////////////////
+	const int denoise_iterations = 5;
+	const float sigma_depth = 0.05f;		// Relative depth change per pixel of tap distance
+	const float sigma_luminance = 4.0f;		// Standard deviations of the luminance noise
+	// The normals' weight is the cosine between them to the 128th power
+	const float min_albedo = 1e-3f;			// So that black surfaces can be divided by
+	// The B3 spline that the a-trous kernel is the outer product of
+	const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	static float luminance(float r, float g, float b)
+	{
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// e^-x for x >= 0, to about 1e-4, without a call to the math library so
+	// that the filter loop vectorizes: 2^-t is split into 2^-floor(t), which
+	// is written straight into the exponent bits, and a polynomial for the
+	// fraction. t is clamped to 126 on its bits (positive floats compare 
+	// like integers), since the compiler would not speculate a float 
+	// compare and convert, and so not vectorize the loop. 
+	///////////////////////////////////////////////////////////////////////////
+	static inline float negativeExp(float x)
+	{
+		float t = x * 1.44269504f;
+		int32_t t_bits;
+		memcpy(&t_bits, &t, sizeof(t));
+		const int32_t max_bits = 0x42FC0000;		// 126.0f
+		t_bits = t_bits < max_bits ? t_bits : max_bits;
+		memcpy(&t, &t_bits, sizeof(t));
+		const int whole = int(t);
+		const float f = t - float(whole);
+		const float fraction = 1.0f + f * (-0.693147f + f * (0.240227f + f * (-0.0555041f +
+			f * (0.00961813f + f * -0.00133336f))));
+		const int32_t bits = (127 - whole) << 23;
+		float scale;
+		memcpy(&scale, &bits, sizeof(scale));
+		return scale * fraction;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The lighting being filtered, its variance and how much each pixel is
+	// trusted (0 for pixels with no samples, until a neighbor fills them),
+	// as one array per member so that the filter loops vectorize
+	///////////////////////////////////////////////////////////////////////////
+	struct DenoisePlanes
+	{
+		vector<float> r, g, b, variance, weight;
+		void resize(size_t n)
+		{
+			r.resize(n); g.resize(n); b.resize(n);
+			variance.resize(n);
+			weight.resize(n);
+		}
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Scratch space kept between calls
+	///////////////////////////////////////////////////////////////////////////
+	static DenoisePlanes planes[2];
+	static vector<float> normal_x, normal_y, normal_z;
+	static vector<float> depth;				// 0 where the camera ray missed
+	static vector<float> depth_stop;		// 1 / (sigma_depth * depth)
+	static vector<float> lighting_luminance;
+	static vector<float> luminance_stop;	// 1 / (sigma_luminance * standard deviation)
+	static vector<vec3> albedo;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Split the image into the planes: the color divided by the albedo (so
+	// that the filter does not blur the materials' colors), and the
+	// variance of the mean of each pixel's luminance
+	///////////////////////////////////////////////////////////////////////////
+	static void demodulate(const Image & image)
+	{
+		const int number_of_pixels = image.width * image.height;
+		planes[0].resize(number_of_pixels);
+		planes[1].resize(number_of_pixels);
+		normal_x.resize(number_of_pixels);
+		normal_y.resize(number_of_pixels);
+		normal_z.resize(number_of_pixels);
+		depth.resize(number_of_pixels);
+		depth_stop.resize(number_of_pixels);
+		lighting_luminance.resize(number_of_pixels);
+		luminance_stop.resize(number_of_pixels);
+		albedo.resize(number_of_pixels);
+		DenoisePlanes & in = planes[0];
+#pragma omp parallel for
+		for (int i = 0; i < number_of_pixels; i++) {
+			const bool hit = image.depth[i] != FLT_MAX;
+			albedo[i] = hit ? glm::max(image.albedo[i], vec3(min_albedo)) : vec3(1.0f);
+			const vec3 lighting = image.data[i] / albedo[i];
+			in.r[i] = lighting.r;
+			in.g[i] = lighting.g;
+			in.b[i] = lighting.b;
+			const int n = image.sample_count[i];
+			const float albedo_luminance = luminance(albedo[i].r, albedo[i].g, albedo[i].b);
+			// With one sample, all we can say is that the noise is about as
+			// large as the pixel
+			const float pixel_luminance = luminance(image.data[i].r, image.data[i].g, image.data[i].b);
+			const float variance = n >= 2 ? image.variance_m2[i] / (float(n) * float(n - 1)) :
+				pixel_luminance * pixel_luminance;
+			in.variance[i] = variance / (albedo_luminance * albedo_luminance);
+			// Missed pixels get no normal, so the dot product shuts them out
+			// of the hits' filters
+			in.weight[i] = (hit && n > 0) ? 1.0f : 0.0f;
+			const vec3 normal = hit ? image.normal[i] : vec3(0.0f);
+			normal_x[i] = normal.x;
+			normal_y[i] = normal.y;
+			normal_z[i] = normal.z;
+			depth[i] = hit ? image.depth[i] : 0.0f;
+			depth_stop[i] = hit ? 1.0f / (sigma_depth * std::max(image.depth[i], 1e-6f)) : 0.0f;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The luminance of each pixel and its edge stop, from the variance 
+	// blurred over 3x3 pixels (a single pixel's estimate of it is noisy too)
+	///////////////////////////////////////////////////////////////////////////
+	static void computeLuminanceStops(const DenoisePlanes & in, int width, int height)
+	{
+		const float blur[3] = { 0.25f, 0.5f, 0.25f };
+#pragma omp parallel for
+		for (int y = 0; y < height; y++) {
+			PATHTRACER_SIMD
+			for (int i = y * width; i < (y + 1) * width; i++) {
+				lighting_luminance[i] = luminance(in.r[i], in.g[i], in.b[i]);
+			}
+			for (int x = 0; x < width; x++) {
+				float variance = 0.0f, total = 0.0f;
+				for (int dy = -1; dy <= 1; dy++) {
+					const int qy = y + dy;
+					if (qy < 0 || qy >= height) continue;
+					for (int dx = -1; dx <= 1; dx++) {
+						const int qx = x + dx;
+						if (qx < 0 || qx >= width) continue;
+						const int q = qy * width + qx;
+						const float w = blur[dx + 1] * blur[dy + 1] * in.weight[q];
+						variance += w * in.variance[q];
+						total += w;
+					}
+				}
+				variance = total > 0.0f ? variance / total : 0.0f;
+				luminance_stop[y * width + x] = 1.0f / (sigma_luminance * sqrt(std::max(variance, 0.0f)) + 1e-4f);
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// One a-trous iteration, with the taps step pixels apart. Each row sums
+	// its 25 taps one at a time, so that the inner loop runs along the row
+	// over contiguous floats. The variance goes through the filter with the
+	// weights squared, as it does for a weighted mean.
+	///////////////////////////////////////////////////////////////////////////
+	static void filterIteration(const DenoisePlanes & in, DenoisePlanes & out, int width, int height, int step)
+	{
+		const float inv_step = 1.0f / float(step);
+		const float * r = in.r.data(), * g = in.g.data(), * b = in.b.data();
+		const float * variance = in.variance.data(), * weight = in.weight.data();
+		const float * nx = normal_x.data(), * ny = normal_y.data(), * nz = normal_z.data();
+		const float * z = depth.data(), * z_stop = depth_stop.data();
+		const float * l = lighting_luminance.data(), * l_stop = luminance_stop.data();
+#pragma omp parallel
+		{
+			vector<float> sum_r(width), sum_g(width), sum_b(width), sum_variance(width), sum_weight(width);
+			float * sr = sum_r.data(), * sg = sum_g.data(), * sb = sum_b.data();
+			float * sv = sum_variance.data(), * sw = sum_weight.data();
+#pragma omp for
+			for (int y = 0; y < height; y++) {
+				std::fill(sum_r.begin(), sum_r.end(), 0.0f);
+				std::fill(sum_g.begin(), sum_g.end(), 0.0f);
+				std::fill(sum_b.begin(), sum_b.end(), 0.0f);
+				std::fill(sum_variance.begin(), sum_variance.end(), 0.0f);
+				std::fill(sum_weight.begin(), sum_weight.end(), 0.0f);
+				const int row = y * width;
+				for (int ky = 0; ky < 5; ky++) {
+					const int qy = y + (ky - 2) * step;
+					if (qy < 0 || qy >= height) continue;
+					for (int kx = 0; kx < 5; kx++) {
+						const int offset = (kx - 2) * step;
+						const int x0 = std::max(0, -offset), x1 = std::min(width, width - offset);
+						const int q_row = qy * width + offset;
+						const float h = kernel[kx] * kernel[ky];
+						PATHTRACER_SIMD
+						for (int x = x0; x < x1; x++) {
+							const int p = row + x, q = q_row + x;
+							float cosine = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q];
+							cosine = 0.5f * (cosine + std::abs(cosine));	// max(cosine, 0) without a branch
+							// To the 128th power
+							cosine *= cosine; cosine *= cosine; cosine *= cosine; cosine *= cosine;
+							cosine *= cosine; cosine *= cosine; cosine *= cosine;
+							const float depth_distance = std::abs(z[p] - z[q]) * z_stop[p] * inv_step;
+							const float luminance_distance = std::abs(l[p] - l[q]) * l_stop[p];
+							const float w = h * weight[q] * cosine * negativeExp(depth_distance + luminance_distance);
+							sr[x] += w * r[q];
+							sg[x] += w * g[q];
+							sb[x] += w * b[q];
+							sv[x] += w * w * variance[q];
+							sw[x] += w;
+						}
+					}
+				}
+				for (int x = 0; x < width; x++) {
+					const int p = row + x;
+					if (depth[p] == 0.0f || sum_weight[x] < 1e-12f) {
+						out.r[p] = in.r[p];
+						out.g[p] = in.g[p];
+						out.b[p] = in.b[p];
+						out.variance[p] = in.variance[p];
+						out.weight[p] = in.weight[p];
+						continue;
+					}
+					const float inv_weight = 1.0f / sum_weight[x];
+					out.r[p] = sum_r[x] * inv_weight;
+					out.g[p] = sum_g[x] * inv_weight;
+					out.b[p] = sum_b[x] * inv_weight;
+					out.variance[p] = sum_variance[x] * inv_weight * inv_weight;
+					out.weight[p] = 1.0f;
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Filter the image
+	///////////////////////////////////////////////////////////////////////////
+	void denoise(const Image & image, vector<vec3> & result)
+	{
+		const int width = image.width, height = image.height;
+		const int number_of_pixels = width * height;
+		result.resize(number_of_pixels);
+		if (number_of_pixels == 0) return;
+		demodulate(image);
+		int current = 0;
+		for (int i = 0; i < denoise_iterations; i++) {
+			computeLuminanceStops(planes[current], width, height);
+			filterIteration(planes[current], planes[1 - current], width, height, 1 << i);
+			current = 1 - current;
+		}
+		// Put the materials' colors back
+		const DenoisePlanes & filtered = planes[current];
+#pragma omp parallel for
+		for (int i = 0; i < number_of_pixels; i++) {
+			if (depth[i] == 0.0f) result[i] = image.data[i];
+			else result[i] = albedo[i] * vec3(filtered.r[i], filtered.g[i], filtered.b[i]);
+		}
+	}
+}
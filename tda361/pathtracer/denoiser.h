@@ -0,0 +1,24 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Filter the noise out of an image with an edge-avoiding a-trous wavelet
+	// filter (Dammertz et al. 2010), guided by the variance of the pixels
+	// like SVGF (Schied et al. 2017). The lighting (the color divided by the
+	// albedo of the first hit) is blurred with a 5x5 kernel, five times over
+	// with the taps spread twice as far each time, and the blur stops where
+	// the depth or the normal of the first hit changes, or where the
+	// luminance changes more than the pixels' noise explains. Pixels with
+	// no samples are filled in from their neighbors, and the environment
+	// (where the camera rays missed) is left as it is.
+	//
+	// Writes image.width x image.height colors to result. Uses all cores,
+	// and keeps its scratch buffers between calls, so only call it from one
+	// thread at a time.
+	///////////////////////////////////////////////////////////////////////////
+	void denoise(const Image & image, std::vector<glm::vec3> & result);
+}
@@ -0,0 +1,435 @@
+#include "distributed.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include "Pathtracer.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+#ifdef _WIN32
+	bool coordinateRender(int port, const DistributedRender & render, uint64_t hash, Checkpoint & result)
+	{
+		cout << "Distributed rendering is not supported on Windows.\n";
+		return false;
+	}
+
+	bool renderForCoordinator(const string & host, int port, const vec3 & camera_pos, const vec3 & camera_dir,
+		const vec3 & camera_up)
+	{
+		cout << "Distributed rendering is not supported on Windows.\n";
+		return false;
+	}
+#else
+	///////////////////////////////////////////////////////////////////////////
+	// The messages: a header and size bytes after it, as raw little endian
+	// values like the checkpoint files
+	///////////////////////////////////////////////////////////////////////////
+	enum MessageType : uint32_t {
+		MESSAGE_HELLO = 1,		// Worker: the checkpointHash() of its view
+		MESSAGE_REFUSED = 2,	// Coordinator: the worker renders something else
+		MESSAGE_JOB = 3,		// Coordinator: a JobMessage
+		MESSAGE_RESULT = 4,		// Worker: the job's checkpoint, as in a checkpoint file
+		MESSAGE_DONE = 5		// Coordinator: no more jobs
+	};
+
+	struct MessageHeader
+	{
+		uint32_t type;
+		uint32_t job;
+		uint64_t size;
+	};
+
+	struct JobMessage
+	{
+		uint32_t seed;
+		int32_t passes;
+	};
+
+	const int jobs_per_worker = 2;
+	const int poll_interval = 100;			// Milliseconds
+	const int send_timeout = 10000;			// Milliseconds
+
+	///////////////////////////////////////////////////////////////////////////
+	// Send or receive all of the bytes. On a non-blocking socket, sending
+	// waits until there is room, for at most send_timeout.
+	///////////////////////////////////////////////////////////////////////////
+	static bool sendAll(int socket, const void * data, size_t size)
+	{
+		const char * bytes = (const char *)data;
+		while (size > 0) {
+			const ssize_t sent = send(socket, bytes, size, 0);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				pollfd writable = { socket, POLLOUT, 0 };
+				if (poll(&writable, 1, send_timeout) <= 0) return false;
+				continue;
+			}
+			if (sent <= 0) return false;
+			bytes += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	static bool receiveAll(int socket, void * data, size_t size)
+	{
+		char * bytes = (char *)data;
+		while (size > 0) {
+			const ssize_t received = recv(socket, bytes, size, 0);
+			if (received < 0 && errno == EINTR) continue;
+			if (received <= 0) return false;
+			bytes += received;
+			size -= size_t(received);
+		}
+		return true;
+	}
+
+	static bool sendMessage(int socket, uint32_t type, uint32_t job, const void * payload = nullptr, uint64_t size = 0)
+	{
+		const MessageHeader header = { type, job, size };
+		return sendAll(socket, &header, sizeof(header)) && (size == 0 || sendAll(socket, payload, size));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Lets a checkpoint be read straight out of a received message
+	///////////////////////////////////////////////////////////////////////////
+	struct MemoryBuffer : public streambuf
+	{
+		MemoryBuffer(char * data, size_t size) { setg(data, data, data + size); }
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A worker, as seen by the coordinator. Its messages are received a
+	// piece at a time, as they arrive, so that one worker sending a large
+	// result never holds up the others.
+	///////////////////////////////////////////////////////////////////////////
+	struct Worker
+	{
+		int socket = -1;			// -1 once it is gone
+		string name;
+		bool greeted = false;		// Its hash has been checked
+		MessageHeader header;
+		size_t header_received = 0;
+		vector<char> payload;
+		size_t payload_received = 0;
+		deque<uint32_t> jobs;		// Handed out and not sent back yet
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Receive what has arrived from a worker, setting complete when a whole
+	// message is in. Returns false if the worker has hung up or sent
+	// something that is not a message. Nothing is allocated for a message
+	// that is not of the size its type must have: a hash, or a checkpoint 
+	// of result_size bytes. 
+	///////////////////////////////////////////////////////////////////////////
+	static bool receiveSome(Worker & worker, uint64_t result_size, bool & complete)
+	{
+		complete = false;
+		const size_t header_size = sizeof(worker.header);
+		if (worker.header_received < header_size) {
+			const ssize_t received = recv(worker.socket, (char *)&worker.header + worker.header_received,
+				header_size - worker.header_received, 0);
+			if (received == 0) return false;
+			if (received < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			worker.header_received += size_t(received);
+			if (worker.header_received < header_size) return true;
+			uint64_t expected_size = 0;
+			if (worker.header.type == MESSAGE_HELLO) expected_size = sizeof(uint64_t);
+			else if (worker.header.type == MESSAGE_RESULT) expected_size = result_size;
+			if (worker.header.size != expected_size) return false;
+			worker.payload.resize(size_t(worker.header.size));
+			worker.payload_received = 0;
+		}
+		if (worker.payload_received < worker.payload.size()) {
+			const ssize_t received = recv(worker.socket, worker.payload.data() + worker.payload_received,
+				worker.payload.size() - worker.payload_received, 0);
+			if (received == 0) return false;
+			if (received < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			worker.payload_received += size_t(received);
+		}
+		complete = worker.payload_received == worker.payload.size();
+		if (complete) worker.header_received = 0;
+		return true;
+	}
+
+	static int listenOn(int port)
+	{
+		const int listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (listener < 0) return -1;
+		const int yes = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(uint16_t(port));
+		if (::bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+			close(listener);
+			return -1;
+		}
+		fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+		return listener;
+	}
+
+	bool coordinateRender(int port, const DistributedRender & render, uint64_t hash, Checkpoint & result)
+	{
+		// A worker hanging up must not kill us while we write to it
+		signal(SIGPIPE, SIG_IGN);
+		const int listener = listenOn(port);
+		if (listener < 0) {
+			cout << "Could not listen on port " << port << ": " << strerror(errno) << ".\n";
+			return false;
+		}
+		cout << "Waiting for workers on port " << port << ".\n";
+
+		const int width = rendered_image.width, height = rendered_image.height;
+		const uint64_t result_size = checkpointSize(width, height);
+		const uint32_t number_of_jobs = render.total_passes > 0 ?
+			uint32_t((render.total_passes + render.passes_per_job - 1) / render.passes_per_job) : UINT32_MAX;
+		uint32_t next_job = 0;
+		deque<uint32_t> lost_jobs;			// Handed out to workers that are gone
+		uint32_t finished_jobs = 0;
+		bool have_result = false;
+		vector<Worker> workers;
+		vector<pollfd> poll_fds;
+
+		auto dropWorker = [&](Worker & worker, const char * reason) {
+			cout << "\nLost worker " << worker.name << " (" << reason << ")";
+			if (!worker.jobs.empty()) cout << ", handing its " << worker.jobs.size() << " jobs to the others";
+			cout << ".\n";
+			lost_jobs.insert(lost_jobs.begin(), worker.jobs.begin(), worker.jobs.end());
+			worker.jobs.clear();
+			close(worker.socket);
+			worker.socket = -1;
+		};
+		auto jobsLeft = [&]() { return !lost_jobs.empty() || next_job < number_of_jobs; };
+
+		const auto start_time = chrono::steady_clock::now();
+		for (;;) {
+			const float elapsed = chrono::duration<float>(chrono::steady_clock::now() - start_time).count();
+			if (render.time_budget > 0.0f && elapsed >= render.time_budget) {
+				lost_jobs.clear();
+				next_job = number_of_jobs;
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Hand out jobs, one to every worker before anyone gets a second
+			///////////////////////////////////////////////////////////////////
+			for (int queued = 1; queued <= jobs_per_worker; queued++) {
+				for (Worker & worker : workers) {
+					if (worker.socket < 0 || !worker.greeted || int(worker.jobs.size()) >= queued || !jobsLeft()) continue;
+					uint32_t job = next_job;
+					if (!lost_jobs.empty()) {
+						job = lost_jobs.front();
+						lost_jobs.pop_front();
+					}
+					else next_job++;
+					JobMessage message;
+					message.seed = settings.seed + job;
+					message.passes = render.passes_per_job;
+					if (render.total_passes > 0) {
+						message.passes = std::min(message.passes, render.total_passes - int(job) * render.passes_per_job);
+					}
+					worker.jobs.push_back(job);
+					if (!sendMessage(worker.socket, MESSAGE_JOB, job, &message, sizeof(message))) {
+						dropWorker(worker, "could not send it a job");
+					}
+				}
+			}
+			workers.erase(remove_if(workers.begin(), workers.end(), [](const Worker & w) { return w.socket < 0; }),
+				workers.end());
+			bool jobs_in_flight = false;
+			for (const Worker & worker : workers) jobs_in_flight |= !worker.jobs.empty();
+			if (!jobs_in_flight && !jobsLeft()) break;
+
+			///////////////////////////////////////////////////////////////////
+			// Wait for new workers and for messages
+			///////////////////////////////////////////////////////////////////
+			poll_fds.resize(workers.size() + 1);
+			poll_fds[0] = { listener, POLLIN, 0 };
+			for (size_t i = 0; i < workers.size(); i++) poll_fds[i + 1] = { workers[i].socket, POLLIN, 0 };
+			if (poll(poll_fds.data(), nfds_t(poll_fds.size()), poll_interval) < 0 && errno != EINTR) {
+				cout << "poll() failed: " << strerror(errno) << ".\n";
+				break;
+			}
+			if (poll_fds[0].revents & POLLIN) {
+				sockaddr_in address;
+				socklen_t address_size = sizeof(address);
+				const int connection = accept(listener, (sockaddr *)&address, &address_size);
+				if (connection >= 0) {
+					fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) | O_NONBLOCK);
+					const int yes = 1;
+					setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+					Worker worker;
+					worker.socket = connection;
+					char host[INET_ADDRSTRLEN] = "?";
+					inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+					worker.name = string(host) + ":" + to_string(ntohs(address.sin_port));
+					workers.push_back(worker);
+				}
+			}
+			for (size_t i = 0; i < workers.size(); i++) {
+				if (poll_fds[i + 1].revents == 0) continue;
+				Worker & worker = workers[i];
+				bool complete;
+				if (!receiveSome(worker, result_size, complete)) {
+					dropWorker(worker, "hung up or sent a broken message");
+					continue;
+				}
+				if (!complete) continue;
+				const MessageHeader & header = worker.header;
+				if (header.type == MESSAGE_HELLO && !worker.greeted && header.size == sizeof(uint64_t)) {
+					uint64_t worker_hash;
+					memcpy(&worker_hash, worker.payload.data(), sizeof(worker_hash));
+					if (worker_hash != hash) {
+						cout << "\nTurned away worker " << worker.name << ", it renders another scene, camera or settings.\n";
+						sendMessage(worker.socket, MESSAGE_REFUSED, 0);
+						close(worker.socket);
+						worker.socket = -1;
+						continue;
+					}
+					worker.greeted = true;
+					cout << "\nWorker " << worker.name << " joined.\n";
+					continue;
+				}
+				const auto job = find(worker.jobs.begin(), worker.jobs.end(), header.job);
+				if (header.type != MESSAGE_RESULT || job == worker.jobs.end()) {
+					dropWorker(worker, "sent something unexpected");
+					continue;
+				}
+				Checkpoint checkpoint;
+				MemoryBuffer buffer(worker.payload.data(), worker.payload.size());
+				istream stream(&buffer);
+				const string name = "the result of job " + to_string(header.job);
+				if (!readCheckpoint(stream, name, checkpoint, width, height) || checkpoint.hash != hash) {
+					dropWorker(worker, "sent a broken result");
+					continue;
+				}
+				worker.jobs.erase(job);
+				vector<char>().swap(worker.payload);
+				if (!have_result) swap(result, checkpoint);
+				else if (!mergeCheckpoint(result, checkpoint)) continue;
+				have_result = true;
+				finished_jobs++;
+				cout << "\rJob " << finished_jobs;
+				if (render.total_passes > 0) cout << " of " << number_of_jobs;
+				cout << ", " << result.image.number_of_samples << " passes, " << workers.size() << " workers, "
+					<< elapsed << " s" << flush;
+			}
+			workers.erase(remove_if(workers.begin(), workers.end(), [](const Worker & w) { return w.socket < 0; }),
+				workers.end());
+		}
+
+		for (Worker & worker : workers) {
+			sendMessage(worker.socket, MESSAGE_DONE, 0);
+			close(worker.socket);
+		}
+		close(listener);
+		const float elapsed = chrono::duration<float>(chrono::steady_clock::now() - start_time).count();
+		if (!have_result) {
+			cout << "\nNothing was rendered.\n";
+			return false;
+		}
+		cout << "\nRendered " << result.image.number_of_samples << " passes in " << finished_jobs << " jobs in "
+			<< elapsed << " s.\n";
+		return true;
+	}
+
+	static int connectTo(const string & host, int port)
+	{
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo * addresses = nullptr;
+		if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0) return -1;
+		int connection = -1;
+		for (addrinfo * address = addresses; address != nullptr; address = address->ai_next) {
+			connection = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+			if (connection < 0) continue;
+			if (connect(connection, address->ai_addr, address->ai_addrlen) == 0) break;
+			close(connection);
+			connection = -1;
+		}
+		freeaddrinfo(addresses);
+		if (connection >= 0) {
+			const int yes = 1;
+			setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		}
+		return connection;
+	}
+
+	bool renderForCoordinator(const string & host, int port, const vec3 & camera_pos, const vec3 & camera_dir,
+		const vec3 & camera_up)
+	{
+		signal(SIGPIPE, SIG_IGN);
+		const int connection = connectTo(host, port);
+		if (connection < 0) {
+			cout << "Could not connect to " << host << ":" << port << ".\n";
+			return false;
+		}
+		const uint64_t hash = checkpointHash(camera_pos, camera_dir, camera_up);
+		bool result = sendMessage(connection, MESSAGE_HELLO, 0, &hash, sizeof(hash));
+		Checkpoint checkpoint;
+		string bytes;
+		while (result) {
+			MessageHeader header;
+			if (!receiveAll(connection, &header, sizeof(header))) {
+				cout << "Lost the coordinator.\n";
+				result = false;
+				break;
+			}
+			if (header.type == MESSAGE_DONE) break;
+			JobMessage job;
+			if (header.type != MESSAGE_JOB || header.size != sizeof(job) || !receiveAll(connection, &job, sizeof(job))) {
+				if (header.type == MESSAGE_REFUSED) cout << "The coordinator renders another scene, camera or settings.\n";
+				else cout << "Unexpected message from the coordinator.\n";
+				result = false;
+				break;
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Render the job from scratch, with its seed
+			///////////////////////////////////////////////////////////////////
+			const auto job_start = chrono::steady_clock::now();
+			settings.seed = job.seed;
+			restart();
+			for (int pass = 0; pass < job.passes; pass++) {
+				if (!tracePaths(camera_pos, camera_dir, camera_up)) break;
+			}
+			makeCheckpoint(checkpoint, camera_pos, camera_dir, camera_up);
+			ostringstream stream(ios::binary);
+			writeCheckpoint(stream, checkpoint);
+			bytes = stream.str();
+			result = sendMessage(connection, MESSAGE_RESULT, header.job, bytes.data(), bytes.size());
+			if (!result) {
+				cout << "Lost the coordinator.\n";
+				break;
+			}
+			cout << "Job " << header.job << ": " << rendered_image.number_of_samples << " passes in "
+				<< chrono::duration<float>(chrono::steady_clock::now() - job_start).count() << " s.\n";
+		}
+		close(connection);
+		return result;
+	}
+#endif
+}
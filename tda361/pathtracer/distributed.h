@@ -0,0 +1,47 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include "checkpoint.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Render one image with several processes, on this machine or others of
+	// the same architecture, over TCP. Every process loads the same scene
+	// with the same settings and camera. The workers build their own BVH
+	// and render jobs: a number of passes over the whole image with a seed
+	// of their own (settings.seed plus the job's number), which they send
+	// back as checkpoints for the coordinator to merge (see
+	// mergeCheckpoint()). A job handed to a worker that dies (or hangs up)
+	// is handed to another one, and as its seed decides its samples, the
+	// result is the same. Workers can join at any time, and each one has
+	// two jobs at a time so that it never waits for the next one.
+	// A worker renders on every core, so several workers on one machine 
+	// should share the cores out with pathtracer-cli --threads (or 
+	// OMP_NUM_THREADS), or they slow each other down. 
+	///////////////////////////////////////////////////////////////////////////
+	struct DistributedRender
+	{
+		int total_passes = 0;		// 0 = hand out jobs until the time is up
+		int passes_per_job = 8;
+		float time_budget = 0.0f;	// Seconds, after which no more jobs are handed out (0 = none)
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Listen for workers on port, hand out the jobs of render and merge what
+	// comes back into result. hash is the checkpointHash() of the view,
+	// which workers that render anything else are turned away by. Returns
+	// false (with a message) if no port could be opened or nothing was
+	// rendered. Not available on Windows.
+	///////////////////////////////////////////////////////////////////////////
+	bool coordinateRender(int port, const DistributedRender & render, uint64_t hash, Checkpoint & result);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Connect to the coordinator at host:port, and render the jobs it hands
+	// out with the camera given, until it says it is done. Returns false
+	// (with a message) if it could not connect or was turned away.
+	///////////////////////////////////////////////////////////////////////////
+	bool renderForCoordinator(const std::string & host, int port, const glm::vec3 & camera_pos,
+		const glm::vec3 & camera_dir, const glm::vec3 & camera_up);
+}
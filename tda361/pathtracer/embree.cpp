@@ -1,6 +1,17 @@
 #include "embree.h"
+#include "lights.h"
+#include "shading.h"
+#include "checkpoint.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <thread>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 
 using namespace std; 
@@ -13,16 +24,11 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	RTCDevice embree_device;
 	RTCScene  embree_scene;
+	int       packet_width = 4;
 
-	///////////////////////////////////////////////////////////////////////////
-	// Build an acceleration structure for the scene
-	///////////////////////////////////////////////////////////////////////////
-	void buildBVH()
-	{
-		cout << "Embree building BVH..." << flush;
-		rtcCommit(embree_scene);
-		cout << "done.\n";
-	}
+	static_assert(sizeof(RayPacket<4>) == sizeof(RTCRay4), "RayPacket<4> must match RTCRay4");
+	static_assert(sizeof(RayPacket<8>) == sizeof(RTCRay8), "RayPacket<8> must match RTCRay8");
+	static_assert(sizeof(RayPacket<16>) == sizeof(RTCRay16), "RayPacket<16> must match RTCRay16");
 
 	///////////////////////////////////////////////////////////////////////////
 	// Called when there is an embree error
@@ -34,71 +40,523 @@ namespace pathtracer
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Used to map an Embree geometry ID to our scene Meshes and Materials
+	// Check which SIMD instruction sets the CPU (and OS) supports
 	///////////////////////////////////////////////////////////////////////////
-	map<uint32_t, const labhelper::Model *> map_geom_ID_to_model;
-	map<uint32_t, const labhelper::Mesh *> map_geom_ID_to_mesh;
+	static void detectCPUFeatures(bool & avx, bool & avx512)
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool cpu_avx = (info[2] & (1 << 28)) != 0;
+		unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+		avx = cpu_avx && (xcr0 & 0x6) == 0x6;
+		__cpuidex(info, 7, 0);
+		avx512 = avx && (info[1] & (1 << 16)) != 0 && (xcr0 & 0xE0) == 0xE0;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_cpu_init();
+		avx = __builtin_cpu_supports("avx") != 0;
+		avx512 = __builtin_cpu_supports("avx512f") != 0;
+#else
+		avx = avx512 = false;
+#endif
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pick the widest ray packet supported by both the CPU and embree
+	///////////////////////////////////////////////////////////////////////////
+	static int selectPacketWidth(RTCDevice device)
+	{
+		bool avx, avx512;
+		detectCPUFeatures(avx, avx512);
+		if (avx512 && rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT16)) return 16;
+		if (avx && rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT8)) return 8;
+		return 4;
+	}
+
+	int packetWidth()
+	{
+		return packet_width;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Each unique Model gets its own embree scene holding its meshes in 
+	// object space, and every call to addModel() places an instance of that
+	// scene in the top level scene. The flat tables used to go from an 
+	// embree hit to shading information are indexed by ray.instID (the 
+	// instance's geomID in the top level scene) and ray.geomID (the mesh's 
+	// geomID in the model's scene); embree hands out both densely from 0. 
+	// Embree and the shading lookups share the model's welded, indexed 
+	// vertex arrays, so no geometry is copied. The tables are only written 
+	// by the functions that change the scene, which must not be called 
+	// while rays are traced, so concurrent lookups need no locking. 
+	//
+	// Static models are built once. The scenes of deformable models are 
+	// dynamic, so that when their vertices change embree refits their BVH
+	// instead of building it again. Moving an instance only changes the 
+	// top level scene, which is dynamic too and cheap to build again. 
+	///////////////////////////////////////////////////////////////////////////
+	struct GeometryInfo
+	{
+		const labhelper::Mesh * mesh;
+		const labhelper::Material * material;
+		const ShadingMaterial * shading;
+		const uint32_t * indices;				// Three per triangle
+		const vec3 * normals;					// Object space shading normals
+		const vec2 * texture_coordinates;
+	};
+
+	struct ModelScene
+	{
+		const labhelper::Model * model;
+		RTCScene scene;
+		bool committed;
+		bool deformable;
+		vector<GeometryInfo> geometry_table;	// Indexed by geomID
+		vector<ShadingMaterial> shading_materials;	// One per material of the model
+		size_t triangles;
+		uint64_t geometry_hash;
+		bool geometry_hashed;					// Hashed lazily, by hashScene()
+	};
+	map<const labhelper::Model *, ModelScene *> model_scenes;
+
+	struct InstanceInfo
+	{
+		ModelScene * model_scene;
+		mat4 model_matrix;
+		mat3 normal_matrix;						// Object to world space, for normals
+	};
+	vector<InstanceInfo> instance_table;		// Indexed by instID
+	bool top_level_committed = false;
+
+	GeometryStats geometry_stats;
+	BuildStats build_stats;
+	bool compact_scenes = false;
+	int embree_threads = 0;
+	BVHQuality bvh_quality = BVH_BALANCED;
+
+	///////////////////////////////////////////////////////////////////////////
+	// What embree has allocated, as reported by its memory monitor, which 
+	// embree calls from its own threads
+	///////////////////////////////////////////////////////////////////////////
+	atomic<int64_t> embree_bytes(0);
+
+	static bool monitorEmbreeMemory(void *, const ssize_t bytes, const bool)
+	{
+		embree_bytes += bytes;
+		return true;
+	}
+
+	static double secondsSince(chrono::steady_clock::time_point start)
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+	static double megabytes(int64_t bytes)
+	{
+		return double(bytes) / (1024.0 * 1024.0);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The background build. bvh_building is set while the thread builds, 
+	// guarded by bvh_mutex. 
+	///////////////////////////////////////////////////////////////////////////
+	thread bvh_thread;
+	mutex bvh_mutex;
+	condition_variable bvh_condition;
+	bool bvh_building = false;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Create the embree device and an empty scene, the first time we are 
+	// called
+	///////////////////////////////////////////////////////////////////////////
+	static bool embree_is_initialized = false;
+
+	static RTCScene newScene(bool dynamic)
+	{
+		int packet_flag = packet_width == 16 ? RTC_INTERSECT16 : (packet_width == 8 ? RTC_INTERSECT8 : RTC_INTERSECT4);
+		// Embree builds dynamic scenes with its fast (Morton code) builder, 
+		// and high quality static ones with spatial splits
+		int scene_flags = RTC_SCENE_STATIC;
+		if (dynamic || bvh_quality == BVH_FAST) scene_flags = RTC_SCENE_DYNAMIC;
+		else if (bvh_quality == BVH_HIGH_QUALITY) scene_flags |= RTC_SCENE_HIGH_QUALITY;
+		if (compact_scenes) scene_flags |= RTC_SCENE_COMPACT;
+		return rtcDeviceNewScene(embree_device, RTCSceneFlags(scene_flags), 
+			RTCAlgorithmFlags(RTC_INTERSECT1 | packet_flag | RTC_INTERSECT_STREAM));
+	}
+
+	static void initEmbree()
+	{
+		if (embree_is_initialized) return;
+		embree_is_initialized = true;
+		const string config = embree_threads > 0 ? "threads=" + to_string(embree_threads) : "";
+		embree_device = rtcNewDevice(config.c_str());
+		rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
+		rtcDeviceSetMemoryMonitorFunction2(embree_device, monitorEmbreeMemory, nullptr);
+		packet_width = selectPacketWidth(embree_device);
+		embree_scene = newScene(true);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Remove all models from the embree scene
+	///////////////////////////////////////////////////////////////////////////
+	void clearScene()
+	{
+		if (!embree_is_initialized) return;
+		waitForBVH();
+		rtcDeleteScene(embree_scene);
+		for (auto & m : model_scenes) {
+			rtcDeleteScene(m.second->scene);
+			delete m.second;
+		}
+		model_scenes.clear();
+		instance_table.clear();
+		clearLights();
+		geometry_stats = GeometryStats();
+		build_stats = BuildStats();
+		embree_scene = newScene(true);
+		top_level_committed = false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hash what a model's scene is made of. Big models are most of the 
+	// scene's bytes, so they are hashed on all cores. 
+	///////////////////////////////////////////////////////////////////////////
+	static uint64_t hashGeometry(const labhelper::Model * model)
+	{
+		uint64_t hash = hashLargeBytes(hash_seed, model->m_indices.data(), model->m_indices.size() * sizeof(uint32_t));
+		hash = hashLargeBytes(hash, model->m_indexed_positions.data(), model->m_indexed_positions.size() * sizeof(vec3));
+		return hashLargeBytes(hash, model->m_indexed_normals.data(), model->m_indexed_normals.size() * sizeof(vec3));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The CPU memory a model holds for its vertices and indices (embree 
+	// shares the same arrays)
+	///////////////////////////////////////////////////////////////////////////
+	static size_t modelBytes(const labhelper::Model * model)
+	{
+		return model->m_positions.capacity() * sizeof(vec3) + model->m_normals.capacity() * sizeof(vec3) 
+			+ model->m_texture_coordinates.capacity() * sizeof(vec2) + model->m_indices.capacity() * sizeof(uint32_t) 
+			+ model->m_indexed_positions.capacity() * sizeof(vec3) + model->m_indexed_normals.capacity() * sizeof(vec3) 
+			+ model->m_indexed_texture_coordinates.capacity() * sizeof(vec2);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Create the embree scene for a model, the first time it is added
+	///////////////////////////////////////////////////////////////////////////
+	static ModelScene * getModelScene(const labhelper::Model * model, bool deformable)
+	{
+		auto it = model_scenes.find(model);
+		if (it != model_scenes.end()) return it->second;
+
+		ModelScene * model_scene = new ModelScene;
+		model_scene->model = model;
+		model_scene->scene = newScene(deformable);
+		model_scene->committed = false;
+		model_scene->deformable = deformable;
+		model_scene->triangles = 0;
+		model_scene->geometry_hashed = false;
+		model_scenes[model] = model_scene;
+		for (auto & material : model->m_materials) {
+			model_scene->shading_materials.push_back(makeShadingMaterial(material));
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Add each mesh in the model as a geometry in embree, with the 
+		// model's indexed arrays as its (shared) vertex and index buffers, 
+		// and create mappings so that we can connect an embree geom_ID to a 
+		// Material. 
+		///////////////////////////////////////////////////////////////////////
+		for (auto & mesh : model->m_meshes) {
+			const uint32_t number_of_triangles = mesh.m_number_of_vertices / 3;
+			uint32_t geom_ID = rtcNewTriangleMesh(model_scene->scene, 
+				deformable ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC,
+				number_of_triangles, mesh.m_number_of_indexed_vertices);
+			if (model_scene->geometry_table.size() <= geom_ID) model_scene->geometry_table.resize(geom_ID + 1);
+			GeometryInfo & info = model_scene->geometry_table[geom_ID];
+			info.mesh = &mesh;
+			info.material = &model->m_materials[mesh.m_material_idx];
+			info.shading = &model_scene->shading_materials[mesh.m_material_idx];
+			info.indices = &model->m_indices[mesh.m_start_index];
+			info.normals = &model->m_indexed_normals[mesh.m_start_indexed_vertex];
+			info.texture_coordinates = &model->m_indexed_texture_coordinates[mesh.m_start_indexed_vertex];
+			rtcSetBuffer2(model_scene->scene, geom_ID, RTC_VERTEX_BUFFER, 
+				&model->m_indexed_positions[mesh.m_start_indexed_vertex], 0, sizeof(vec3), mesh.m_number_of_indexed_vertices);
+			rtcSetBuffer2(model_scene->scene, geom_ID, RTC_INDEX_BUFFER, 
+				info.indices, 0, 3 * sizeof(uint32_t), number_of_triangles);
+			// What the triangles would take with one padded vertex (plus 
+			// attributes) per corner
+			model_scene->triangles += number_of_triangles;
+			geometry_stats.triangles += number_of_triangles;
+			geometry_stats.unindexed_bytes += number_of_triangles * 3 * 
+				(sizeof(vec4) + sizeof(uint32_t) + sizeof(vec3) + sizeof(vec2));
+		}
+		geometry_stats.bytes += modelBytes(model);
+		return model_scene;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Emissive meshes are area lights, in world space, so they are added 
+	// again whenever their instance moves or their vertices change
+	///////////////////////////////////////////////////////////////////////////
+	static void addEmissiveMeshes(uint32_t inst_ID)
+	{
+		const InstanceInfo & instance = instance_table[inst_ID];
+		const ModelScene * model_scene = instance.model_scene;
+		for (uint32_t geom_ID = 0; geom_ID < model_scene->geometry_table.size(); geom_ID++) {
+			const GeometryInfo & info = model_scene->geometry_table[geom_ID];
+			if (info.mesh != nullptr && info.material->m_emission > 0.0f) {
+				addEmissiveMesh(inst_ID, geom_ID, model_scene->model, *info.mesh, instance.model_matrix);
+			}
+		}
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Add a model to the embree scene
 	///////////////////////////////////////////////////////////////////////////
-	void addModel(const labhelper::Model * model, const mat4 & model_matrix)
+	uint32_t addModel(const labhelper::Model * model, const mat4 & model_matrix, bool deformable)
 	{
 		///////////////////////////////////////////////////////////////////////
 		// Lazy initialize embree on first use
 		///////////////////////////////////////////////////////////////////////
 		cout << "Initializing embree..." << flush;
-		static bool embree_is_initialized = false;
-		if (!embree_is_initialized) {
-			embree_is_initialized = true;
-			embree_device = rtcNewDevice();
-			rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
-			embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
-		}
+		initEmbree();
 		cout << "done.\n";
+		waitForBVH();
+		const auto start = chrono::steady_clock::now();
 
 		///////////////////////////////////////////////////////////////////////
-		// Transform and add each mesh in the model as a geometry in embree, 
-		// and create mappings so that we can connect an embree geom_ID to a 
-		// Material. 
+		// Place an instance of the model's scene, which holds the only copy 
+		// of its geometry, however many times the model is added
 		///////////////////////////////////////////////////////////////////////
 		cout << "Adding " << model->m_name << " to embree scene..." << flush;
-		for (auto & mesh : model->m_meshes) {
-			uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-				mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-			map_geom_ID_to_mesh[geom_ID] = &mesh;
-			map_geom_ID_to_model[geom_ID] = model;
-			// Transform and commit vertices
-			vec4 * embree_vertices = (vec4 *)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-			for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++) {
-				embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+		ModelScene * model_scene = getModelScene(model, deformable);
+		if (model_scene->deformable != deformable) {
+			cout << "\n" << model->m_name << " must be added as deformable every time, or never.\n";
+			exit(1);
+		}
+		uint32_t inst_ID = rtcNewInstance2(embree_scene, model_scene->scene);
+		if (instance_table.size() <= inst_ID) instance_table.resize(inst_ID + 1);
+		instance_table[inst_ID].model_scene = model_scene;
+		setModelTransform(inst_ID, model_matrix);
+		build_stats.add_seconds += secondsSince(start);
+		cout << "done.\n";
+		return inst_ID;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Move an instance. Only the top level scene needs to be built again.
+	///////////////////////////////////////////////////////////////////////////
+	void setModelTransform(uint32_t inst_ID, const mat4 & model_matrix)
+	{
+		waitForBVH();
+		InstanceInfo & instance = instance_table[inst_ID];
+		rtcSetTransform2(embree_scene, inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &model_matrix[0].x);
+		rtcUpdate(embree_scene, inst_ID);
+		instance.model_matrix = model_matrix;
+		instance.normal_matrix = inverse(transpose(mat3(model_matrix)));
+		top_level_committed = false;
+		addEmissiveMeshes(inst_ID);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Tell embree that the vertices of a deformable model have changed, 
+	// which marks its scene for a refit, and its instances' bounds (in the
+	// top level scene) as changed
+	///////////////////////////////////////////////////////////////////////////
+	void updateModelVertices(const labhelper::Model * model)
+	{
+		waitForBVH();
+		auto it = model_scenes.find(model);
+		if (it == model_scenes.end()) return;
+		ModelScene * model_scene = it->second;
+		if (!model_scene->deformable) {
+			cout << model->m_name << " was not added as deformable, its vertices can not be changed.\n";
+			exit(1);
+		}
+		for (uint32_t geom_ID = 0; geom_ID < model_scene->geometry_table.size(); geom_ID++) {
+			if (model_scene->geometry_table[geom_ID].mesh == nullptr) continue;
+			rtcUpdateBuffer(model_scene->scene, geom_ID, RTC_VERTEX_BUFFER);
+		}
+		model_scene->committed = false;
+		model_scene->geometry_hashed = false;
+		for (uint32_t inst_ID = 0; inst_ID < instance_table.size(); inst_ID++) {
+			if (instance_table[inst_ID].model_scene != model_scene) continue;
+			rtcUpdate(embree_scene, inst_ID);
+			addEmissiveMeshes(inst_ID);
+		}
+		top_level_committed = false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Commit the scenes that have changed since they were last committed: 
+	// the models' scenes (each static one is only built once) and then the
+	// top level BVH over the instances. Embree builds each one on all 
+	// cores, so they are committed one at a time. With report, print what
+	// each one took. The memory is what embree allocated meanwhile (mostly
+	// the BVH). 
+	///////////////////////////////////////////////////////////////////////////
+	static void commitScenes(bool report)
+	{
+		const auto start = chrono::steady_clock::now();
+		for (auto & m : model_scenes) {
+			ModelScene * model_scene = m.second;
+			if (model_scene->committed) continue;
+			const auto model_start = chrono::steady_clock::now();
+			const int64_t bytes_before = embree_bytes;
+			rtcCommit(model_scene->scene);
+			model_scene->committed = true;
+			if (report) {
+				cout << "  " << model_scene->model->m_name << ": " << model_scene->triangles << " triangles, "
+					<< secondsSince(model_start) << " s, " << megabytes(embree_bytes - bytes_before) << " MB\n";
 			}
-			rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-			// Commit triangle indices
-			int * embree_tri_idxs = (int *)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-			for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++) {
-				embree_tri_idxs[i] = i;
+		}
+		if (!top_level_committed) {
+			const auto top_level_start = chrono::steady_clock::now();
+			const int64_t bytes_before = embree_bytes;
+			rtcCommit(embree_scene);
+			top_level_committed = true;
+			if (report) {
+				cout << "  Top level: " << instance_table.size() << " instances, " << secondsSince(top_level_start) 
+					<< " s, " << megabytes(embree_bytes - bytes_before) << " MB\n";
 			}
-			rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
 		}
+		build_stats.build_seconds += secondsSince(start);
+		build_stats.embree_bytes = size_t(std::max(int64_t(0), int64_t(embree_bytes)));
+	}
+
+	void updateBVH()
+	{
+		waitForBVH();
+		commitScenes(false);
+	}
+
+	static void buildAndReport()
+	{
+		static const char * quality_names[] = { "fast", "balanced", "high quality" };
+		cout << "Embree building BVH (" << quality_names[bvh_quality] << ")...\n";
+		commitScenes(true);
 		cout << "done.\n";
+		if (geometry_stats.triangles > 0) {
+			cout << "Geometry: " << geometry_stats.triangles << " triangles, "
+				<< double(geometry_stats.bytes) / double(geometry_stats.triangles) << " bytes/triangle ("
+				<< double(geometry_stats.unindexed_bytes) / double(geometry_stats.triangles) 
+				<< " bytes/triangle unindexed), excluding the BVH.\n";
+		}
+		cout << "Scene setup: " << build_stats.add_seconds << " s adding models, " << build_stats.build_seconds
+			<< " s building, " << megabytes(build_stats.embree_bytes) << " MB held by embree.\n";
+	}
+
+	void buildBVH()
+	{
+		waitForBVH();
+		buildAndReport();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Build on a thread of its own, which says when it is done
+	///////////////////////////////////////////////////////////////////////////
+	void startBuildingBVH()
+	{
+		waitForBVH();
+		{
+			lock_guard<mutex> lock(bvh_mutex);
+			bvh_building = true;
+		}
+		bvh_thread = thread([] {
+			buildAndReport();
+			lock_guard<mutex> lock(bvh_mutex);
+			bvh_building = false;
+			bvh_condition.notify_all();
+		});
+	}
+
+	bool bvhReady()
+	{
+		lock_guard<mutex> lock(bvh_mutex);
+		return !bvh_building;
+	}
+
+	void waitForBVH()
+	{
+		unique_lock<mutex> lock(bvh_mutex);
+		bvh_condition.wait(lock, [] { return !bvh_building; });
+		if (bvh_thread.joinable()) bvh_thread.join();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Update the material pointers after meshes have been assigned new
+	// materials, and the shading materials after materials have changed.
+	// Which meshes are lights, and their radiance, may have changed too, so
+	// the triangle lights are made again. 
+	///////////////////////////////////////////////////////////////////////////
+	void updateMaterials()
+	{
+		for (auto & m : model_scenes) {
+			ModelScene * model_scene = m.second;
+			for (size_t i = 0; i < m.first->m_materials.size(); i++) {
+				model_scene->shading_materials[i] = makeShadingMaterial(m.first->m_materials[i]);
+			}
+			for (auto & info : model_scene->geometry_table) {
+				if (info.mesh == nullptr) continue;
+				info.material = &m.first->m_materials[info.mesh->m_material_idx];
+				info.shading = &model_scene->shading_materials[info.mesh->m_material_idx];
+			}
+		}
+		clearLights();
+		for (uint32_t inst_ID = 0; inst_ID < instance_table.size(); inst_ID++) {
+			if (instance_table[inst_ID].model_scene != nullptr) addEmissiveMeshes(inst_ID);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Hash the scene. Materials are hashed by their values, which is what 
+	// shading reads. 
+	///////////////////////////////////////////////////////////////////////////
+	uint64_t hashScene(uint64_t hash)
+	{
+		for (const InstanceInfo & instance : instance_table) {
+			if (instance.model_scene == nullptr) continue;
+			const labhelper::Model * model = instance.model_scene->model;
+			if (!instance.model_scene->geometry_hashed) {
+				instance.model_scene->geometry_hash = hashGeometry(model);
+				instance.model_scene->geometry_hashed = true;
+			}
+			hash = hashValue(hash, instance.model_scene->geometry_hash);
+			hash = hashValue(hash, instance.model_matrix);
+			for (const labhelper::Mesh & mesh : model->m_meshes) hash = hashValue(hash, mesh.m_material_idx);
+			for (const labhelper::Material & material : model->m_materials) {
+				hash = hashValue(hash, material.m_color);
+				hash = hashValue(hash, material.m_reflectivity);
+				hash = hashValue(hash, material.m_shininess);
+				hash = hashValue(hash, material.m_metalness);
+				hash = hashValue(hash, material.m_fresnel);
+				hash = hashValue(hash, material.m_emission);
+				hash = hashValue(hash, material.m_transparency);
+			}
+		}
+		return hash;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Extract an intersection from an embree ray.
+	// Extract an intersection from an embree ray. Embree reports the 
+	// geometry normal of an instance hit in object space, so both normals
+	// are taken to world space with the instance's normal matrix. 
 	///////////////////////////////////////////////////////////////////////////
 	Intersection getIntersection(const Ray & r) 
 	{
-		const labhelper::Model * model = map_geom_ID_to_model[r.geomID];
-		const labhelper::Mesh * mesh = map_geom_ID_to_mesh[r.geomID];
+		const InstanceInfo & instance = instance_table[r.instID];
+		const GeometryInfo & info = instance.model_scene->geometry_table[r.geomID];
+		const uint32_t * v = info.indices + 3 * r.primID;
 		Intersection i;
-		i.material = &(model->m_materials[mesh->m_material_idx]);
-		vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-		vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-		vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+		i.material = info.material;
+		i.shading = info.shading;
 		float w = 1.0f - (r.u + r.v);
-		i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-		i.geometry_normal = -normalize(r.n);
+		i.shading_normal = normalize(instance.normal_matrix * 
+			(w * info.normals[v[0]] + r.u * info.normals[v[1]] + r.v * info.normals[v[2]]));
+		i.texture_coordinate = w * info.texture_coordinates[v[0]] + r.u * info.texture_coordinates[v[1]] + 
+			r.v * info.texture_coordinates[v[2]];
+		i.geometry_normal = -normalize(instance.normal_matrix * r.n);
 		i.position = r.o + r.tfar * r.d;
 		i.wo = normalize(-r.d);
 		return i;
@@ -122,4 +580,66 @@ namespace pathtracer
 		rtcOccluded(embree_scene, *((RTCRay *)&r));
 		return r.geomID != RTC_INVALID_GEOMETRY_ID;
 	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Packet versions of intersect() and occluded()
+	///////////////////////////////////////////////////////////////////////////
+	void intersect4(const int * valid, RayPacket<4> & packet)
+	{
+		rtcIntersect4(valid, embree_scene, *((RTCRay4 *)&packet));
+	}
+	void intersect8(const int * valid, RayPacket<8> & packet)
+	{
+		rtcIntersect8(valid, embree_scene, *((RTCRay8 *)&packet));
+	}
+	void intersect16(const int * valid, RayPacket<16> & packet)
+	{
+		rtcIntersect16(valid, embree_scene, *((RTCRay16 *)&packet));
+	}
+	void occluded4(const int * valid, RayPacket<4> & packet)
+	{
+		rtcOccluded4(valid, embree_scene, *((RTCRay4 *)&packet));
+	}
+	void occluded8(const int * valid, RayPacket<8> & packet)
+	{
+		rtcOccluded8(valid, embree_scene, *((RTCRay8 *)&packet));
+	}
+	void occluded16(const int * valid, RayPacket<16> & packet)
+	{
+		rtcOccluded16(valid, embree_scene, *((RTCRay16 *)&packet));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Stream versions of intersect() and occluded()
+	///////////////////////////////////////////////////////////////////////////
+	static RTCRayNp streamPointers(RayQueue & queue)
+	{
+		RTCRayNp rays;
+		rays.orgx = queue.ox.data(); rays.orgy = queue.oy.data(); rays.orgz = queue.oz.data();
+		rays.dirx = queue.dx.data(); rays.diry = queue.dy.data(); rays.dirz = queue.dz.data();
+		rays.tnear = queue.tnear.data(); rays.tfar = queue.tfar.data(); rays.time = queue.time.data();
+		rays.mask = queue.mask.data();
+		rays.Ngx = queue.nx.data(); rays.Ngy = queue.ny.data(); rays.Ngz = queue.nz.data();
+		rays.u = queue.u.data(); rays.v = queue.v.data();
+		rays.geomID = queue.geomID.data(); rays.primID = queue.primID.data(); rays.instID = queue.instID.data();
+		return rays;
+	}
+
+	void intersect(RayQueue & queue, bool coherent)
+	{
+		if (queue.size() == 0) return;
+		RTCIntersectContext context;
+		context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+		context.userRayExt = nullptr;
+		rtcIntersectNp(embree_scene, &context, streamPointers(queue), queue.size());
+	}
+
+	void occluded(RayQueue & queue)
+	{
+		if (queue.size() == 0) return;
+		RTCIntersectContext context;
+		context.flags = RTC_INTERSECT_INCOHERENT;
+		context.userRayExt = nullptr;
+		rtcOccludedNp(embree_scene, &context, streamPointers(queue), queue.size());
+	}
 }
\ No newline at end of file
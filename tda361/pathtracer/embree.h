@@ -3,19 +3,124 @@
 #include <embree2/rtcore_ray.h>
 #include "Model.h"
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <map>
+#include <vector>
 
 namespace pathtracer
 {
+	struct ShadingMaterial;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Build scenes with RTC_SCENE_COMPACT, which uses less memory for the 
+	// BVH at some cost in trace speed (useful for huge scenes). Only affects
+	// scenes created after it is set, so set it before the first addModel()
+	// (or before clearScene()). 
+	///////////////////////////////////////////////////////////////////////////
+	extern bool compact_scenes;
+
+	///////////////////////////////////////////////////////////////////////////
+	// How many threads embree builds BVHs with (0 = one per core). Only 
+	// read when embree is initialized, by the first addModel(). 
+	///////////////////////////////////////////////////////////////////////////
+	extern int embree_threads;
+
+	///////////////////////////////////////////////////////////////////////////
+	// How much time embree spends building the BVHs of static models: fast
+	// builds them quickly with the builder for dynamic scenes, high quality
+	// takes longest but gives the fastest traversal. Like compact_scenes, 
+	// only affects scenes created after it is set. 
+	///////////////////////////////////////////////////////////////////////////
+	enum BVHQuality
+	{
+		BVH_FAST = 0,
+		BVH_BALANCED = 1,
+		BVH_HIGH_QUALITY = 2
+	};
+	extern BVHQuality bvh_quality;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Memory held by the models of the scene for their geometry and shading
+	// attributes (not counting the BVH), and what the same triangles would 
+	// take with one padded vertex per triangle corner and no index sharing. 
+	///////////////////////////////////////////////////////////////////////////
+	extern struct GeometryStats {
+		size_t triangles = 0;
+		size_t bytes = 0;
+		size_t unindexed_bytes = 0;
+	} geometry_stats;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Where the time setting up the scene went, and what embree holds (the 
+	// BVHs and its own copies of the scene data) as of the last build. 
+	// Reset by clearScene(). 
+	///////////////////////////////////////////////////////////////////////////
+	extern struct BuildStats {
+		double add_seconds = 0.0;			// In addModel()
+		double build_seconds = 0.0;			// Committing scenes to embree
+		size_t embree_bytes = 0;
+	} build_stats;
+
 	///////////////////////////////////////////////////////////////////////////
-	// Add a model to the embree scene
+	// Add a model to the embree scene. Adding the same model several times
+	// (with different model matrices) places instances that share one copy
+	// of its geometry and BVH. Returns the instance's ID. 
+	//
+	// The vertices of a deformable model may be changed after the scene is
+	// built (see updateModelVertices()). A model must be added as 
+	// deformable every time or never. 
 	///////////////////////////////////////////////////////////////////////////
-	void addModel(const labhelper::Model * model, const glm::mat4 & model_matrix);
+	uint32_t addModel(const labhelper::Model * model, const glm::mat4 & model_matrix, bool deformable = false);
 
 	///////////////////////////////////////////////////////////////////////////
-	// Build an acceleration structure for the scene
+	// Animate the scene: move an instance placed by addModel(), or tell the
+	// pathtracer that the positions (and normals) of a deformable model 
+	// have been changed in place. The number of vertices must stay the 
+	// same, as embree reads the model's arrays. Call updateBVH() before 
+	// tracing again. Do not call while rays are traced. 
+	///////////////////////////////////////////////////////////////////////////
+	void setModelTransform(uint32_t inst_ID, const glm::mat4 & model_matrix);
+	void updateModelVertices(const labhelper::Model * model);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Remove all models from the embree scene, so that a new scene can be 
+	// added and built
+	///////////////////////////////////////////////////////////////////////////
+	void clearScene();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Call when a mesh in a model that has been added has changed its 
+	// material index, or when a material has changed (which also updates
+	// the emissive triangle lights). Do not call while rays are traced. 
+	///////////////////////////////////////////////////////////////////////////
+	void updateMaterials();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Build an acceleration structure for the scene. updateBVH() does the 
+	// same without printing, and only does what the scene's changes since
+	// the last call need: the BVHs of deformed models are refit, and the 
+	// top level over the instances is built again if anything moved. 
 	///////////////////////////////////////////////////////////////////////////
 	void buildBVH();
+	void updateBVH();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Do what buildBVH() does on a thread of its own, so that the program 
+	// can go on (e.g. open its window) while the BVH is built. Rays must not
+	// be traced before waitForBVH() has returned, which tracePaths() and 
+	// the functions that change the scene call. bvhReady() tells whether 
+	// the build is done without waiting for it. 
+	///////////////////////////////////////////////////////////////////////////
+	void startBuildingBVH();
+	bool bvhReady();
+	void waitForBVH();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add the models in the scene, where they are placed and their
+	// materials to a hash (see checkpoint.h). The geometry of a model is 
+	// only hashed again after its vertices have changed. 
+	///////////////////////////////////////////////////////////////////////////
+	uint64_t hashScene(uint64_t hash);
 
 	///////////////////////////////////////////////////////////////////////////
 	// This struct is what an embree Ray must look like. It contains the 
@@ -45,6 +150,117 @@ namespace pathtracer
 		uint32_t instID = RTC_INVALID_GEOMETRY_ID;
 	};
 
+	///////////////////////////////////////////////////////////////////////////
+	// A packet of N rays, laid out like embree's RTCRay4/8/16. It holds the 
+	// same information as N Ray structs, but each member is stored as an 
+	// array over the rays in the packet so that embree can trace them all 
+	// at once with SIMD instructions. 
+	///////////////////////////////////////////////////////////////////////////
+	template<int N>
+	struct alignas(4 * N) RayPacket
+	{
+		RayPacket()
+		{
+			for (int i = 0; i < N; i++) {
+				tnear[i] = 0.0f; tfar[i] = FLT_MAX; time[i] = 0.0f;
+				mask[i] = 0xFFFFFFFF;
+				geomID[i] = primID[i] = instID[i] = RTC_INVALID_GEOMETRY_ID;
+			}
+		}
+		// Copy a ray into slot i of the packet
+		void setRay(int i, const Ray & r)
+		{
+			ox[i] = r.o.x; oy[i] = r.o.y; oz[i] = r.o.z;
+			dx[i] = r.d.x; dy[i] = r.d.y; dz[i] = r.d.z;
+			tnear[i] = r.tnear; tfar[i] = r.tfar; time[i] = r.time;
+			mask[i] = r.mask;
+			geomID[i] = r.geomID; primID[i] = r.primID; instID[i] = r.instID;
+		}
+		// Extract the ray (and hit data) in slot i of the packet
+		Ray getRay(int i) const
+		{
+			Ray r(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i]), tnear[i], tfar[i]);
+			r.time = time[i];
+			r.mask = mask[i];
+			r.n = glm::vec3(nx[i], ny[i], nz[i]);
+			r.u = u[i]; r.v = v[i];
+			r.geomID = geomID[i]; r.primID = primID[i]; r.instID = instID[i];
+			return r;
+		}
+		// Ray data
+		float ox[N], oy[N], oz[N];
+		float dx[N], dy[N], dz[N];
+		float tnear[N], tfar[N], time[N];
+		uint32_t mask[N];
+		// Hit Data
+		float nx[N], ny[N], nz[N];
+		float u[N], v[N];
+		uint32_t geomID[N];
+		uint32_t primID[N];
+		uint32_t instID[N];
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A queue of rays of arbitrary length, stored as one array per member
+	// (structure of arrays). A whole queue can be handed to embree's ray 
+	// stream API in one call, which lets embree reorder and regroup the rays
+	// internally. The arrays only grow: clear() keeps them allocated, so a
+	// queue that is reused for every tile stops allocating after the first. 
+	///////////////////////////////////////////////////////////////////////////
+	struct RayQueue
+	{
+		size_t size() const { return count; }
+		void clear() { count = 0; }
+		// Make room for n rays without reallocating
+		void reserve(size_t n)
+		{
+			if (n <= ox.size()) return;
+			ox.resize(n); oy.resize(n); oz.resize(n);
+			dx.resize(n); dy.resize(n); dz.resize(n);
+			tnear.resize(n); tfar.resize(n); time.resize(n);
+			mask.resize(n);
+			nx.resize(n); ny.resize(n); nz.resize(n);
+			u.resize(n); v.resize(n);
+			geomID.resize(n); primID.resize(n); instID.resize(n);
+		}
+		// Append a ray to the queue and return its index
+		size_t push(const Ray & r)
+		{
+			size_t i = count++;
+			if (i == ox.size()) reserve(std::max<size_t>(256, 2 * i));
+			ox[i] = r.o.x; oy[i] = r.o.y; oz[i] = r.o.z;
+			dx[i] = r.d.x; dy[i] = r.d.y; dz[i] = r.d.z;
+			tnear[i] = r.tnear; tfar[i] = r.tfar; time[i] = r.time;
+			mask[i] = r.mask;
+			geomID[i] = r.geomID; primID[i] = r.primID; instID[i] = r.instID;
+			return i;
+		}
+		// Extract the ray (and hit data) at index i
+		Ray getRay(size_t i) const
+		{
+			Ray r(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i]), tnear[i], tfar[i]);
+			r.time = time[i];
+			r.mask = mask[i];
+			r.n = glm::vec3(nx[i], ny[i], nz[i]);
+			r.u = u[i]; r.v = v[i];
+			r.geomID = geomID[i]; r.primID = primID[i]; r.instID = instID[i];
+			return r;
+		}
+		// Ray data
+		std::vector<float> ox, oy, oz;
+		std::vector<float> dx, dy, dz;
+		std::vector<float> tnear, tfar, time;
+		std::vector<uint32_t> mask;
+		// Hit Data
+		std::vector<float> nx, ny, nz;
+		std::vector<float> u, v;
+		std::vector<uint32_t> geomID;
+		std::vector<uint32_t> primID;
+		std::vector<uint32_t> instID;
+		// Number of rays in the queue, the arrays may be longer
+		size_t count = 0;
+	};
+
 	///////////////////////////////////////////////////////////////////////////
 	// This struct describes an intersection, as extracted from the Embree 
 	// ray. 
@@ -55,7 +271,9 @@ namespace pathtracer
 		glm::vec3 geometry_normal; 
 		glm::vec3 shading_normal;
 		glm::vec3 wo; 
+		glm::vec2 texture_coordinate;
 		const labhelper::Material * material;
+		const ShadingMaterial * shading;		// See shading.h
 	};
 	Intersection getIntersection(const Ray & r); 
 
@@ -69,4 +287,37 @@ namespace pathtracer
 	// intersection).
 	///////////////////////////////////////////////////////////////////////////
 	bool occluded(Ray &r);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Packet versions of intersect() and occluded(). Only the rays whose 
+	// entry in valid is -1 are traced, the others must be set to 0. 
+	///////////////////////////////////////////////////////////////////////////
+	void intersect4(const int * valid, RayPacket<4> & packet);
+	void intersect8(const int * valid, RayPacket<8> & packet);
+	void intersect16(const int * valid, RayPacket<16> & packet);
+	void occluded4(const int * valid, RayPacket<4> & packet);
+	void occluded8(const int * valid, RayPacket<8> & packet);
+	void occluded16(const int * valid, RayPacket<16> & packet);
+	inline void intersect(const int * valid, RayPacket<4> & packet) { intersect4(valid, packet); }
+	inline void intersect(const int * valid, RayPacket<8> & packet) { intersect8(valid, packet); }
+	inline void intersect(const int * valid, RayPacket<16> & packet) { intersect16(valid, packet); }
+	inline void occluded(const int * valid, RayPacket<4> & packet) { occluded4(valid, packet); }
+	inline void occluded(const int * valid, RayPacket<8> & packet) { occluded8(valid, packet); }
+	inline void occluded(const int * valid, RayPacket<16> & packet) { occluded16(valid, packet); }
+
+	///////////////////////////////////////////////////////////////////////////
+	// Stream versions of intersect() and occluded(), tracing every ray in 
+	// the queue. Set coherent if the rays are known to be coherent (e.g., 
+	// camera rays). After occluded(), a ray's geomID is 0 if it was blocked 
+	// and RTC_INVALID_GEOMETRY_ID otherwise. 
+	///////////////////////////////////////////////////////////////////////////
+	void intersect(RayQueue & queue, bool coherent = false);
+	void occluded(RayQueue & queue);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The widest packet (4, 8 or 16) that both the CPU and embree support. 
+	// It is detected when embree is initialized and the scene only enables 
+	// the packet functions for that width. 
+	///////////////////////////////////////////////////////////////////////////
+	int packetWidth();
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "imageio.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <stb_image_write.h>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The rendered image has its first row at the bottom, while .hdr and 
+	// .png files store the top row first (.pfm stores the bottom row first).
+	///////////////////////////////////////////////////////////////////////////
+	bool writePFM(const string & filename, const Image & image)
+	{
+		ofstream file(filename, ios::binary);
+		if (!file.is_open()) return false;
+		file << "PF\n" << image.width << " " << image.height << "\n-1.0\n";
+		file.write((const char *)&image.data[0].x, image.data.size() * sizeof(vec3));
+		return file.good();
+	}
+
+	bool writeHDR(const string & filename, const Image & image)
+	{
+		vector<vec3> flipped(image.data.size());
+		for (int y = 0; y < image.height; y++) {
+			copy(image.data.begin() + y * image.width, image.data.begin() + (y + 1) * image.width,
+				flipped.begin() + (image.height - 1 - y) * image.width);
+		}
+		return stbi_write_hdr(filename.c_str(), image.width, image.height, 3, &flipped[0].x) != 0;
+	}
+
+	bool writePNG(const string & filename, const Image & image, float exposure, float gamma)
+	{
+		vector<uint8_t> pixels(image.width * image.height * 3);
+		for (int y = 0; y < image.height; y++) {
+			for (int x = 0; x < image.width; x++) {
+				vec3 color = image.data[y * image.width + x] * exposure;
+				color = pow(clamp(color, vec3(0.0f), vec3(1.0f)), vec3(1.0f / gamma));
+				for (int c = 0; c < 3; c++) {
+					pixels[((image.height - 1 - y) * image.width + x) * 3 + c] = uint8_t(color[c] * 255.0f + 0.5f);
+				}
+			}
+		}
+		return stbi_write_png(filename.c_str(), image.width, image.height, 3, pixels.data(), image.width * 3) != 0;
+	}
+
+	bool writeImage(const string & filename, const Image & image, float exposure, float gamma)
+	{
+		string extension = filename.substr(std::min(filename.size(), filename.find_last_of('.')));
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (extension == ".pfm") return writePFM(filename, image);
+		if (extension == ".hdr") return writeHDR(filename, image);
+		if (extension == ".png") return writePNG(filename, image, exposure, gamma);
+		cout << "Unknown image format: " << filename << " (expected .hdr, .pfm or .png).\n";
+		return false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Read a little endian, three channel .pfm image
+	///////////////////////////////////////////////////////////////////////////
+	bool readPFM(const string & filename, Image & image)
+	{
+		ifstream file(filename, ios::binary);
+		if (!file.is_open()) return false;
+		string type;
+		float scale;
+		file >> type >> image.width >> image.height >> scale;
+		file.get(); // The single whitespace character before the pixels
+		if (type != "PF" || scale >= 0.0f || image.width <= 0 || image.height <= 0) {
+			cout << "Unsupported .pfm file: " << filename << "\n";
+			return false;
+		}
+		image.data.resize(image.width * image.height);
+		file.read((char *)&image.data[0].x, image.data.size() * sizeof(vec3));
+		return file.good();
+	}
+}
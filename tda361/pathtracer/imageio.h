@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Write an image to disk, as .hdr or .pfm (linear radiance) or as .png 
+	// (clamped, after exposure and gamma). The format is picked from the 
+	// file extension. Returns false if the file could not be written. 
+	///////////////////////////////////////////////////////////////////////////
+	bool writeImage(const std::string & filename, const Image & image, float exposure = 1.0f, float gamma = 1.0f);
+	bool writePFM(const std::string & filename, const Image & image);
+	bool writeHDR(const std::string & filename, const Image & image);
+	bool writePNG(const std::string & filename, const Image & image, float exposure, float gamma);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Read a .pfm image (as written by writePFM) into image.width, 
+	// image.height and image.data. Returns false if it could not be read. 
+	///////////////////////////////////////////////////////////////////////////
+	bool readPFM(const std::string & filename, Image & image);
+}
@@ -0,0 +1,351 @@
+#include "lights.h"
+#include <unordered_map>
+#include "sampling.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Global variables
+	///////////////////////////////////////////////////////////////////////////
+	vector<PointLight> point_lights;
+
+	///////////////////////////////////////////////////////////////////////////
+	// An emissive triangle in world space, emitting the same radiance from
+	// both sides
+	///////////////////////////////////////////////////////////////////////////
+	struct TriangleLight
+	{
+		vec3 p0, e1, e2;	// A corner and the two edges from it
+		vec3 normal;
+		float area;
+		vec3 radiance;
+	};
+	vector<TriangleLight> triangle_lights;
+	// The index of the first triangle light of each emissive mesh, keyed by
+	// (instID, geomID). The mesh's triangles follow in primID order.
+	unordered_map<uint64_t, uint32_t> emissive_meshes;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The lights that are picked from: the point lights (point_light first,
+	// if it is on) followed by the triangle lights, as of the last call to
+	// updateLights()
+	///////////////////////////////////////////////////////////////////////////
+	vector<PointLight> active_point_lights;
+	vector<AliasEntry> light_table;
+	bool triangle_lights_changed = true;
+
+	static uint64_t meshKey(uint32_t inst_ID, uint32_t geom_ID)
+	{
+		return (uint64_t(inst_ID) << 32) | uint64_t(geom_ID);
+	}
+
+	static float luminance(const vec3 & c)
+	{
+		return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add the triangles of an emissive mesh as lights, or overwrite them if
+	// the mesh has been added before
+	///////////////////////////////////////////////////////////////////////////
+	void addEmissiveMesh(uint32_t inst_ID, uint32_t geom_ID, const labhelper::Model * model,
+		const labhelper::Mesh & mesh, const mat4 & model_matrix)
+	{
+		const labhelper::Material & material = model->m_materials[mesh.m_material_idx];
+		const vec3 radiance = material.m_emission * material.m_color;
+		if (luminance(radiance) <= 0.0f) return;
+		const uint32_t number_of_triangles = mesh.m_number_of_vertices / 3;
+		auto it = emissive_meshes.find(meshKey(inst_ID, geom_ID));
+		if (it == emissive_meshes.end()) {
+			it = emissive_meshes.insert(make_pair(meshKey(inst_ID, geom_ID), uint32_t(triangle_lights.size()))).first;
+			triangle_lights.resize(triangle_lights.size() + number_of_triangles);
+		}
+		TriangleLight * lights = &triangle_lights[it->second];
+		const uint32_t * indices = &model->m_indices[mesh.m_start_index];
+		const vec3 * positions = &model->m_indexed_positions[mesh.m_start_indexed_vertex];
+		// Emissive meshes can be large (e.g. the windows of a city), and this
+		// is done again whenever they move
+#pragma omp parallel for
+		for (int t = 0; t < int(number_of_triangles); t++) {
+			const vec3 p0 = vec3(model_matrix * vec4(positions[indices[3 * t + 0]], 1.0f));
+			const vec3 p1 = vec3(model_matrix * vec4(positions[indices[3 * t + 1]], 1.0f));
+			const vec3 p2 = vec3(model_matrix * vec4(positions[indices[3 * t + 2]], 1.0f));
+			TriangleLight & light = lights[t];
+			light.p0 = p0;
+			light.e1 = p1 - p0;
+			light.e2 = p2 - p0;
+			const vec3 n = cross(light.e1, light.e2);
+			light.area = 0.5f * length(n);
+			light.normal = light.area > 0.0f ? n / (2.0f * light.area) : vec3(0.0f);
+			light.radiance = radiance;
+		}
+		triangle_lights_changed = true;
+	}
+
+	void clearLights()
+	{
+		triangle_lights.clear();
+		emissive_meshes.clear();
+		triangle_lights_changed = true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Rebuild the light table if a light has been added, removed or changed
+	///////////////////////////////////////////////////////////////////////////
+	static bool samePointLights(const vector<PointLight> & a, const vector<PointLight> & b)
+	{
+		if (a.size() != b.size()) return false;
+		for (size_t i = 0; i < a.size(); i++) {
+			if (a[i].intensity_multiplier != b[i].intensity_multiplier || a[i].color != b[i].color ||
+				a[i].position != b[i].position) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void updateLights()
+	{
+		vector<PointLight> current;
+		if (point_light.intensity_multiplier > 0.0f) current.push_back(point_light);
+		current.insert(current.end(), point_lights.begin(), point_lights.end());
+		if (!triangle_lights_changed && samePointLights(current, active_point_lights)) return;
+		active_point_lights = current;
+		triangle_lights_changed = false;
+
+		// The power of a point light is 4 pi I, and that of a two sided area
+		// light is 2 pi A L
+		vector<float> power;
+		power.reserve(active_point_lights.size() + triangle_lights.size());
+		for (auto & light : active_point_lights) {
+			power.push_back(4.0f * M_PI * light.intensity_multiplier * luminance(light.color));
+		}
+		for (auto & light : triangle_lights) {
+			power.push_back(2.0f * M_PI * light.area * luminance(light.radiance));
+		}
+		light_table.resize(power.size());
+		if (!power.empty()) buildAliasTable(power.data(), int(power.size()), light_table.data());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Emission, and the pdf of hitting an emissive triangle by light sampling
+	///////////////////////////////////////////////////////////////////////////
+	vec3 Lemitted(const Intersection & hit)
+	{
+		return hit.material->m_emission * hit.material->m_color;
+	}
+
+	float lightPdf(const Ray & ray)
+	{
+		auto it = emissive_meshes.find(meshKey(ray.instID, ray.geomID));
+		if (it == emissive_meshes.end() || triangle_lights_changed) return 0.0f;
+		const uint32_t i = it->second + ray.primID;
+		const TriangleLight & light = triangle_lights[i];
+		const float cos_light = abs(dot(light.normal, ray.d));
+		if (light.area <= 0.0f || cos_light <= 0.0f) return 0.0f;
+		return light_table[active_point_lights.size() + i].pdf * ray.tfar * ray.tfar / (light.area * cos_light);
+	}
+
+	vec3 offsetOrigin(const Intersection & hit, const vec3 & d)
+	{
+		return hit.position + (dot(d, hit.geometry_normal) > 0.0f ? EPSILON : -EPSILON) * hit.geometry_normal;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shadow ray queue
+	///////////////////////////////////////////////////////////////////////////
+	void ShadowQueue::clear()
+	{
+		rays.clear();
+		slots.clear();
+		contributions.clear();
+	}
+
+	void ShadowQueue::push(const Ray & ray, int slot, const vec3 & contribution)
+	{
+		rays.push(ray);
+		slots.push_back(slot);
+		contributions.push_back(contribution);
+	}
+
+	void ShadowQueue::trace(vector<vec3> & radiance)
+	{
+		if (rays.size() == 0) return;
+		occluded(rays);
+		for (size_t i = 0; i < rays.size(); i++) {
+			if (rays.geomID[i] == RTC_INVALID_GEOMETRY_ID) radiance[slots[i]] += contributions[i];
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sample one light and one direction of the environment. Each sample 
+	// that can contribute gets its shadow ray, the radiance Le arriving along
+	// it times cos_theta / pdf, and the pdf to weight it against the brdf 
+	// with (0 for point lights, which brdf samples can not hit). 
+	///////////////////////////////////////////////////////////////////////////
+	struct LightSample
+	{
+		Ray shadow_ray;
+		vec3 wi;
+		vec3 Le_cos_over_pdf;
+		float pdf;
+	};
+
+	static int sampleLights(const Intersection & hit, LightSample samples[2])
+	{
+		int count = 0;
+		if (!light_table.empty()) {
+			float u = getSampler().get1D();
+			const vec2 uv = getSampler().get2D();
+			const uint32_t i = sampleAliasTable(light_table.data(), int(light_table.size()), u);
+			const float pick_pdf = light_table[i].pdf;
+			if (i < active_point_lights.size()) {
+				const PointLight & light = active_point_lights[i];
+				const vec3 to_light = light.position - hit.position;
+				const float distance_to_light = length(to_light);
+				const vec3 wi = to_light / distance_to_light;
+				const float cos_theta = dot(wi, hit.shading_normal);
+				if (cos_theta > 0.0f) {
+					const vec3 origin = offsetOrigin(hit, wi);
+					LightSample & sample = samples[count++];
+					sample.shadow_ray = Ray(origin, wi, 0.0f, length(light.position - origin));
+					sample.wi = wi;
+					sample.Le_cos_over_pdf = light.intensity_multiplier * light.color * cos_theta /
+						(distance_to_light * distance_to_light * pick_pdf);
+					sample.pdf = 0.0f;
+				}
+			}
+			else {
+				// A uniformly distributed point on an emissive triangle
+				const TriangleLight & light = triangle_lights[i - active_point_lights.size()];
+				const float su = sqrt(uv.x);
+				const vec3 p = light.p0 + su * (1.0f - uv.y) * light.e1 + su * uv.y * light.e2;
+				const vec3 to_light = p - hit.position;
+				const float distance2 = dot(to_light, to_light);
+				const vec3 wi = to_light / sqrt(distance2);
+				const float cos_theta = dot(wi, hit.shading_normal);
+				const float cos_light = abs(dot(wi, light.normal));
+				if (cos_theta > 0.0f && cos_light > 0.0f) {
+					// Stop just short of the light, so that it does not block itself
+					const vec3 origin = offsetOrigin(hit, wi);
+					LightSample & sample = samples[count++];
+					sample.shadow_ray = Ray(origin, wi, 0.0f, 0.999f * length(p - origin));
+					sample.wi = wi;
+					sample.pdf = pick_pdf * distance2 / (light.area * cos_light);
+					sample.Le_cos_over_pdf = light.radiance * cos_theta / sample.pdf;
+				}
+			}
+		}
+		{
+			vec3 wi;
+			float pdf;
+			const vec3 Le = sampleEnvironment(wi, pdf);
+			const float cos_theta = dot(wi, hit.shading_normal);
+			if (pdf > 0.0f && cos_theta > 0.0f) {
+				LightSample & sample = samples[count++];
+				sample.shadow_ray = Ray(offsetOrigin(hit, wi), wi);
+				sample.wi = wi;
+				sample.pdf = pdf;
+				sample.Le_cos_over_pdf = Le * cos_theta / pdf;
+			}
+		}
+		return count;
+	}
+
+	void sampleDirectLight(const Intersection & hit, BRDF & mat, const vec3 & throughput, bool brdf_sampled,
+		int slot, ShadowQueue & shadows)
+	{
+		LightSample samples[2];
+		const int count = sampleLights(hit, samples);
+		for (int i = 0; i < count; i++) {
+			const LightSample & sample = samples[i];
+			const float weight = (brdf_sampled && sample.pdf > 0.0f) ?
+				powerHeuristic(sample.pdf, mat.pdf(sample.wi, hit.wo, hit.shading_normal)) : 1.0f;
+			const vec3 contribution = weight * throughput * mat.f(sample.wi, hit.wo, hit.shading_normal) *
+				sample.Le_cos_over_pdf;
+			if (contribution != vec3(0.0f)) shadows.push(sample.shadow_ray, slot, contribution);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The batched version: the brdf is evaluated later, in resolve()
+	///////////////////////////////////////////////////////////////////////////
+	void DirectLightBatch::clear()
+	{
+		shading.clear();
+		rays.clear();
+		slots.clear();
+		factors.clear();
+		light_pdfs.clear();
+	}
+
+	void DirectLightBatch::resolve(ShadowQueue & shadows)
+	{
+		shading.evaluate();
+		for (size_t i = 0; i < rays.size(); i++) {
+			const float weight = light_pdfs[i] > 0.0f ? powerHeuristic(light_pdfs[i], shading.pdf(i)) : 1.0f;
+			const vec3 contribution = weight * factors[i] * shading.f(i);
+			if (contribution != vec3(0.0f)) shadows.push(rays[i], slots[i], contribution);
+		}
+	}
+
+	void sampleDirectLight(const Intersection & hit, const vec3 & throughput, bool brdf_sampled, int slot,
+		DirectLightBatch & batch)
+	{
+		LightSample samples[2];
+		const int count = sampleLights(hit, samples);
+		for (int i = 0; i < count; i++) {
+			const LightSample & sample = samples[i];
+			batch.shading.push(hit.shading, sample.wi, hit.wo, hit.shading_normal);
+			batch.rays.push_back(sample.shadow_ray);
+			batch.slots.push_back(slot);
+			batch.factors.push_back(throughput * sample.Le_cos_over_pdf);
+			batch.light_pdfs.push_back(brdf_sampled ? sample.pdf : 0.0f);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shading a hit of a path. The reference path goes through a Material 
+	// tree, the batched one through the material's kernels. 
+	///////////////////////////////////////////////////////////////////////////
+	bool shadeHit(const Intersection & hit, const Ray & ray, bool continue_path, PathState & path, vec3 & radiance,
+		Ray & next_ray, DirectLightBatch & batch, ShadowQueue & shadows)
+	{
+		// Light emitted by the surface. If the ray was sampled from a brdf,
+		// the surface could also have been reached by sampling the lights. 
+		const vec3 Le = Lemitted(hit);
+		if (Le != vec3(0.0f)) {
+			const float weight = path.brdf_pdf > 0.0f ? powerHeuristic(path.brdf_pdf, lightPdf(ray)) : 1.0f;
+			radiance += weight * path.throughput * Le;
+		}
+		vec3 wi, f;
+		float pdf = 0.0f;
+		if (settings.batched_shading) {
+			sampleDirectLight(hit, path.throughput, continue_path, path.slot, batch);
+			if (continue_path) f = hit.shading->sample(*hit.shading, wi, hit.wo, hit.shading_normal, pdf);
+		}
+		else {
+			MaterialTree material(*hit.material);
+			BRDF & mat = material.brdf();
+			sampleDirectLight(hit, mat, path.throughput, continue_path, path.slot, shadows);
+			if (continue_path) f = mat.sample_wi(wi, hit.wo, hit.shading_normal, pdf);
+		}
+		if (!continue_path || pdf <= 0.0f) return false;
+		path.throughput *= f * std::abs(dot(wi, hit.shading_normal)) / pdf;
+		path.brdf_pdf = pdf;
+		if (path.throughput == vec3(0.0f)) return false;
+		next_ray = Ray(offsetOrigin(hit, wi), wi);
+		return true;
+	}
+
+	float environmentWeight(const PathState & path, const vec3 & d, uint32_t sample_index, float & solid_angle)
+	{
+		solid_angle = 0.0f;
+		if (path.brdf_pdf <= 0.0f) return 1.0f;
+		solid_angle = 1.0f / (path.brdf_pdf * float(sample_index + 1));
+		return powerHeuristic(path.brdf_pdf, environmentPdf(d));
+	}
+}
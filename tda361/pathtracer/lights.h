@@ -0,0 +1,127 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "material.h"
+#include "shading.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Point lights in addition to point_light. Call updateLights() (or just
+	// tracePaths()) after changing them.
+	///////////////////////////////////////////////////////////////////////////
+	extern std::vector<PointLight> point_lights;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add the triangles of a mesh whose material is emissive (m_emission *
+	// m_color) as area lights. Called by addModel() for each emissive mesh of
+	// the instance inst_ID, with the mesh's geomID in the model's scene.
+	// The emission is read when the model is added, and again by 
+	// updateMaterials(). Adding a mesh again (when its instance has moved 
+	// or its vertices have changed) updates its lights. clearLights() 
+	// removes all triangle lights.
+	///////////////////////////////////////////////////////////////////////////
+	void addEmissiveMesh(uint32_t inst_ID, uint32_t geom_ID, const labhelper::Model * model,
+		const labhelper::Mesh & mesh, const glm::mat4 & model_matrix);
+	void clearLights();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Rebuild the table that lights are picked from, if any light has
+	// changed. Lights are picked in proportion to their power from an alias
+	// table, so picking one costs the same however many lights there are.
+	///////////////////////////////////////////////////////////////////////////
+	void updateLights();
+
+	///////////////////////////////////////////////////////////////////////////
+	// The radiance emitted from a hit toward the ray's origin, and the pdf
+	// (per solid angle, as seen from the ray's origin) with which
+	// sampleDirectLight() would have picked the hit point.
+	///////////////////////////////////////////////////////////////////////////
+	vec3 Lemitted(const Intersection & hit);
+	float lightPdf(const Ray & ray);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Offset a ray origin along the geometry normal to the side that the 
+	// direction d points to, so that it does not hit the surface it starts on
+	///////////////////////////////////////////////////////////////////////////
+	vec3 offsetOrigin(const Intersection & hit, const vec3 & d);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shadow rays waiting to be traced, each with the radiance it adds to
+	// a sample slot if it is not blocked. trace() tests all of them with one
+	// call to the ray stream API and adds the unblocked contributions.
+	///////////////////////////////////////////////////////////////////////////
+	struct ShadowQueue
+	{
+		RayQueue rays;
+		std::vector<int> slots;
+		std::vector<vec3> contributions;
+		void clear();
+		void push(const Ray & ray, int slot, const vec3 & contribution);
+		void trace(std::vector<vec3> & radiance);
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sample direct illumination at a hit: one light picked by power and one
+	// direction of the environment. Queues a shadow ray for each sample that
+	// contributes. If the path goes on with a direction sampled from the
+	// brdf (brdf_sampled), the samples of area lights and of the environment
+	// are weighted with multiple importance sampling.
+	///////////////////////////////////////////////////////////////////////////
+	void sampleDirectLight(const Intersection & hit, BRDF & mat, const vec3 & throughput, bool brdf_sampled,
+		int slot, ShadowQueue & shadows);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The same, for many hits at once: the light samples of each hit are 
+	// recorded with the brdf evaluations they need, and resolve() evaluates
+	// all brdfs as one ShadingBatch and then queues the shadow rays. 
+	///////////////////////////////////////////////////////////////////////////
+	struct DirectLightBatch
+	{
+		ShadingBatch shading;				// One entry per light sample
+		std::vector<Ray> rays;				// Shadow ray of each light sample
+		std::vector<int> slots;
+		std::vector<vec3> factors;			// Throughput * Le * cos_theta / pdf
+		std::vector<float> light_pdfs;		// To weight against the brdf with, or 0
+		void clear();
+		void resolve(ShadowQueue & shadows);
+	};
+	void sampleDirectLight(const Intersection & hit, const vec3 & throughput, bool brdf_sampled, int slot,
+		DirectLightBatch & batch);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The state of a path that is still being traced
+	///////////////////////////////////////////////////////////////////////////
+	struct PathState
+	{
+		int slot;				// Index of the path's sample within the tile
+		vec3 throughput;		// Product of f * cos / pdf along the path so far
+		float brdf_pdf;			// Pdf of the brdf sample that gave the current ray (0 for camera rays)
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shade the hit of a path's ray, the same way in every trace mode: add
+	// the light emitted by the surface to radiance, sample direct light 
+	// (into batch with settings.batched_shading, otherwise into shadows) 
+	// and, if continue_path, sample the brdf for the next ray. Returns 
+	// whether the path goes on, with path updated for next_ray. The 
+	// environment and the emissive triangles are reached both by light 
+	// samples and by brdf samples, so both are weighted with multiple 
+	// importance sampling. 
+	///////////////////////////////////////////////////////////////////////////
+	bool shadeHit(const Intersection & hit, const Ray & ray, bool continue_path, PathState & path, vec3 & radiance,
+		Ray & next_ray, DirectLightBatch & batch, ShadowQueue & shadows);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The weight of the environment seen by a ray of a path that missed the
+	// scene, and the solid angle to filter it over (see Lenvironment()), 
+	// for sample sample_index of the path's pixel. A ray sampled from a brdf
+	// stands for a solid angle of about 1 / pdf, shared between the pixel's
+	// samples so far. Filtering the environment over that removes aliasing,
+	// and the filter shrinks toward a plain lookup as samples accumulate. 
+	///////////////////////////////////////////////////////////////////////////
+	float environmentWeight(const PathState & path, const vec3 & d, uint32_t sample_index, float & solid_angle);
+}
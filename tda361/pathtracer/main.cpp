@@ -12,6 +12,9 @@
 #include <string>
 #include "Pathtracer.h"
 #include "embree.h"
+#include "sampling.h"
+#include "renderthread.h"
+#include "checkpoint.h"
 
 using namespace glm;
 using namespace std; 
@@ -31,6 +34,8 @@ GLuint shaderProgram;
 // GL texture to put pathtracing result into
 ///////////////////////////////////////////////////////////////////////////////
 uint32_t pathtracer_result_txt_id; 
+// The image published by the render thread that is in the texture
+const pathtracer::DisplayImage * displayed_image = nullptr;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
@@ -39,11 +44,28 @@ vec3 cameraPosition(-30.0f, 10.0f, 30.0f);
 vec3 cameraDirection = normalize(vec3(0.0f, 10.0f, 0.0f) - cameraPosition);
 vec3 worldUp(0.0f, 1.0f, 0.0f);
 
+///////////////////////////////////////////////////////////////////////////////
+// Where the render is saved now and then, so that it can be resumed after 
+// a restart (with the same scene, settings, window size and camera)
+///////////////////////////////////////////////////////////////////////////////
+const string checkpointFilename = "pathtracer.checkpoint";
+const float checkpointInterval = 30.0f; // Seconds
+
 ///////////////////////////////////////////////////////////////////////////////
 // Models
 ///////////////////////////////////////////////////////////////////////////////
 vector<pair<labhelper::Model *, mat4>> models; 
 
+///////////////////////////////////////////////////////////////////////////////
+// Animation of the ship (the first model): it can hover and turn, and 
+// ripple (which moves its vertices, so it is added as deformable)
+///////////////////////////////////////////////////////////////////////////////
+bool animateShip = false;
+bool rippleShip = false;
+float animationTime = 0.0f;
+uint32_t shipInstance = 0;
+vector<vec3> shipRestPositions;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
 ///////////////////////////////////////////////////////////////////////////////
@@ -59,6 +81,17 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.tile_size = 16;
+	pathtracer::settings.trace_mode = pathtracer::TRACE_PACKETS;
+	pathtracer::settings.sampler = pathtracer::SAMPLER_OWEN_SOBOL;
+	pathtracer::settings.adaptive_sampling = false;
+	pathtracer::settings.target_error = 0.0f; // 0 = Never stop
+	pathtracer::settings.batched_shading = true;
+	pathtracer::settings.frame_time_budget = 1.0f / 30.0f;
+	pathtracer::settings.interleaved = false;
+	pathtracer::settings.reprojection = true;
+	pathtracer::settings.denoise = false;
+	pathtracer::settings.seed = 0;
 	#ifdef _DEBUG
 	pathtracer::settings.subsampling = 16; 
 	#else
@@ -88,10 +121,14 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Add models to pathtracer scene
 	///////////////////////////////////////////////////////////////////////////
-	for (auto m : models) {
-		pathtracer::addModel(m.first, m.second);
+	shipInstance = pathtracer::addModel(models[0].first, models[0].second, true);
+	shipRestPositions = models[0].first->m_indexed_positions;
+	for (size_t i = 1; i < models.size(); i++) {
+		pathtracer::addModel(models[i].first, models[i].second);
 	}	
-	pathtracer::buildBVH();
+	// The window comes up while the BVH is built, and the render thread 
+	// starts tracing when it is done
+	pathtracer::startBuildingBVH();
 
 	///////////////////////////////////////////////////////////////////////////
 	// Generate result texture
@@ -111,6 +148,39 @@ void initialize()
 	//glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Move the ship along. The animation only steps when a pass of its last 
+// step has been shown, so that every step is seen, however slow the passes.
+///////////////////////////////////////////////////////////////////////////////
+void animateScene(bool pass_shown)
+{
+	static auto lastFrame = std::chrono::steady_clock::now();
+	const auto now = std::chrono::steady_clock::now();
+	const float dt = std::chrono::duration<float>(now - lastFrame).count();
+	lastFrame = now;
+	if (!animateShip && !rippleShip) return;
+	animationTime += dt;
+	if (!pass_shown) return;
+
+	pathtracer::pauseRendering();
+	if (animateShip) {
+		const mat4 hover = translate(vec3(0.0f, 2.0f * sin(animationTime), 0.0f)) * 
+			rotate(0.3f * animationTime, worldUp);
+		pathtracer::setModelTransform(shipInstance, models[0].second * hover);
+	}
+	if (rippleShip) {
+		labhelper::Model * ship = models[0].first;
+		for (size_t i = 0; i < shipRestPositions.size(); i++) {
+			const vec3 & p = shipRestPositions[i];
+			ship->m_indexed_positions[i] = p + 0.3f * sin(3.0f * animationTime + 0.5f * p.z) * ship->m_indexed_normals[i];
+		}
+		pathtracer::updateModelVertices(ship);
+	}
+	pathtracer::updateBVH();
+	pathtracer::sceneMoved();
+	pathtracer::resumeRendering();
+}
+
 void display(void)
 {
 	{	///////////////////////////////////////////////////////////////////////
@@ -121,7 +191,9 @@ void display(void)
 		SDL_GetWindowSize(g_window, &w, &h);
 		static int old_subsampling; 
 		if (windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling) {
+			pathtracer::pauseRendering();
 			pathtracer::resize(w, h);
+			pathtracer::resumeRendering();
 			windowWidth = w; 
 			windowWidth = h;
 			old_subsampling = pathtracer::settings.subsampling; 
@@ -129,17 +201,22 @@ void display(void)
 	}
 
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
+	// Tell the render thread where the camera is
 	///////////////////////////////////////////////////////////////////////////
 	vec3 cameraRight = normalize(cross(cameraDirection, worldUp));
 	vec3 cameraUp = normalize(cross(cameraRight, cameraDirection));
-	pathtracer::tracePaths(cameraPosition, cameraDirection, cameraUp);
+	pathtracer::setRenderCamera(cameraPosition, cameraDirection, cameraUp);
 
 	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Copy the latest pathtraced image to texture for display
 	///////////////////////////////////////////////////////////////////////////
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width, pathtracer::rendered_image.height,
-		0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	bool image_changed;
+	displayed_image = &pathtracer::displayImage(image_changed);
+	animateScene(image_changed && displayed_image->number_of_samples > 0);
+	if (image_changed) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, displayed_image->width, displayed_image->height,
+			0, GL_RGB, GL_FLOAT, &displayed_image->data[0].x);
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -181,7 +258,6 @@ bool handleEvents(void)
 					mat4 yaw = rotate(rotationSpeed * -delta_x, worldUp);
 					mat4 pitch = rotate(rotationSpeed * -delta_y, normalize(cross(cameraDirection, worldUp)));
 					cameraDirection = vec3(pitch * yaw * vec4(cameraDirection, 0.0f));
-					pathtracer::restart(); 
 				}
 				prev_xcoord = event.motion.x;
 				prev_ycoord = event.motion.y;
@@ -189,6 +265,8 @@ bool handleEvents(void)
 		}
 	}
 
+	// Camera moves are passed on to the pathtracer by display(), which 
+	// restarts or reprojects
 	if (!io.WantCaptureKeyboard)
 	{
 		// check keyboard state (which keys are still pressed)
@@ -197,27 +275,21 @@ bool handleEvents(void)
 		const float speed = 0.5f; 
 		if (state[SDL_SCANCODE_W]) {
 			cameraPosition += speed * cameraDirection;
-			pathtracer::restart();
 		}
 		if (state[SDL_SCANCODE_S]) {
 			cameraPosition -= speed * cameraDirection;
-			pathtracer::restart();
 		}
 		if (state[SDL_SCANCODE_A]) {
 			cameraPosition -= speed * cameraRight;
-			pathtracer::restart();
 		}
 		if (state[SDL_SCANCODE_D]) {
 			cameraPosition += speed * cameraRight;
-			pathtracer::restart();
 		}
 		if (state[SDL_SCANCODE_Q]) {
 			cameraPosition -= speed * worldUp;
-			pathtracer::restart();
 		}
 		if (state[SDL_SCANCODE_E]) {
 			cameraPosition += speed * worldUp;
-			pathtracer::restart();
 		}
 	}
 
@@ -286,7 +358,11 @@ void gui() {
 		labhelper::Material & selected_material = model->m_materials[material_index];
 		if (ImGui::Combo("Material", &material_index, material_getter,
 			(void *)&model->m_materials, model->m_materials.size())) {
+			pathtracer::pauseRendering();
 			mesh.m_material_idx = material_index;
+			pathtracer::updateMaterials();
+			pathtracer::restart();
+			pathtracer::resumeRendering();
 		}
 	}
 
@@ -297,27 +373,56 @@ void gui() {
 	{
 		ImGui::ListBox("Materials", &material_index, material_getter,
 			(void*)&model->m_materials, model->m_materials.size(), 8);
-		labhelper::Material & material = model->m_materials[material_index];
+		// The material is edited as a copy, as the render thread may be 
+		// reading it
+		labhelper::Material material = model->m_materials[material_index];
 		char name[256];
 		strcpy(name, material.m_name.c_str());
-		if (ImGui::InputText("Material Name", name, 256)) { material.m_name = name; }
-		ImGui::ColorEdit3("Color", &material.m_color.x);
-		ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
-		ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-		ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-		ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
-		ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
-		ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+		bool changed = false;
+		if (ImGui::InputText("Material Name", name, 256)) { 
+			material.m_name = name; 
+			model->m_materials[material_index].m_name = name;
+		}
+		changed |= ImGui::ColorEdit3("Color", &material.m_color.x);
+		changed |= ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
+		changed |= ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
+		changed |= ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
+		changed |= ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
+		changed |= ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
+		changed |= ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+		// The shading materials are made from the materials' parameters
+		if (changed) {
+			pathtracer::pauseRendering();
+			model->m_materials[material_index] = material;
+			pathtracer::updateMaterials();
+			pathtracer::restart();
+			pathtracer::resumeRendering();
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Light and environment map
 	///////////////////////////////////////////////////////////////////////////
+	if (ImGui::CollapsingHeader("Animation", "animation_ch", true, true))
+	{
+		ImGui::Checkbox("Hover Ship", &animateShip);
+		ImGui::Checkbox("Ripple Ship", &rippleShip);
+	}
+
 	if (ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
-		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
-		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
-		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier, 0.0f, 10000.0f);
+		float environment_multiplier = pathtracer::environment.multiplier;
+		pathtracer::PointLight light = pathtracer::point_light;
+		bool changed = false;
+		changed |= ImGui::SliderFloat("Environment multiplier", &environment_multiplier, 0.0f, 10.0f);
+		changed |= ImGui::ColorEdit3("Point light color", &light.color.x);
+		changed |= ImGui::SliderFloat("Point light intensity multiplier", &light.intensity_multiplier, 0.0f, 10000.0f);
+		if (changed) {
+			pathtracer::pauseRendering();
+			pathtracer::environment.multiplier = environment_multiplier;
+			pathtracer::point_light = light;
+			pathtracer::resumeRendering();
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -325,9 +430,35 @@ void gui() {
 	///////////////////////////////////////////////////////////////////////////
 	if (ImGui::CollapsingHeader("Pathtracer", "pathtracer_ch", true, true))
 	{
-		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
-		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
-		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		if (!pathtracer::bvhReady()) ImGui::Text("Building BVH...");
+		pathtracer::Settings settings = pathtracer::settings;
+		bool changed = false;
+		float budget_ms = 1000.0f * settings.frame_time_budget;
+		if (ImGui::SliderFloat("Frame Time Budget (ms)", &budget_ms, 0.0f, 100.0f)) {
+			settings.frame_time_budget = budget_ms / 1000.0f;
+			changed = true;
+		}
+		if (settings.frame_time_budget > 0.0f) ImGui::Text("Subsampling: %d", displayed_image->subsampling);
+		else changed |= ImGui::SliderInt("Subsampling", &settings.subsampling, 1, 16);
+		changed |= ImGui::SliderInt("Max Bounces", &settings.max_bounces, 0, 16);
+		changed |= ImGui::SliderInt("Max Paths Per Pixel", &settings.max_paths_per_pixel, 0, 1024);
+		changed |= ImGui::SliderInt("Tile Size", &settings.tile_size, 1, 64);
+		changed |= ImGui::Combo("Trace Mode", &settings.trace_mode, "Single rays\0Packets\0Wavefront\0");
+		changed |= ImGui::Combo("Sampler", &settings.sampler, "Independent (PCG)\0Halton\0Sobol\0Owen-scrambled Sobol\0");
+		changed |= ImGui::Checkbox("Interleaved Refinement", &settings.interleaved);
+		changed |= ImGui::Checkbox("Reproject On Camera Moves", &settings.reprojection);
+		changed |= ImGui::Checkbox("Denoise", &settings.denoise);
+		changed |= ImGui::Checkbox("Adaptive Sampling", &settings.adaptive_sampling);
+		changed |= ImGui::Checkbox("Batched Shading", &settings.batched_shading);
+		changed |= ImGui::SliderFloat("Target Relative Error", &settings.target_error, 0.0f, 0.1f);
+		if (changed) {
+			pathtracer::pauseRendering();
+			pathtracer::settings = settings;
+			pathtracer::resumeRendering();
+		}
+		ImGui::Text("Passes: %d", displayed_image->number_of_samples);
+		ImGui::Text("Converged pixels: %d / %d", displayed_image->converged_pixels,
+			displayed_image->width * displayed_image->height);
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -348,6 +479,17 @@ int main(int argc, char *argv[])
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
+	pathtracer::Checkpoint checkpoint;
+	if (pathtracer::readCheckpoint(checkpointFilename, checkpoint)) {
+		// Go back to where the camera was, so that the render thread can 
+		// go on from the checkpoint
+		cameraPosition = checkpoint.camera_position;
+		cameraDirection = checkpoint.camera_direction;
+		pathtracer::settings.seed = checkpoint.seed;
+		pathtracer::resumeRenderingFrom(checkpoint);
+	}
+	pathtracer::startCheckpointWriter(checkpointFilename, checkpointInterval);
+	pathtracer::startRenderThread();
 
 	bool stopRendering = false;
 	auto startTime = std::chrono::system_clock::now();
@@ -366,6 +508,10 @@ int main(int argc, char *argv[])
 		stopRendering = handleEvents();
 	}
 
+	pathtracer::stopRenderThread();
+	pathtracer::stopCheckpointWriter();
+	pathtracer::waitForBVH();
+
 	// Delete Models
 	for (auto & m : models) {
 		labhelper::freeModel(m.first);
@@ -22,28 +22,75 @@ namespace pathtracer
 		return f(wi, wo, n);
 	}
 
+	float Diffuse::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return max(0.0f, dot(n, wi)) / M_PI;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// A Blinn Phong Dielectric Microfacet BRFD
 	///////////////////////////////////////////////////////////////////////////
+	static float schlickFresnel(float R0, const vec3 & wh, const vec3 & wi)
+	{
+		return R0 + (1.0f - R0) * pow(1.0f - abs(dot(wh, wi)), 5.0f);
+	}
+
 	vec3 BlinnPhong::refraction_brdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
-		return vec3(0.0f);
+		if (refraction_layer == NULL) return vec3(0.0f);
+		const vec3 wh = normalize(wi + wo);
+		return (1.0f - schlickFresnel(R0, wh, wi)) * refraction_layer->f(wi, wo, n);
 	}
 	vec3 BlinnPhong::reflection_brdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
-		return vec3(0.0f);
+		if (dot(n, wi) <= 0.0f || dot(n, wo) <= 0.0f) return vec3(0.0f);
+		const vec3 wh = normalize(wi + wo);
+		const float F = schlickFresnel(R0, wh, wi);
+		const float D = (shininess + 2.0f) / (2.0f * M_PI) * pow(max(0.0f, dot(n, wh)), shininess);
+		const float G = min(1.0f, min(2.0f * dot(n, wh) * dot(n, wo) / dot(wo, wh),
+			2.0f * dot(n, wh) * dot(n, wi) / dot(wo, wh)));
+		return vec3(F * D * G / (4.0f * dot(n, wo) * dot(n, wi)));
 	}
 
 	vec3 BlinnPhong::f(const vec3 & wi, const vec3 & wo, const vec3 & n) {
 		return reflection_brdf(wi, wo, n) + refraction_brdf(wi, wo, n); 
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Half of the samples are taken from the microfacet distribution (the 
+	// half vector with pdf D(wh) * cos(theta_h)), the other half from the 
+	// refraction layer. The returned pdf and brdf are those of both layers.
+	///////////////////////////////////////////////////////////////////////////
 	vec3 BlinnPhong::sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) {
-		vec3 tangent = normalize(perpendicular(n));
-		vec3 bitangent = normalize(cross(tangent, n));
-		vec3 sample = cosineSampleHemisphere();
-		wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-		if (dot(wi, n) <= 0.0f) p = 0.0f;
-		else p = max(0.0f, dot(n, wi)) / M_PI;
-		return f(wi, wo, n); 
+		if (randf() < 0.5f) {
+			vec3 tangent = normalize(perpendicular(n));
+			vec3 bitangent = normalize(cross(tangent, n));
+			const float phi = 2.0f * M_PI * randf();
+			const float cos_theta = pow(randf(), 1.0f / (shininess + 1.0f));
+			const float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
+			const vec3 wh = normalize(sin_theta * cos(phi) * tangent + sin_theta * sin(phi) * bitangent + 
+				cos_theta * n);
+			wi = reflect(-wo, wh);
+		}
+		else {
+			if (refraction_layer == NULL) {
+				p = 0.0f;
+				return vec3(0.0f);
+			}
+			float p_refraction;
+			refraction_layer->sample_wi(wi, wo, n, p_refraction);
+		}
+		p = pdf(wi, wo, n);
+		return f(wi, wo, n);
+	}
+
+	float BlinnPhong::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		float p = 0.0f;
+		const vec3 wh = normalize(wi + wo);
+		const float wo_dot_wh = dot(wo, wh);
+		if (dot(n, wi) > 0.0f && wo_dot_wh > 0.0f) {
+			const float p_wh = (shininess + 1.0f) * pow(max(0.0f, dot(n, wh)), shininess) / (2.0f * M_PI);
+			p += 0.5f * p_wh / (4.0f * wo_dot_wh);
+		}
+		if (refraction_layer != NULL) p += 0.5f * refraction_layer->pdf(wi, wo, n);
+		return p;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -57,15 +104,42 @@ namespace pathtracer
 	};
 
 	///////////////////////////////////////////////////////////////////////////
-	// A Linear Blend between two BRDFs
+	// A Linear Blend between two BRDFs. A sample is taken from bsdf0 with
+	// probability w, and the pdf is that of the blend. 
 	///////////////////////////////////////////////////////////////////////////
 	vec3 LinearBlend::f(const vec3 & wi, const vec3 & wo, const vec3 & n) {
-		return vec3(0.0); 
+		return w * bsdf0->f(wi, wo, n) + (1.0f - w) * bsdf1->f(wi, wo, n); 
 	}
 
 	vec3 LinearBlend::sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) {
-		p = 0.0f; 
-		return vec3(0.0f);
+		float p_layer;
+		if (randf() < w) bsdf0->sample_wi(wi, wo, n, p_layer);
+		else bsdf1->sample_wi(wi, wo, n, p_layer);
+		if (p_layer <= 0.0f) {
+			p = 0.0f;
+			return vec3(0.0f);
+		}
+		p = pdf(wi, wo, n);
+		return f(wi, wo, n);
+	}
+
+	float LinearBlend::pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) {
+		return w * bsdf0->pdf(wi, wo, n) + (1.0f - w) * bsdf1->pdf(wi, wo, n);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The material tree of a labhelper::Material: a reflectivity weighted 
+	// blend of a microfacet layer and the diffuse base, where the microfacet
+	// layer is a metalness weighted blend of a metal and a dielectric (with
+	// the diffuse base under it). 
+	///////////////////////////////////////////////////////////////////////////
+	MaterialTree::MaterialTree(const labhelper::Material & m)
+		: diffuse(m.m_color)
+		, dielectric(m.m_shininess, m.m_fresnel, &diffuse)
+		, metal(m.m_color, m.m_shininess, m.m_fresnel)
+		, metal_blend(m.m_metalness, &metal, &dielectric)
+		, reflectivity_blend(m.m_reflectivity, &metal_blend, &diffuse)
+	{
 	}
 
 	///////////////////////////////////////////////////////////////////////////
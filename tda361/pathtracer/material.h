@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <Model.h>
 #include "Pathtracer.h"
 #include "sampling.h"
 
@@ -18,6 +19,8 @@ namespace pathtracer
 		// Sample a suitable direction and return the brdf in that direction as
 		// well as the pdf (~probability) that the direction was chosen. 
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) = 0;
+		// Return the pdf with which sample_wi() would have chosen wi
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) = 0;
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -30,6 +33,7 @@ namespace pathtracer
 		Diffuse(vec3 c) : color(c) {}
 		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override;
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -47,6 +51,7 @@ namespace pathtracer
 		virtual vec3 reflection_brdf(const vec3 & wi, const vec3 & wo, const vec3 & n);
 		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override;
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -73,6 +78,23 @@ namespace pathtracer
 		LinearBlend(float _w, BRDF * a, BRDF * b) : w(_w), bsdf0(a), bsdf1(b) {};
 		virtual vec3 f(const vec3 & wi, const vec3 & wo, const vec3 & n) override; 
 		virtual vec3 sample_wi(vec3 & wi, const vec3 & wo, const vec3 & n, float & p) override; 
+		virtual float pdf(const vec3 & wi, const vec3 & wo, const vec3 & n) override;
 	};
 
-}
\ No newline at end of file
+	///////////////////////////////////////////////////////////////////////////
+	// The tree of BRDFs for a labhelper::Material, built on the stack for a
+	// hit. brdf() is its root. 
+	///////////////////////////////////////////////////////////////////////////
+	struct MaterialTree
+	{
+		Diffuse diffuse;
+		BlinnPhong dielectric;
+		BlinnPhongMetal metal;
+		LinearBlend metal_blend;
+		LinearBlend reflectivity_blend;
+		MaterialTree(const labhelper::Material & m);
+		MaterialTree(const MaterialTree &) = delete;
+		MaterialTree & operator=(const MaterialTree &) = delete;
+		BRDF & brdf() { return reflectivity_blend; }
+	};
+}
@@ -0,0 +1,180 @@
+#include "mipmap.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+///////////////////////////////////////////////////////////////////////////
+// RGB9E5, as specified in EXT_texture_shared_exponent
+///////////////////////////////////////////////////////////////////////////
+uint32_t packRGB9E5(const vec3 & color)
+{
+	const int mantissa_bits = 9, exponent_bias = 15;
+	const float max_value = 65408.0f;	// (511 / 512) * 2^16
+	// std::max(0, x) also turns NaN into 0
+	const float r = std::min(std::max(0.0f, color.r), max_value);
+	const float g = std::min(std::max(0.0f, color.g), max_value);
+	const float b = std::min(std::max(0.0f, color.b), max_value);
+	const float max_component = std::max(r, std::max(g, b));
+	int exponent;
+	frexp(max_component, &exponent);	// max_component = f * 2^exponent, f in [0.5, 1)
+	int shared_exponent = std::max(-exponent_bias - 1, exponent - 1) + 1 + exponent_bias;
+	float scale = ldexp(1.0f, shared_exponent - exponent_bias - mantissa_bits);
+	if (uint32_t(max_component / scale + 0.5f) == (1u << mantissa_bits)) {
+		shared_exponent += 1;
+		scale *= 2.0f;
+	}
+	const uint32_t rm = uint32_t(r / scale + 0.5f);
+	const uint32_t gm = uint32_t(g / scale + 0.5f);
+	const uint32_t bm = uint32_t(b / scale + 0.5f);
+	return rm | (gm << 9) | (bm << 18) | (uint32_t(shared_exponent) << 27);
+}
+
+vec3 unpackRGB9E5(uint32_t packed)
+{
+	const float scale = ldexp(1.0f, int(packed >> 27) - 15 - 9);
+	return scale * vec3(float(packed & 0x1FF), float((packed >> 9) & 0x1FF), float((packed >> 18) & 0x1FF));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Where texel (x, y) is stored in a level: 8x8 tiles, row by row, with the
+// 64 texels of a tile in Morton order
+///////////////////////////////////////////////////////////////////////////
+static inline uint32_t spreadBits3(uint32_t v)
+{
+	v = (v | (v << 2)) & 0x33;
+	v = (v | (v << 1)) & 0x55;
+	return v;
+}
+
+static inline size_t texelIndex(const MipMap::Level & level, int x, int y)
+{
+	const size_t tile = size_t(y >> 3) * level.tiles_x + size_t(x >> 3);
+	return (tile << 6) | spreadBits3(x & 7) | (spreadBits3(y & 7) << 1);
+}
+
+static inline int wrap(int i, int size, MipMap::WrapMode mode)
+{
+	if (mode == MipMap::WRAP_REPEAT) return ((i % size) + size) % size;
+	return std::min(std::max(i, 0), size - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fold a texel coordinate that is (at most one texel) outside an octahedral
+// map back in. The texel just outside an edge is the mirror image (along 
+// that edge) of the texel just inside it. 
+///////////////////////////////////////////////////////////////////////////
+static inline void wrapOctahedral(int & x, int & y, int size)
+{
+	if (x < 0) { x = -1 - x; y = size - 1 - y; }
+	else if (x >= size) { x = 2 * size - 1 - x; y = size - 1 - y; }
+	if (y < 0) { y = -1 - y; x = size - 1 - x; }
+	else if (y >= size) { y = 2 * size - 1 - y; x = size - 1 - x; }
+	x = std::min(std::max(x, 0), size - 1);
+	y = std::min(std::max(y, 0), size - 1);
+}
+
+static inline vec3 fetch(const MipMap::Level & l, int x, int y, MipMap::WrapMode wrap_u, MipMap::WrapMode wrap_v)
+{
+	if (wrap_u == MipMap::WRAP_OCTAHEDRAL) wrapOctahedral(x, y, l.width);
+	else {
+		x = wrap(x, l.width, wrap_u);
+		y = wrap(y, l.height, wrap_v);
+	}
+	return unpackRGB9E5(l.texels[texelIndex(l, x, y)]);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Build the pyramid. Each level is a 2x2 box filtered version of the one 
+// above it, computed from unpacked floats so that rounding errors do not 
+// accumulate. 
+///////////////////////////////////////////////////////////////////////////
+void MipMap::allocate(int width, int height, WrapMode _wrap_u, WrapMode _wrap_v)
+{
+	wrap_u = _wrap_u;
+	wrap_v = _wrap_v;
+	levels.clear();
+	for (;;) {
+		Level level;
+		level.width = width;
+		level.height = height;
+		level.tiles_x = (width + 7) / 8;
+		level.texels.resize(size_t(level.tiles_x) * ((height + 7) / 8) * 64);
+		levels.push_back(std::move(level));
+		if (width == 1 && height == 1) break;
+		width = std::max(1, width / 2);
+		height = std::max(1, height / 2);
+	}
+}
+
+void MipMap::build(const float * rgb, int width, int height, WrapMode _wrap_u, WrapMode _wrap_v)
+{
+	allocate(width, height, _wrap_u, _wrap_v);
+	vector<vec3> current(size_t(width) * height), next;
+	for (size_t i = 0; i < current.size(); i++) {
+		current[i] = vec3(rgb[i * 3 + 0], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+	}
+	for (size_t l = 0; l < levels.size(); l++) {
+		Level & level = levels[l];
+#pragma omp parallel for
+		for (int y = 0; y < level.height; y++) {
+			for (int x = 0; x < level.width; x++) {
+				level.texels[texelIndex(level, x, y)] = packRGB9E5(current[size_t(y) * level.width + x]);
+			}
+		}
+		if (l + 1 == levels.size()) break;
+
+		const int width = level.width, height = level.height;
+		const int next_width = levels[l + 1].width, next_height = levels[l + 1].height;
+		next.resize(size_t(next_width) * next_height);
+#pragma omp parallel for
+		for (int y = 0; y < next_height; y++) {
+			const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+			for (int x = 0; x < next_width; x++) {
+				const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+				next[size_t(y) * next_width + x] = 0.25f * (
+					current[size_t(y0) * width + x0] + current[size_t(y0) * width + x1] +
+					current[size_t(y1) * width + x0] + current[size_t(y1) * width + x1]);
+			}
+		}
+		swap(current, next);
+	}
+}
+
+vec3 MipMap::texel(int level, int x, int y) const
+{
+	const Level & l = levels[level];
+	return unpackRGB9E5(l.texels[texelIndex(l, x, y)]);
+}
+
+vec3 MipMap::bilinear(int level, float u, float v) const
+{
+	const Level & l = levels[level];
+	const float x = u * float(l.width) - 0.5f, y = v * float(l.height) - 0.5f;
+	const float fx = floor(x), fy = floor(y);
+	const float tx = x - fx, ty = y - fy;
+	const int x0 = int(fx), y0 = int(fy);
+	const vec3 c00 = fetch(l, x0, y0, wrap_u, wrap_v);
+	const vec3 c10 = fetch(l, x0 + 1, y0, wrap_u, wrap_v);
+	const vec3 c01 = fetch(l, x0, y0 + 1, wrap_u, wrap_v);
+	const vec3 c11 = fetch(l, x0 + 1, y0 + 1, wrap_u, wrap_v);
+	return mix(mix(c00, c10, tx), mix(c01, c11, tx), ty);
+}
+
+vec3 MipMap::trilinear(float u, float v, float lod) const
+{
+	const int last_level = int(levels.size()) - 1;
+	if (lod <= 0.0f) return bilinear(0, u, v);
+	if (lod >= float(last_level)) return bilinear(last_level, u, v);
+	const int level = int(lod);
+	const float t = lod - float(level);
+	return mix(bilinear(level, u, v), bilinear(level + 1, u, v), t);
+}
+
+size_t MipMap::bytes() const
+{
+	size_t total = 0;
+	for (auto & level : levels) total += level.texels.size() * sizeof(uint32_t);
+	return total;
+}
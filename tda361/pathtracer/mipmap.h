@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+///////////////////////////////////////////////////////////////////////////
+// A mip-mapped RGB image for filtered lookups. Texels are packed as RGB9E5
+// (three 9 bit mantissas sharing a 5 bit exponent, 4 bytes instead of 12)
+// and every level is stored as 8x8 texel tiles, in Morton order within a 
+// tile, so that the four texels of a bilinear lookup are nearly always in
+// the same 64 byte cache line or the one next to it. 
+///////////////////////////////////////////////////////////////////////////
+struct MipMap {
+	// WRAP_OCTAHEDRAL is for square octahedral maps (used for both u and 
+	// v): stepping off an edge comes back in mirrored along the same edge.
+	enum WrapMode { WRAP_CLAMP, WRAP_REPEAT, WRAP_OCTAHEDRAL };
+	struct Level {
+		int width, height, tiles_x;
+		std::vector<uint32_t> texels;
+	};
+	std::vector<Level> levels;
+	WrapMode wrap_u = WRAP_REPEAT, wrap_v = WRAP_CLAMP;
+
+	// Build all levels from a row-major, interleaved RGB float image
+	void build(const float * rgb, int width, int height, WrapMode wrap_u, WrapMode wrap_v);
+	// Allocate (uninitialized) levels for a width x height image, e.g. to 
+	// read the texels of a pyramid that was built before
+	void allocate(int width, int height, WrapMode wrap_u, WrapMode wrap_v);
+	// The (unfiltered) texel at (x, y) of a level
+	glm::vec3 texel(int level, int x, int y) const;
+	// Bilinear lookup in one level, with u, v in [0,1)
+	glm::vec3 bilinear(int level, float u, float v) const;
+	// Trilinear lookup between the two levels around lod. lod <= 0 is a 
+	// bilinear lookup in the full resolution level, lod 1 is a bilinear 
+	// lookup in the level with half the resolution, and so on. 
+	glm::vec3 trilinear(float u, float v, float lod) const;
+	// Memory used by the texels of all levels
+	size_t bytes() const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Convert between linear RGB and the shared exponent RGB9E5 format
+///////////////////////////////////////////////////////////////////////////
+uint32_t packRGB9E5(const glm::vec3 & color);
+glm::vec3 unpackRGB9E5(uint32_t packed);
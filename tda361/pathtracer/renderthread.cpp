@@ -0,0 +1,306 @@
+#include "renderthread.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "Pathtracer.h"
+#include "denoiser.h"
+#include "embree.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The triple buffer. The render thread fills the back buffer and swaps
+	// it with the middle one, the window thread swaps the middle buffer with
+	// its front buffer when the middle one holds a newer image. The middle
+	// buffer's index and whether it is new share one atomic word, so both
+	// swaps are a single exchange and neither thread ever waits.
+	///////////////////////////////////////////////////////////////////////////
+	DisplayImage display_buffers[3];
+	const uint32_t buffer_is_new = 4;
+	atomic<uint32_t> middle_buffer(1);
+	uint32_t back_buffer = 2;			// Only used by the render thread
+	uint32_t front_buffer = 0;			// Only used by the window thread
+
+	///////////////////////////////////////////////////////////////////////////
+	// The image as last published, which finished tiles are copied into. It
+	// still shows the previous pass (or camera) where the tiles of this pass
+	// are not finished yet. Only used by the render thread.
+	///////////////////////////////////////////////////////////////////////////
+	vector<vec3> published_image;
+	// Whether it is denoised. A denoised image is only published when a
+	// pass is finished, as the filter needs the whole image. 
+	bool published_denoised = false;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The samples traced per second, measured over the tiles finished in 
+	// each pass. Only used by the render thread. 
+	///////////////////////////////////////////////////////////////////////////
+	double samples_per_second = 0.0;
+	uint64_t samples_finished = 0;		// In the tiles finished this pass
+	const int max_auto_subsampling = 16;
+	// The camera counts as moving until it has stood still this long
+	const float camera_settle_time = 0.2f;
+
+	///////////////////////////////////////////////////////////////////////////
+	// State shared by the render thread and the others, guarded by
+	// render_mutex
+	///////////////////////////////////////////////////////////////////////////
+	thread render_thread;
+	mutex render_mutex;
+	condition_variable render_condition;
+	bool render_thread_running = false;
+	bool tracing = false;				// Whether the render thread is in tracePaths()
+	int pauses = 0;
+	struct RenderCamera
+	{
+		vec3 position, direction, up;
+	} render_camera;
+	chrono::steady_clock::time_point last_camera_move;
+
+	///////////////////////////////////////////////////////////////////////////
+	// The checkpoint to go on from, and the camera of the last pass that 
+	// can be checkpointed. Only used by the render thread once it runs. 
+	///////////////////////////////////////////////////////////////////////////
+	Checkpoint resume_checkpoint;
+	bool resume_pending = false;
+	RenderCamera checkpoint_camera;
+	bool checkpoint_pending = false;	// Samples have been traced since the last checkpoint
+
+	void resumeRenderingFrom(Checkpoint & checkpoint)
+	{
+		swap(resume_checkpoint, checkpoint);
+		resume_pending = true;
+	}
+
+	static bool sameCamera(const RenderCamera & a, const RenderCamera & b)
+	{
+		return a.position == b.position && a.direction == b.direction && a.up == b.up;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Resume from the pending checkpoint once the window has set its camera
+	///////////////////////////////////////////////////////////////////////////
+	static void tryResume(const RenderCamera & camera)
+	{
+		const RenderCamera checkpoint_view = { resume_checkpoint.camera_position, resume_checkpoint.camera_direction,
+			resume_checkpoint.camera_up };
+		// Until the window has set the camera, it is all zeros
+		if (camera.direction == vec3(0.0f) || rendered_image.width == 0) return;
+		resume_pending = false;
+		if (!sameCamera(camera, checkpoint_view)) return;
+		const int subsampling = rendered_image.subsampling;
+		setSubsampling(resume_checkpoint.image.subsampling);
+		if (!resumeCheckpoint(resume_checkpoint, camera.position, camera.direction, camera.up)) {
+			setSubsampling(subsampling);
+			return;
+		}
+		resume_checkpoint = Checkpoint();
+		// Refine the resumed image as if the camera had been standing still
+		lock_guard<mutex> lock(render_mutex);
+		last_camera_move = chrono::steady_clock::time_point();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Copy finished tiles into the published image and hand it over
+	///////////////////////////////////////////////////////////////////////////
+	static void publishImage();
+
+	static void publishTiles(const vector<Tile> & finished_tiles)
+	{
+		const int width = rendered_image.width;
+		for (const Tile & tile : finished_tiles) {
+			for (int y = tile.y0; y < tile.y1; y++) {
+				if (!published_denoised) {
+					std::copy(&rendered_image.data[y * width + tile.x0], &rendered_image.data[y * width + tile.x1],
+						&published_image[y * width + tile.x0]);
+				}
+				for (int x = tile.x0; x < tile.x1; x++) samples_finished += rendered_image.pass_samples[y * width + x];
+			}
+		}
+		if (!published_denoised) publishImage();
+	}
+
+	static void publishImage()
+	{
+		DisplayImage & image = display_buffers[back_buffer];
+		image.width = rendered_image.width;
+		image.height = rendered_image.height;
+		image.subsampling = rendered_image.subsampling;
+		image.number_of_samples = rendered_image.number_of_samples;
+		image.converged_pixels = rendered_image.converged_pixels;
+		image.data = published_image;
+		back_buffer = middle_buffer.exchange(back_buffer | buffer_is_new, memory_order_acq_rel) & ~buffer_is_new;
+	}
+
+	const DisplayImage & displayImage(bool & changed)
+	{
+		changed = (middle_buffer.load(memory_order_acquire) & buffer_is_new) != 0;
+		if (changed) front_buffer = middle_buffer.exchange(front_buffer, memory_order_acq_rel) & ~buffer_is_new;
+		return display_buffers[front_buffer];
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pick the subsampling for the next pass
+	///////////////////////////////////////////////////////////////////////////
+	static void chooseSubsampling(bool camera_moving)
+	{
+		int subsampling = rendered_image.subsampling;
+		if (settings.frame_time_budget <= 0.0f) {
+			subsampling = settings.subsampling;
+		}
+		else if (camera_moving) {
+			// Going to a coarser power of two keeps the samples (see 
+			// setSubsampling()), so reprojection goes on from them
+			if (samples_per_second <= 0.0) return;
+			const double window_pixels = double(rendered_image.width * rendered_image.subsampling) *
+				double(rendered_image.height * rendered_image.subsampling);
+			subsampling = 1;
+			while (subsampling < max_auto_subsampling &&
+				window_pixels / (double(subsampling * subsampling) * samples_per_second) > settings.frame_time_budget) {
+				subsampling *= 2;
+			}
+		}
+		else if (subsampling > 1 && rendered_image.number_of_samples > 0) {
+			// Refine to the next power of two below
+			int finer = 1;
+			while (finer * 2 < subsampling) finer *= 2;
+			subsampling = finer;
+		}
+		setSubsampling(subsampling);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace passes until stopped. When every pixel is done, wake up now and
+	// then to see if rendering has been restarted.
+	///////////////////////////////////////////////////////////////////////////
+	static void renderLoop()
+	{
+		unique_lock<mutex> lock(render_mutex);
+		while (render_thread_running) {
+			if (pauses > 0) {
+				render_condition.wait(lock);
+				continue;
+			}
+			// Wait here rather than in tracePaths(), so that pauses do not
+			// wait for the build
+			if (!bvhReady()) {
+				render_condition.wait_for(lock, chrono::milliseconds(10));
+				continue;
+			}
+			const RenderCamera camera = render_camera;
+			tracing = true;
+			lock.unlock();
+			if (resume_pending) tryResume(camera);
+			lock.lock();
+			const bool camera_moving = 
+				chrono::duration<float>(chrono::steady_clock::now() - last_camera_move).count() < camera_settle_time;
+			lock.unlock();
+			// Between passes the image is ours, so this is where its size
+			// changes. The published image then starts out as a copy of it. 
+			chooseSubsampling(camera_moving);
+			if (published_image.size() != rendered_image.data.size() || published_denoised != settings.denoise) {
+				published_denoised = settings.denoise;
+				if (published_denoised) denoise(rendered_image, published_image);
+				else published_image = rendered_image.data;
+				publishImage();
+			}
+			samples_finished = 0;
+			const auto pass_start = chrono::steady_clock::now();
+			const bool traced = tracePaths(camera.position, camera.direction, camera.up, publishTiles);
+			const double pass_time = chrono::duration<double>(chrono::steady_clock::now() - pass_start).count();
+			if (samples_finished > 0 && pass_time > 0.001) {
+				const double rate = double(samples_finished) / pass_time;
+				samples_per_second = samples_per_second > 0.0 ? 0.7 * samples_per_second + 0.3 * rate : rate;
+			}
+			// The denoiser runs here, outside the pass, so that it has all
+			// cores too
+			if (traced && published_denoised) {
+				denoise(rendered_image, published_image);
+				publishImage();
+			}
+			if (traced) {
+				checkpoint_camera = camera;
+				checkpoint_pending = !camera_moving &&
+					!offerCheckpoint(camera.position, camera.direction, camera.up);
+			}
+			lock.lock();
+			tracing = false;
+			render_condition.notify_all();
+			if (!traced && !passCancelled()) render_condition.wait_for(lock, chrono::milliseconds(10));
+		}
+		// Keep the samples traced since the last checkpoint, unless the 
+		// camera has moved on from them
+		const bool camera_still = sameCamera(render_camera, checkpoint_camera);
+		lock.unlock();
+		if (checkpoint_pending && camera_still) {
+			offerCheckpoint(checkpoint_camera.position, checkpoint_camera.direction, checkpoint_camera.up, true);
+		}
+		checkpoint_pending = false;
+	}
+
+	void startRenderThread()
+	{
+		lock_guard<mutex> lock(render_mutex);
+		if (render_thread_running) return;
+		render_thread_running = true;
+		render_thread = thread(renderLoop);
+	}
+
+	void stopRenderThread()
+	{
+		{
+			lock_guard<mutex> lock(render_mutex);
+			if (!render_thread_running) return;
+			render_thread_running = false;
+			cancelPasses();
+			render_condition.notify_all();
+		}
+		render_thread.join();
+		if (pauses == 0) resumePasses();
+	}
+
+	void setRenderCamera(const vec3 & position, const vec3 & direction, const vec3 & up)
+	{
+		lock_guard<mutex> lock(render_mutex);
+		if (position == render_camera.position && direction == render_camera.direction && up == render_camera.up) return;
+		render_camera.position = position;
+		render_camera.direction = direction;
+		render_camera.up = up;
+		last_camera_move = chrono::steady_clock::now();
+		// With reprojection, tracePaths() carries the samples over to the 
+		// new view when it sees the new camera
+		if (settings.reprojection) cancelPass();
+		else restart();
+		render_condition.notify_all();
+	}
+
+	void sceneMoved()
+	{
+		lock_guard<mutex> lock(render_mutex);
+		last_camera_move = chrono::steady_clock::now();
+		restart();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pause and resume the render thread
+	///////////////////////////////////////////////////////////////////////////
+	void pauseRendering()
+	{
+		unique_lock<mutex> lock(render_mutex);
+		if (pauses++ == 0) cancelPasses();
+		render_condition.wait(lock, [] { return !tracing; });
+	}
+
+	void resumeRendering()
+	{
+		lock_guard<mutex> lock(render_mutex);
+		if (--pauses > 0) return;
+		resumePasses();
+		render_condition.notify_all();
+	}
+}
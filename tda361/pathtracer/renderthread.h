@@ -0,0 +1,82 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include "checkpoint.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// An image published by the render thread for display
+	///////////////////////////////////////////////////////////////////////////
+	struct DisplayImage
+	{
+		int width = 0, height = 0;
+		int subsampling = 0;
+		int number_of_samples = 0;		// Passes finished when it was published
+		int converged_pixels = 0;
+		std::vector<glm::vec3> data;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Run tracePaths() pass after pass on a thread of its own (which uses
+	// all cores for the tiles, like tracePaths() always does), so that the
+	// thread that owns the window never waits for a pass. Tiles are
+	// published as they are finished, through a triple buffer that the
+	// render thread and the window thread hand images back and forth in
+	// without locks.
+	//
+	// With settings.frame_time_budget set, the render thread also picks the
+	// subsampling: while the camera moves, the finest one (a power of two) 
+	// whose passes fit in the budget at the measured samples per second, 
+	// and once it stands still, half that after every pass down to 1, 
+	// keeping the samples of the coarser images (see setSubsampling()). 
+	// With settings.reprojection the resolution is kept while the camera 
+	// moves, as the samples carried over to the new view are worth more. 
+	//
+	// With settings.denoise the image is denoised (see denoiser.h) after 
+	// every pass, and published then instead of tile by tile. 
+	///////////////////////////////////////////////////////////////////////////
+	void startRenderThread();
+	void stopRenderThread();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Go on from a checkpoint when the render camera is set to its camera 
+	// (if the scene, settings and window size match it too). Takes the 
+	// checkpoint's buffers. Call before startRenderThread(). 
+	//
+	// While the render thread runs, it offers a checkpoint (see 
+	// offerCheckpoint()) after every pass traced with the camera standing 
+	// still, and when it stops. 
+	///////////////////////////////////////////////////////////////////////////
+	void resumeRenderingFrom(Checkpoint & checkpoint);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set the camera of the following passes. If it has moved, the pass in
+	// flight is cancelled and rendering restarts with the new camera (or,
+	// with settings.reprojection, goes on with the samples reprojected).
+	///////////////////////////////////////////////////////////////////////////
+	void setRenderCamera(const glm::vec3 & position, const glm::vec3 & direction, const glm::vec3 & up);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Call while rendering is paused, after the scene has been animated 
+	// (see setModelTransform()). Rendering restarts, and the subsampling is
+	// picked as while the camera moves. 
+	///////////////////////////////////////////////////////////////////////////
+	void sceneMoved();
+
+	///////////////////////////////////////////////////////////////////////////
+	// The latest image published by the render thread. Sets changed if it
+	// is not the same image as the last call returned. Only call from one
+	// thread (the one that displays the image).
+	///////////////////////////////////////////////////////////////////////////
+	const DisplayImage & displayImage(bool & changed);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Stop the render thread, cancelling the pass in flight, and wait until
+	// it is out of tracePaths(). Between pauseRendering() and
+	// resumeRendering() the scene, materials, lights, settings and image
+	// size may be changed. Pauses nest.
+	///////////////////////////////////////////////////////////////////////////
+	void pauseRendering();
+	void resumeRendering();
+}
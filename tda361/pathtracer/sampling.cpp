@@ -1,22 +1,231 @@
 #include "sampling.h"
-#include <random>
-#include "labhelper.h"
-#include <omp.h>
-#include <iostream>
+#include "Pathtracer.h"
+#include <memory>
+#include <vector>
+#include <algorithm>
 #include <glm/glm.hpp>
 
 using namespace glm; 
 
 namespace pathtracer
 {
+	///////////////////////////////////////////////////////////////////////////
+	// Integer hashing and bit helpers
+	///////////////////////////////////////////////////////////////////////////
+	static uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16; x *= 0x7feb352d;
+		x ^= x >> 15; x *= 0x846ca68b;
+		x ^= x >> 16;
+		return x;
+	}
+
+	static uint32_t hashCombine(uint32_t seed, uint32_t v)
+	{
+		return seed ^ (hash(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+	}
+
+	static uint32_t reverseBits(uint32_t x)
+	{
+		x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+		x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+		x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+		x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+		return (x >> 16) | (x << 16);
+	}
+
+	// The hash that the numbers of a pixel are derived from. Each 
+	// settings.seed gives every pixel another, independent sequence (seed 0
+	// is the sequence the pixel had before there were seeds). 
+	static uint32_t pixelHash(uint32_t x, uint32_t y)
+	{
+		const uint32_t pixel_hash = hashCombine(hash(x), y);
+		return settings.seed == 0 ? pixel_hash : hashCombine(pixel_hash, settings.seed);
+	}
+
+	// Map the top 24 bits of x to a float in [0,1) without any division
+	static float toUnitFloat(uint32_t x)
+	{
+		return float(x >> 8) * 5.9604645e-8f; // 2^-24
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Independent random numbers from a PCG32 generator whose state is 
+	// derived from (pixel, sample index, first dimension), so any sample can
+	// be regenerated without storing generator state. 
+	///////////////////////////////////////////////////////////////////////////
+	class IndependentSampler : public Sampler
+	{
+	public: 
+		uint64_t state = 0;
+		uint64_t increment = 1;
+		void startPixelSample(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t first_dimension) override
+		{
+			uint32_t pixel_hash = pixelHash(x, y);
+			state = 0;
+			increment = (uint64_t(hashCombine(pixel_hash, first_dimension)) << 1) | 1;
+			next();
+			state += (uint64_t(pixel_hash) << 32) | uint64_t(hash(sample_index));
+			next();
+		}
+		uint32_t next()
+		{
+			uint64_t old_state = state;
+			state = old_state * 6364136223846793005ULL + increment;
+			uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+			uint32_t rot = uint32_t(old_state >> 59u);
+			return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+		}
+		float get1D() override { return toUnitFloat(next()); }
+		vec2 get2D() override { float u = get1D(); return vec2(u, get1D()); }
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The Halton sequence, using one prime base per dimension. Each pixel 
+	// gets its own random (Cranley-Patterson) shift per dimension so that 
+	// neighbouring pixels are decorrelated. Dimensions beyond the table of 
+	// primes fall back to independent random numbers. 
+	///////////////////////////////////////////////////////////////////////////
+	class HaltonSampler : public Sampler
+	{
+	public: 
+		static const int number_of_primes = 32;
+		uint32_t index = 0, dimension = 0, pixel_hash = 0;
+		IndependentSampler fallback;
+		void startPixelSample(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t first_dimension) override
+		{
+			index = sample_index;
+			dimension = first_dimension;
+			pixel_hash = pixelHash(x, y);
+			fallback.startPixelSample(x, y, sample_index, first_dimension);
+		}
+		static float radicalInverse(uint32_t base, uint32_t i)
+		{
+			const float inv_base = 1.0f / float(base);
+			float inv_base_n = 1.0f, result = 0.0f;
+			while (i > 0) {
+				uint32_t next = i / base;
+				uint32_t digit = i - next * base;
+				inv_base_n *= inv_base;
+				result += float(digit) * inv_base_n;
+				i = next;
+			}
+			return result;
+		}
+		float get1D() override
+		{
+			static const uint32_t primes[number_of_primes] = {
+				2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+				59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131 };
+			if (dimension >= number_of_primes) { dimension++; return fallback.get1D(); }
+			float shift = toUnitFloat(hashCombine(pixel_hash, dimension));
+			float u = radicalInverse(primes[dimension++], index) + shift;
+			u = u >= 1.0f ? u - 1.0f : u;
+			return std::min(u, 0.99999994f);
+		}
+		vec2 get2D() override { float u = get1D(); return vec2(u, get1D()); }
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The first two dimensions of the Sobol sequence, padded to any number of
+	// dimensions by giving each pair of dimensions its own random shuffle of 
+	// the sample indices (Burley 2020, "Practical Hash-based Owen 
+	// Scrambling"). The shuffle only permutes indices within aligned blocks 
+	// of power-of-two size, so every prefix of 2^k samples stays 
+	// stratified. With owen_scramble the points are also Owen scrambled, 
+	// otherwise they only get a random XOR (digit) scramble. 
+	///////////////////////////////////////////////////////////////////////////
+	class SobolSampler : public Sampler
+	{
+	public: 
+		bool owen_scramble;
+		uint32_t index = 0, dimension = 0, pixel_hash = 0;
+		SobolSampler(bool _owen_scramble) : owen_scramble(_owen_scramble) {}
+		void startPixelSample(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t first_dimension) override
+		{
+			index = sample_index;
+			dimension = first_dimension;
+			pixel_hash = pixelHash(x, y);
+		}
+		static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+		{
+			x += seed;
+			x ^= x * 0x6c50b47cu;
+			x ^= x * 0xb82f1e52u;
+			x ^= x * 0xc7afe638u;
+			x ^= x * 0x8d22f6e6u;
+			return x;
+		}
+		static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+		{
+			return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+		}
+		static uint32_t sobolDimension1(uint32_t i)
+		{
+			uint32_t result = 0;
+			for (uint32_t v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1) {
+				if (i & 1) result ^= v;
+			}
+			return result;
+		}
+		vec2 get2D() override
+		{
+			uint32_t seed = hashCombine(pixel_hash, dimension);
+			dimension += 2;
+			uint32_t i = nestedUniformScramble(index, seed);
+			uint32_t x = reverseBits(i);
+			uint32_t y = sobolDimension1(i);
+			if (owen_scramble) {
+				x = nestedUniformScramble(x, hashCombine(seed, 0));
+				y = nestedUniformScramble(y, hashCombine(seed, 1));
+			}
+			else {
+				x ^= hash(hashCombine(seed, 0));
+				y ^= hash(hashCombine(seed, 1));
+			}
+			return vec2(toUnitFloat(x), toUnitFloat(y));
+		}
+		float get1D() override { return get2D().x; }
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// One sampler per thread. It lives in thread local storage, so there is
+	// no limit on the number of threads and no two threads share its state.
+	///////////////////////////////////////////////////////////////////////////
+	static Sampler * createSampler(int type)
+	{
+		switch (type) {
+		case SAMPLER_HALTON: return new HaltonSampler();
+		case SAMPLER_SOBOL: return new SobolSampler(false);
+		case SAMPLER_OWEN_SOBOL: return new SobolSampler(true);
+		default: return new IndependentSampler();
+		}
+	}
+
+	static thread_local std::unique_ptr<Sampler> thread_sampler;
+	static thread_local int thread_sampler_type = -1;
+
+	Sampler & getSampler()
+	{
+		if (!thread_sampler) {
+			thread_sampler.reset(createSampler(settings.sampler));
+			thread_sampler_type = settings.sampler;
+			thread_sampler->startPixelSample(0, 0, 0);
+		}
+		return *thread_sampler;
+	}
+
+	void startPixelSample(int x, int y, uint32_t sample_index, uint32_t first_dimension)
+	{
+		if (thread_sampler_type != settings.sampler) thread_sampler.reset();
+		getSampler().startPixelSample(uint32_t(x), uint32_t(y), sample_index, first_dimension);
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
-	// Get a random float. Note that we need one "generator" per thread, or we 
-	// would need to lock everytime someone called randf(). 
+	// Get a random float from this thread's sampler
 	///////////////////////////////////////////////////////////////////////////////
-	std::mt19937 generators[24]; // Assuming no more than 24 cores
 	float randf() {
-		return float(generators[omp_get_thread_num()]() /
-			double(generators[omp_get_thread_num()].max()));
+		return getSampler().get1D();
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -24,8 +233,9 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	void concentricSampleDisk(float *dx, float *dy) {
 		float r, theta;
-		float u1 = randf();
-		float u2 = randf();
+		vec2 u = getSampler().get2D();
+		float u1 = u.x;
+		float u2 = u.y;
 		// Map uniform random numbers to $[-1,1]^2$
 		float sx = 2 * u1 - 1;
 		float sy = 2 * u2 - 1;
@@ -72,6 +282,15 @@ namespace pathtracer
 		return ret;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Multiple importance sampling weight (power heuristic)
+	///////////////////////////////////////////////////////////////////////////
+	float powerHeuristic(float pdf_a, float pdf_b)
+	{
+		const float a2 = pdf_a * pdf_a, b2 = pdf_b * pdf_b;
+		return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Generate a vector that is perpendicular to another
 	///////////////////////////////////////////////////////////////////////////
@@ -90,4 +309,58 @@ namespace pathtracer
 	bool sameHemisphere(const vec3 &i, const vec3 &o, const vec3 &n) {
 		return sign(dot(o, n)) == sign(dot(i, n));
 	}
-}
\ No newline at end of file
+
+	///////////////////////////////////////////////////////////////////////////
+	// Build an alias table for n weights with Vose's method. Returns the sum of
+	// the weights. If they are all zero, every entry gets the same probability.
+	///////////////////////////////////////////////////////////////////////////
+	float buildAliasTable(const float * weights, int n, AliasEntry * table)
+	{
+		double sum = 0.0;
+		for (int i = 0; i < n; i++) sum += weights[i];
+		std::vector<uint32_t> small, large;
+		small.reserve(n);
+		large.reserve(n);
+		std::vector<float> scaled(n);
+		for (int i = 0; i < n; i++) {
+			table[i].pdf = sum > 0.0 ? float(weights[i] / sum) : 1.0f / float(n);
+			table[i].alias = i;
+			scaled[i] = table[i].pdf * float(n);
+			if (scaled[i] < 1.0f) small.push_back(i);
+			else large.push_back(i);
+		}
+		while (!small.empty() && !large.empty()) {
+			uint32_t s = small.back(); small.pop_back();
+			uint32_t l = large.back();
+			table[s].threshold = scaled[s];
+			table[s].alias = l;
+			scaled[l] -= 1.0f - scaled[s];
+			if (scaled[l] < 1.0f) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// What is left (up to rounding) has probability one
+		for (uint32_t i : small) table[i].threshold = 1.0f;
+		for (uint32_t i : large) table[i].threshold = 1.0f;
+		return float(sum);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pick an entry from an alias table with u in [0,1), and reuse what is
+	// left of u as a new uniform number in [0,1).
+	///////////////////////////////////////////////////////////////////////////
+	uint32_t sampleAliasTable(const AliasEntry * table, int n, float & u)
+	{
+		float scaled = u * float(n);
+		uint32_t i = std::min(uint32_t(scaled), uint32_t(n - 1));
+		float fraction = scaled - float(i);
+		const AliasEntry & entry = table[i];
+		if (fraction < entry.threshold) {
+			u = std::min(fraction / entry.threshold, 0.99999994f);
+			return i;
+		}
+		u = std::min((fraction - entry.threshold) / (1.0f - entry.threshold), 0.99999994f);
+		return entry.alias;
+	}
+}
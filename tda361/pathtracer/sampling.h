@@ -1,10 +1,49 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <cstdint>
 
 namespace pathtracer
 {
 	///////////////////////////////////////////////////////////////////////////
-	// Random number generation
+	// The available sample generators (see settings.sampler)
+	///////////////////////////////////////////////////////////////////////////
+	enum SamplerType {
+		SAMPLER_INDEPENDENT = 0,	// PCG32 seeded from (pixel, sample index)
+		SAMPLER_HALTON = 1,			// Halton sequence, randomly shifted per pixel
+		SAMPLER_SOBOL = 2,			// Shuffled, randomly XOR scrambled 2D Sobol
+		SAMPLER_OWEN_SOBOL = 3		// Shuffled, Owen scrambled 2D Sobol
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The interface of a sample generator. A sampler is told which sample of
+	// which pixel is being computed, and then hands out the numbers for that
+	// sample one dimension at a time. The numbers only depend on pixel, 
+	// sample index and dimension, not on which thread is doing the work. 
+	///////////////////////////////////////////////////////////////////////////
+	class Sampler
+	{
+	public: 
+		virtual ~Sampler() {}
+		// Start generating numbers for a sample of a pixel, beginning at
+		// dimension first_dimension
+		virtual void startPixelSample(uint32_t x, uint32_t y, uint32_t sample_index, uint32_t first_dimension = 0) = 0;
+		// The next number in [0,1) / the next pair of numbers in [0,1)^2
+		virtual float get1D() = 0;
+		virtual glm::vec2 get2D() = 0;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Each thread has its own sampler, of the type in settings.sampler. 
+	// startPixelSample() must be called before drawing numbers for a sample. 
+	///////////////////////////////////////////////////////////////////////////
+	Sampler & getSampler();
+	void startPixelSample(int x, int y, uint32_t sample_index, uint32_t first_dimension = 0);
+	// Bounce b of a path starts at dimension b * dimensions_per_bounce, in
+	// every trace mode, so that paths shaded interleaved get the same numbers
+	const uint32_t dimensions_per_bounce = 16;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Random number generation (the next dimension of this thread's sampler)
 	///////////////////////////////////////////////////////////////////////////
 	float randf();
 	///////////////////////////////////////////////////////////////////////////
@@ -16,6 +55,12 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	glm::vec3 cosineSampleHemisphere();
 	///////////////////////////////////////////////////////////////////////////
+	// The weight of a sample taken with pdf_a, when the same direction could
+	// also have been sampled with pdf_b (multiple importance sampling with 
+	// Veach's power heuristic, beta = 2)
+	///////////////////////////////////////////////////////////////////////////
+	float powerHeuristic(float pdf_a, float pdf_b);
+	///////////////////////////////////////////////////////////////////////////
 	// Generate a vector that is perpendicular to another
 	///////////////////////////////////////////////////////////////////////////
 	glm::vec3 perpendicular(const glm::vec3 &v);
@@ -23,4 +68,20 @@ namespace pathtracer
 	// Check if wi and wo are on the same side of the plane defined by n
 	///////////////////////////////////////////////////////////////////////////
 	bool sameHemisphere(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n);
-}
\ No newline at end of file
+	///////////////////////////////////////////////////////////////////////////
+	// Walker alias tables, for picking one of n entries in proportion to 
+	// their weights in constant time. Entry i is picked with probability 
+	// threshold / n, otherwise its alias is picked. pdf is the probability 
+	// of entry i itself. buildAliasTable() returns the sum of the weights 
+	// (if they are all zero, every entry gets the same probability). 
+	// sampleAliasTable() picks an entry with u in [0,1) and leaves what is 
+	// left of u as a new uniform number in [0,1). 
+	///////////////////////////////////////////////////////////////////////////
+	struct AliasEntry {
+		float threshold;
+		uint32_t alias;
+		float pdf;
+	};
+	float buildAliasTable(const float * weights, int n, AliasEntry * table);
+	uint32_t sampleAliasTable(const AliasEntry * table, int n, float & u);
+}
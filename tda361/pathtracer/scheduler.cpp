@@ -0,0 +1,132 @@
+#include "scheduler.h"
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <omp.h>
+
+using namespace std;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Interleave the bits of x and y (16 bits each) into a Morton code
+	///////////////////////////////////////////////////////////////////////////
+	static uint32_t spreadBits(uint32_t v)
+	{
+		v &= 0x0000FFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+
+	static uint32_t mortonCode(uint32_t x, uint32_t y)
+	{
+		return spreadBits(x) | (spreadBits(y) << 1);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Split the image into tiles in Morton order
+	///////////////////////////////////////////////////////////////////////////
+	void buildTiles(int width, int height, int tile_size, vector<Tile> & tiles)
+	{
+		tile_size = std::max(1, tile_size);
+		int tiles_x = (width + tile_size - 1) / tile_size;
+		int tiles_y = (height + tile_size - 1) / tile_size;
+		vector<pair<uint32_t, Tile>> sorted_tiles;
+		sorted_tiles.reserve(tiles_x * tiles_y);
+		for (int ty = 0; ty < tiles_y; ty++) {
+			for (int tx = 0; tx < tiles_x; tx++) {
+				Tile tile;
+				tile.x0 = tx * tile_size;
+				tile.y0 = ty * tile_size;
+				tile.x1 = std::min(tile.x0 + tile_size, width);
+				tile.y1 = std::min(tile.y0 + tile_size, height);
+				sorted_tiles.push_back(make_pair(mortonCode(tx, ty), tile));
+			}
+		}
+		sort(sorted_tiles.begin(), sorted_tiles.end(),
+			[](const pair<uint32_t, Tile> & a, const pair<uint32_t, Tile> & b) { return a.first < b.first; });
+		tiles.resize(sorted_tiles.size());
+		for (size_t i = 0; i < sorted_tiles.size(); i++) {
+			tiles[i] = sorted_tiles[i].second;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// A per-thread run of tile indices [front, back). The owner pops from the
+	// front and thieves pop from the back. Both ends are packed into a single
+	// 64 bit word so that both operations are a single compare-and-swap. Each
+	// queue is padded to a cache line so that threads do not share lines.
+	///////////////////////////////////////////////////////////////////////////
+	struct TileQueue
+	{
+		atomic<uint64_t> range;
+		char padding[64 - sizeof(atomic<uint64_t>)];
+	};
+
+	static uint64_t packRange(uint32_t front, uint32_t back)
+	{
+		return (uint64_t(back) << 32) | uint64_t(front);
+	}
+
+	static bool popFront(TileQueue & queue, uint32_t & tile_index)
+	{
+		uint64_t range = queue.range.load(memory_order_relaxed);
+		for (;;) {
+			uint32_t front = uint32_t(range), back = uint32_t(range >> 32);
+			if (front >= back) return false;
+			if (queue.range.compare_exchange_weak(range, packRange(front + 1, back))) {
+				tile_index = front;
+				return true;
+			}
+		}
+	}
+
+	static bool popBack(TileQueue & queue, uint32_t & tile_index)
+	{
+		uint64_t range = queue.range.load(memory_order_relaxed);
+		for (;;) {
+			uint32_t front = uint32_t(range), back = uint32_t(range >> 32);
+			if (front >= back) return false;
+			if (queue.range.compare_exchange_weak(range, packRange(front, back - 1))) {
+				tile_index = back - 1;
+				return true;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Render all tiles with per-thread work stealing
+	///////////////////////////////////////////////////////////////////////////
+	void forEachTile(const vector<Tile> & tiles, const function<void(const Tile &)> & render_tile)
+	{
+		const int number_of_queues = omp_get_max_threads();
+		const uint32_t number_of_tiles = uint32_t(tiles.size());
+		vector<TileQueue> queues(number_of_queues);
+		for (int i = 0; i < number_of_queues; i++) {
+			uint32_t front = uint32_t((uint64_t(number_of_tiles) * i) / number_of_queues);
+			uint32_t back = uint32_t((uint64_t(number_of_tiles) * (i + 1)) / number_of_queues);
+			queues[i].range.store(packRange(front, back));
+		}
+
+#pragma omp parallel
+		{
+			const int thread_id = omp_get_thread_num();
+			uint32_t tile_index;
+			// First work through our own run of tiles, front to back
+			while (popFront(queues[thread_id], tile_index)) {
+				render_tile(tiles[tile_index]);
+			}
+			// Then help the others. Queues never grow, so once a queue has
+			// been found empty we never need to look at it again.
+			for (int i = 1; i < number_of_queues; i++) {
+				TileQueue & victim = queues[(thread_id + i) % number_of_queues];
+				while (popBack(victim, tile_index)) {
+					render_tile(tiles[tile_index]);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <vector>
+#include <functional>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// A rectangular block of pixels [x0, x1) x [y0, y1) in the rendered image
+	///////////////////////////////////////////////////////////////////////////
+	struct Tile
+	{
+		int x0, y0, x1, y1;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Split an image into tiles of tile_size x tile_size pixels (smaller at
+	// the right and top borders), ordered along a Morton (Z-order) curve so
+	// that consecutive tiles are close to each other on screen.
+	///////////////////////////////////////////////////////////////////////////
+	void buildTiles(int width, int height, int tile_size, std::vector<Tile> & tiles);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Call render_tile once for every tile, on all cores. Each thread starts
+	// with a contiguous run of the tile list and, when it runs dry, steals
+	// tiles from the far end of another thread's run.
+	///////////////////////////////////////////////////////////////////////////
+	void forEachTile(const std::vector<Tile> & tiles, const std::function<void(const Tile &)> & render_tile);
+}
@@ -0,0 +1,246 @@
+#include "shading.h"
+#include <algorithm>
+#include "Pathtracer.h"
+#include "sampling.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	void ShadingBatchEntries::reserve(size_t n)
+	{
+		if (n <= wi_x.size()) return;
+		wi_x.resize(n); wi_y.resize(n); wi_z.resize(n);
+		wo_x.resize(n); wo_y.resize(n); wo_z.resize(n);
+		n_x.resize(n); n_y.resize(n); n_z.resize(n);
+		f_r.resize(n); f_g.resize(n); f_b.resize(n);
+		pdf.resize(n);
+	}
+
+	void ShadingBatch::clear()
+	{
+		materials.clear();
+	}
+
+	size_t ShadingBatch::push(const ShadingMaterial * material, const vec3 & wi, const vec3 & wo, const vec3 & n)
+	{
+		const size_t i = size();
+		materials.push_back(material);
+		if (i == entries.wi_x.size()) entries.reserve(std::max<size_t>(256, 2 * i));
+		entries.wi_x[i] = wi.x; entries.wi_y[i] = wi.y; entries.wi_z[i] = wi.z;
+		entries.wo_x[i] = wo.x; entries.wo_y[i] = wo.y; entries.wo_z[i] = wo.z;
+		entries.n_x[i] = n.x; entries.n_y[i] = n.y; entries.n_z[i] = n.z;
+		return i;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The material tree, flattened. With F the Fresnel term, R the microfacet
+	// reflection and d the diffuse brdf, 
+	//   f = metal_weight * R * color + dielectric_weight * (R + (1 - F) * d) 
+	//       + base_weight * d
+	//   pdf = (metal_weight + dielectric_weight) * pdf_R 
+	//       + (dielectric_weight / 2 + base_weight) * pdf_d
+	// where pdf_R is half the pdf of sampling the microfacet distribution. 
+	// The template parameters say which layers the material has, and the 
+	// others are compiled away. 
+	///////////////////////////////////////////////////////////////////////////
+	template<bool Diffuse, bool Dielectric, bool Metal>
+	static inline void evaluateLayers(const ShadingMaterial & m, const vec3 & wi, const vec3 & wo, const vec3 & n, 
+		vec3 & f, float & pdf)
+	{
+		const float metal_weight = Metal ? m.metal_weight : 0.0f;
+		const float dielectric_weight = Dielectric ? m.dielectric_weight : 0.0f;
+		const float base_weight = Diffuse ? m.base_weight : 0.0f;
+		const float cos_i = dot(n, wi);
+		const float cos_o = dot(n, wo);
+		const bool above = cos_i > 0.0f && cos_o > 0.0f;
+		const float pdf_d = std::max(0.0f, cos_i) / M_PI;
+		float diffuse_scale = base_weight;
+		f = vec3(0.0f);
+		pdf = 0.0f;
+		if (Dielectric || Metal) {
+			const vec3 wh = normalize(wi + wo);
+			const float n_dot_h = dot(n, wh);
+			const float wo_dot_h = dot(wo, wh);
+			const float c = 1.0f - abs(dot(wi, wh));
+			const float F = m.R0 + (1.0f - m.R0) * (c * c) * (c * c) * c;
+			const float distribution = pow(std::max(0.0f, n_dot_h), m.shininess);
+			const float G = std::min(1.0f, std::min(2.0f * n_dot_h * cos_o / wo_dot_h, 2.0f * n_dot_h * cos_i / wo_dot_h));
+			const float R = above ? F * m.D_normalization * distribution * G / (4.0f * cos_o * cos_i) : 0.0f;
+			if (Metal) f += metal_weight * R * m.color;
+			if (Dielectric) {
+				f += vec3(dielectric_weight * R);
+				diffuse_scale += dielectric_weight * (1.0f - F);
+			}
+			const float pdf_R = (cos_i > 0.0f && wo_dot_h > 0.0f) ? 
+				0.5f * m.pdf_normalization * distribution / (4.0f * wo_dot_h) : 0.0f;
+			pdf += (metal_weight + dielectric_weight) * pdf_R;
+		}
+		if (Diffuse) {
+			if (above) f += diffuse_scale * m.diffuse;
+			pdf += (0.5f * dielectric_weight + base_weight) * pdf_d;
+		}
+	}
+
+	template<bool Diffuse, bool Dielectric, bool Metal>
+	static void evaluateMaterial(const ShadingMaterial & material, ShadingBatchEntries & e, size_t begin, size_t end)
+	{
+		const ShadingMaterial m = material;
+		const float * wi_x = e.wi_x.data(), * wi_y = e.wi_y.data(), * wi_z = e.wi_z.data();
+		const float * wo_x = e.wo_x.data(), * wo_y = e.wo_y.data(), * wo_z = e.wo_z.data();
+		const float * n_x = e.n_x.data(), * n_y = e.n_y.data(), * n_z = e.n_z.data();
+		float * f_r = e.f_r.data(), * f_g = e.f_g.data(), * f_b = e.f_b.data(), * pdf = e.pdf.data();
+		PATHTRACER_SIMD
+		for (size_t i = begin; i < end; i++) {
+			vec3 f;
+			float p;
+			evaluateLayers<Diffuse, Dielectric, Metal>(m, vec3(wi_x[i], wi_y[i], wi_z[i]), 
+				vec3(wo_x[i], wo_y[i], wo_z[i]), vec3(n_x[i], n_y[i], n_z[i]), f, p);
+			f_r[i] = f.r;
+			f_g[i] = f.g;
+			f_b[i] = f.b;
+			pdf[i] = p;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sample a direction with the same distribution as the material tree: 
+	// the microfacet distribution with probability (metal_weight + 
+	// dielectric_weight) / 2, the diffuse base with probability 
+	// dielectric_weight / 2 + base_weight, and nothing otherwise (a metal 
+	// has no layer under it). 
+	///////////////////////////////////////////////////////////////////////////
+	template<bool Diffuse, bool Dielectric, bool Metal>
+	static vec3 sampleMaterial(const ShadingMaterial & m, vec3 & wi, const vec3 & wo, const vec3 & n, float & p)
+	{
+		bool microfacet = false;
+		if (Dielectric || Metal) {
+			const float u = randf();
+			microfacet = u < m.microfacet_probability;
+			if (!microfacet && !(Diffuse && u < m.microfacet_probability + m.diffuse_probability)) {
+				p = 0.0f;
+				return vec3(0.0f);
+			}
+		}
+		const vec3 tangent = normalize(perpendicular(n));
+		const vec3 bitangent = normalize(cross(tangent, n));
+		if (microfacet) {
+			const float phi = 2.0f * M_PI * randf();
+			const float cos_theta = pow(randf(), 1.0f / (m.shininess + 1.0f));
+			const float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+			const vec3 wh = normalize(sin_theta * cos(phi) * tangent + sin_theta * sin(phi) * bitangent + 
+				cos_theta * n);
+			wi = reflect(-wo, wh);
+		}
+		else {
+			const vec3 sample = cosineSampleHemisphere();
+			wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
+		}
+		vec3 f;
+		evaluateLayers<Diffuse, Dielectric, Metal>(m, wi, wo, n, f, p);
+		return f;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Work out which layers a material has and pick the functions compiled
+	// for them
+	///////////////////////////////////////////////////////////////////////////
+	template<bool Diffuse, bool Dielectric, bool Metal>
+	static void setFunctions(ShadingMaterial & m)
+	{
+		m.evaluate = evaluateMaterial<Diffuse, Dielectric, Metal>;
+		m.sample = sampleMaterial<Diffuse, Dielectric, Metal>;
+	}
+
+	ShadingMaterial makeShadingMaterial(const labhelper::Material & material)
+	{
+		ShadingMaterial m;
+		m.material = &material;
+		m.color = material.m_color;
+		m.diffuse = material.m_color / M_PI;
+		m.metal_weight = material.m_reflectivity * material.m_metalness;
+		m.dielectric_weight = material.m_reflectivity * (1.0f - material.m_metalness);
+		m.base_weight = 1.0f - material.m_reflectivity;
+		m.R0 = material.m_fresnel;
+		m.shininess = material.m_shininess;
+		m.D_normalization = (m.shininess + 2.0f) / (2.0f * M_PI);
+		m.pdf_normalization = (m.shininess + 1.0f) / (2.0f * M_PI);
+		m.microfacet_probability = 0.5f * (m.metal_weight + m.dielectric_weight);
+		m.diffuse_probability = 0.5f * m.dielectric_weight + m.base_weight;
+
+		m.features = 0;
+		if (m.base_weight > 0.0f || m.dielectric_weight > 0.0f) m.features |= MATERIAL_DIFFUSE;
+		if (m.dielectric_weight > 0.0f) m.features |= MATERIAL_DIELECTRIC;
+		if (m.metal_weight > 0.0f) m.features |= MATERIAL_METAL;
+		if (material.m_color_texture.valid || material.m_reflectivity_texture.valid || 
+			material.m_shininess_texture.valid || material.m_metalness_texture.valid ||
+			material.m_fresnel_texture.valid || material.m_emission_texture.valid) {
+			m.features |= MATERIAL_TEXTURED;
+		}
+		if (material.m_emission > 0.0f) m.features |= MATERIAL_EMISSIVE;
+		if (material.m_transparency > 0.0f) m.features |= MATERIAL_TRANSPARENT;
+
+		switch (m.features & (MATERIAL_DIFFUSE | MATERIAL_DIELECTRIC | MATERIAL_METAL)) {
+		case MATERIAL_METAL: setFunctions<false, false, true>(m); break;
+		case MATERIAL_DIFFUSE: setFunctions<true, false, false>(m); break;
+		case MATERIAL_DIFFUSE | MATERIAL_METAL: setFunctions<true, false, true>(m); break;
+		case MATERIAL_DIFFUSE | MATERIAL_DIELECTRIC: setFunctions<true, true, false>(m); break;
+		case MATERIAL_DIFFUSE | MATERIAL_DIELECTRIC | MATERIAL_METAL: setFunctions<true, true, true>(m); break;
+		// A black material with no layers: the diffuse base (of weight 0)
+		default: setFunctions<true, false, false>(m); break;
+		}
+		return m;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Sort the entries by material (counting sort over the materials in the
+	// batch, which are few), evaluate each bin and put the results back in
+	// the original order
+	///////////////////////////////////////////////////////////////////////////
+	void ShadingBatch::evaluate()
+	{
+		const size_t n = size();
+		if (n == 0) return;
+		bin_materials.clear();
+		bin_of_entry.resize(n);
+		const ShadingMaterial * last_material = nullptr;
+		uint32_t last_bin = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (materials[i] != last_material) {
+				last_material = materials[i];
+				auto it = find(bin_materials.begin(), bin_materials.end(), last_material);
+				last_bin = uint32_t(it - bin_materials.begin());
+				if (it == bin_materials.end()) bin_materials.push_back(last_material);
+			}
+			bin_of_entry[i] = last_bin;
+		}
+		const uint32_t number_of_bins = uint32_t(bin_materials.size());
+		if (number_of_bins == 1) {
+			bin_materials[0]->evaluate(*bin_materials[0], entries, 0, n);
+			return;
+		}
+
+		bin_start.assign(number_of_bins + 1, 0);
+		for (size_t i = 0; i < n; i++) bin_start[bin_of_entry[i] + 1]++;
+		for (uint32_t b = 0; b < number_of_bins; b++) bin_start[b + 1] += bin_start[b];
+		order.resize(n);
+		for (size_t i = 0; i < n; i++) order[bin_start[bin_of_entry[i]]++] = uint32_t(i);
+		// bin_start now holds the ends of the bins
+		sorted.reserve(n);
+		for (size_t j = 0; j < n; j++) {
+			const uint32_t i = order[j];
+			sorted.wi_x[j] = entries.wi_x[i]; sorted.wi_y[j] = entries.wi_y[i]; sorted.wi_z[j] = entries.wi_z[i];
+			sorted.wo_x[j] = entries.wo_x[i]; sorted.wo_y[j] = entries.wo_y[i]; sorted.wo_z[j] = entries.wo_z[i];
+			sorted.n_x[j] = entries.n_x[i]; sorted.n_y[j] = entries.n_y[i]; sorted.n_z[j] = entries.n_z[i];
+		}
+		for (uint32_t b = 0; b < number_of_bins; b++) {
+			bin_materials[b]->evaluate(*bin_materials[b], sorted, b == 0 ? 0 : bin_start[b - 1], bin_start[b]);
+		}
+		for (size_t j = 0; j < n; j++) {
+			const uint32_t i = order[j];
+			entries.f_r[i] = sorted.f_r[j]; entries.f_g[i] = sorted.f_g[j]; entries.f_b[i] = sorted.f_b[j];
+			entries.pdf[i] = sorted.pdf[j];
+		}
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <Model.h>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// What a material is made of. The first three select the layers of the
+	// material tree that are evaluated, the rest are recorded for the other
+	// stages (the pathtracer does not use textures or transparency yet).
+	///////////////////////////////////////////////////////////////////////////
+	enum MaterialFeatures
+	{
+		MATERIAL_DIFFUSE = 1 << 0,		// Diffuse base (reflectivity < 1 or metalness < 1)
+		MATERIAL_DIELECTRIC = 1 << 1,	// Dielectric microfacet layer (reflectivity > 0, metalness < 1)
+		MATERIAL_METAL = 1 << 2,		// Metal microfacet layer (reflectivity > 0, metalness > 0)
+		MATERIAL_TEXTURED = 1 << 3,
+		MATERIAL_EMISSIVE = 1 << 4,
+		MATERIAL_TRANSPARENT = 1 << 5
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The entries of a ShadingBatch, stored as one array per member. The
+	// arrays only grow, and may be longer than the batch. 
+	///////////////////////////////////////////////////////////////////////////
+	struct ShadingBatchEntries
+	{
+		std::vector<float> wi_x, wi_y, wi_z;
+		std::vector<float> wo_x, wo_y, wo_z;
+		std::vector<float> n_x, n_y, n_z;
+		std::vector<float> f_r, f_g, f_b;
+		std::vector<float> pdf;
+		// Make room for n entries without reallocating
+		void reserve(size_t n);
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A labhelper::Material prepared for shading: its parameters, and the
+	// evaluate and sample functions of the material tree compiled for its
+	// combination of layers, so that layers with zero weight cost nothing.
+	// Made once per material when a model is added (and again by
+	// updateMaterials()).
+	///////////////////////////////////////////////////////////////////////////
+	struct ShadingMaterial
+	{
+		const labhelper::Material * material;
+		uint32_t features;
+		glm::vec3 color, diffuse;					// diffuse = color / pi
+		float metal_weight;							// reflectivity * metalness
+		float dielectric_weight;					// reflectivity * (1 - metalness)
+		float base_weight;							// 1 - reflectivity
+		float R0, shininess;
+		float D_normalization, pdf_normalization;
+		float microfacet_probability;				// Of sampling the microfacet layers
+		float diffuse_probability;					// Of sampling the diffuse base
+		// Evaluate entries [begin, end) of a batch, which all have this
+		// material
+		void (*evaluate)(const ShadingMaterial & material, ShadingBatchEntries & entries, size_t begin, size_t end);
+		// Sample a direction like MaterialTree::brdf().sample_wi() does
+		glm::vec3 (*sample)(const ShadingMaterial & material, glm::vec3 & wi, const glm::vec3 & wo,
+			const glm::vec3 & n, float & p);
+	};
+	ShadingMaterial makeShadingMaterial(const labhelper::Material & material);
+
+	///////////////////////////////////////////////////////////////////////////
+	// A batch of brdf evaluations, each one a material and the directions wi
+	// and wo around a shading normal n. evaluate() computes the brdf and the
+	// pdf of sampling wi (as the MaterialTree of the material would) for the
+	// whole batch: the entries are binned by material, and each bin is run
+	// through the material's evaluate function, one straight loop over
+	// arrays of floats that the compiler can vectorize.
+	///////////////////////////////////////////////////////////////////////////
+	struct ShadingBatch
+	{
+		std::vector<const ShadingMaterial *> materials;
+		ShadingBatchEntries entries;
+
+		size_t size() const { return materials.size(); }
+		void clear();
+		// Append an entry and return its index
+		size_t push(const ShadingMaterial * material, const glm::vec3 & wi, const glm::vec3 & wo,
+			const glm::vec3 & n);
+		void evaluate();
+		// The results of evaluate() for entry i
+		glm::vec3 f(size_t i) const { return glm::vec3(entries.f_r[i], entries.f_g[i], entries.f_b[i]); }
+		float pdf(size_t i) const { return entries.pdf[i]; }
+
+		// Scratch space for sorting the entries by material
+		std::vector<const ShadingMaterial *> bin_materials;
+		std::vector<uint32_t> bin_of_entry, bin_start, order;
+		ShadingBatchEntries sorted;
+	};
+}
@@ -0,0 +1,146 @@
+#include "wavefront.h"
+#include "embree.h"
+#include "material.h"
+#include "sampling.h"
+#include "lights.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// The queues used while tracing a tile. They are kept per thread and 
+	// reused between tiles so that we do not allocate memory for every tile.
+	// Path i in the list of live paths belongs to ray i in the ray queue of
+	// the current bounce. 
+	///////////////////////////////////////////////////////////////////////////
+	struct WavefrontQueues
+	{
+		RayQueue rays;						// Rays of the current bounce
+		RayQueue next_rays;					// Continuation rays for the next bounce
+		vector<PathState> paths;			// One per ray in rays
+		vector<PathState> next_paths;		// One per ray in next_rays
+		DirectLightBatch direct_light;		// Light samples waiting for their brdfs
+		ShadowQueue shadows;				// Shadow rays of the current bounce
+		// Rays that missed the scene, looked up in the environment together
+		vector<float> miss_x, miss_y, miss_z, miss_lod;
+		vector<vec3> miss_weights;			// Throughput times MIS weight
+		vector<int> miss_slots;				// Sample slot of each miss
+		vector<vec3> miss_radiance;
+		// One slot per sample taken in the tile this pass
+		vector<int> slot_x, slot_y;			// Pixel the sample belongs to
+		vector<uint32_t> slot_sample_index;	// Sample index within that pixel
+		vector<vec3> radiance;				// Radiance found so far
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shade all hits of the current bounce. Misses terminate the path with 
+	// the environment radiance, hits queue shadow rays toward a light and
+	// toward a sampled direction of the environment, and (if we have bounces
+	// left) a continuation ray for the next bounce (see shadeHit()). 
+	///////////////////////////////////////////////////////////////////////////
+	static void shadeBounce(WavefrontQueues & q, int bounce, bool continue_paths)
+	{
+		q.next_rays.clear();
+		q.next_rays.reserve(q.rays.size());
+		q.next_paths.clear();
+		q.direct_light.clear();
+		q.shadows.clear();
+		q.miss_x.clear();
+		q.miss_y.clear();
+		q.miss_z.clear();
+		q.miss_lod.clear();
+		q.miss_weights.clear();
+		q.miss_slots.clear();
+		for (size_t i = 0; i < q.rays.size(); i++) {
+			const PathState & path = q.paths[i];
+			Ray ray = q.rays.getRay(i);
+			if (ray.geomID == RTC_INVALID_GEOMETRY_ID) {
+				if (bounce == 0) recordPrimaryHit(q.slot_x[path.slot], q.slot_y[path.slot], FLT_MAX, vec3(0.0f), vec3(1.0f));
+				float solid_angle;
+				const float weight = environmentWeight(path, ray.d, q.slot_sample_index[path.slot], solid_angle);
+				q.miss_x.push_back(ray.d.x);
+				q.miss_y.push_back(ray.d.y);
+				q.miss_z.push_back(ray.d.z);
+				q.miss_lod.push_back(environmentLod(ray.d, solid_angle));
+				q.miss_weights.push_back(weight * path.throughput);
+				q.miss_slots.push_back(path.slot);
+				continue;
+			}
+			Intersection hit = getIntersection(ray);
+			if (bounce == 0) {
+				recordPrimaryHit(q.slot_x[path.slot], q.slot_y[path.slot], ray.tfar, hit.shading_normal,
+					hit.material->m_color);
+			}
+			startPixelSample(q.slot_x[path.slot], q.slot_y[path.slot], q.slot_sample_index[path.slot],
+				bounce * dimensions_per_bounce);
+			PathState next = path;
+			Ray next_ray;
+			if (shadeHit(hit, ray, continue_paths, next, q.radiance[path.slot], next_ray, q.direct_light, q.shadows)) {
+				q.next_rays.push(next_ray);
+				q.next_paths.push_back(next);
+			}
+		}
+		// Evaluate the brdfs of all light samples at once
+		q.direct_light.resolve(q.shadows);
+		// Look up the environment for all misses at once
+		const int misses = int(q.miss_slots.size());
+		q.miss_radiance.resize(misses);
+		environment.map.sample(misses, q.miss_x.data(), q.miss_y.data(), q.miss_z.data(), q.miss_lod.data(),
+			q.miss_radiance.data());
+		for (int i = 0; i < misses; i++) {
+			q.radiance[q.miss_slots[i]] += environment.multiplier * q.miss_weights[i] * q.miss_radiance[i];
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Trace the paths of a tile, breadth first
+	///////////////////////////////////////////////////////////////////////////
+	void traceTileWavefront(const Tile & tile, const Camera & camera)
+	{
+		static thread_local WavefrontQueues q;
+
+		// Generate all camera rays of the tile, one per sample that each
+		// pixel gets in this pass
+		q.rays.clear();
+		q.paths.clear();
+		q.slot_x.clear();
+		q.slot_y.clear();
+		q.slot_sample_index.clear();
+		for (int y = tile.y0; y < tile.y1; y++) {
+			for (int x = tile.x0; x < tile.x1; x++) {
+				const int i = y * rendered_image.width + x;
+				for (int s = 0; s < rendered_image.pass_samples[i]; s++) {
+					PathState path;
+					path.slot = int(q.paths.size());
+					path.throughput = vec3(1.0f);
+					path.brdf_pdf = 0.0f;
+					q.rays.push(Ray(camera.position, camera.direction(x, y)));
+					q.paths.push_back(path);
+					q.slot_x.push_back(x);
+					q.slot_y.push_back(y);
+					q.slot_sample_index.push_back(uint32_t(rendered_image.sample_count[i] + s));
+				}
+			}
+		}
+		q.radiance.assign(q.paths.size(), vec3(0.0f));
+
+		// One iteration per bounce. Only the paths that survive are compacted
+		// into the queues for the next bounce. 
+		for (int bounce = 0; bounce <= settings.max_bounces && q.rays.size() > 0; bounce++) {
+			if (passCancelled()) return;
+			intersect(q.rays, bounce == 0);
+			shadeBounce(q, bounce, bounce < settings.max_bounces);
+			q.shadows.trace(q.radiance);
+			swap(q.rays, q.next_rays);
+			swap(q.paths, q.next_paths);
+		}
+
+		// Accumulate the radiance of all paths to the image, in the order 
+		// of their sample indices
+		for (size_t slot = 0; slot < q.radiance.size(); slot++) {
+			accumulate(q.slot_x[slot], q.slot_y[slot], q.radiance[slot]);
+		}
+	}
+}
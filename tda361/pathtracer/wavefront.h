@@ -0,0 +1,16 @@
+#pragma once
+#include "Pathtracer.h"
+#include "scheduler.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Trace the paths of this pass for all pixels in a tile (as many per
+	// pixel as rendered_image.pass_samples says), breadth first. All camera
+	// rays of the tile are intersected as one ray stream, then all hits are
+	// shaded, then the shadow rays and the continuation rays of the paths 
+	// that are still alive are traced as new streams, and so on for every 
+	// bounce up to settings.max_bounces. 
+	///////////////////////////////////////////////////////////////////////////
+	void traceTileWavefront(const Tile & tile, const Camera & camera);
+}